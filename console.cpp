@@ -19,12 +19,35 @@
  *
  */
 
+#include "common/algorithm.h"
+#include "common/savefile.h"
+
 #include "gamos/console.h"
+#include "gamos/gamos.h"
+#include "gamos/vm.h"
 
 namespace Gamos {
 
 Console::Console() : GUI::Debugger() {
 	registerCmd("test",   WRAP_METHOD(Console, Cmd_test));
+	registerCmd("vm_pairs", WRAP_METHOD(Console, Cmd_vmPairs));
+	registerCmd("vm_profile", WRAP_METHOD(Console, Cmd_vmProfile));
+	registerCmd("vm_top", WRAP_METHOD(Console, Cmd_vmTop));
+	registerCmd("vm_ops", WRAP_METHOD(Console, Cmd_vmOps));
+	registerCmd("vm_reset", WRAP_METHOD(Console, Cmd_vmReset));
+	registerCmd("vm_calls", WRAP_METHOD(Console, Cmd_vmCalls));
+	registerCmd("vm_contexts", WRAP_METHOD(Console, Cmd_vmContexts));
+	registerCmd("vm_memo", WRAP_METHOD(Console, Cmd_vmMemo));
+	registerCmd("vm_translate", WRAP_METHOD(Console, Cmd_vmTranslate));
+	registerCmd("vm_loops", WRAP_METHOD(Console, Cmd_vmLoops));
+	registerCmd("vm_natives", WRAP_METHOD(Console, Cmd_vmNatives));
+	registerCmd("vm_bench", WRAP_METHOD(Console, Cmd_vmBench));
+	registerCmd("vm_selftest", WRAP_METHOD(Console, Cmd_vmSelfTest));
+	registerCmd("vm_snapshot", WRAP_METHOD(Console, Cmd_vmSnapshot));
+	registerCmd("lzss_bench", WRAP_METHOD(Console, Cmd_lzssBench));
+	registerCmd("prefetch", WRAP_METHOD(Console, Cmd_prefetch));
+	registerCmd("images", WRAP_METHOD(Console, Cmd_images));
+	registerCmd("load_stats", WRAP_METHOD(Console, Cmd_loadStats));
 }
 
 Console::~Console() {
@@ -35,4 +58,532 @@ bool Console::Cmd_test(int argc, const char **argv) {
 	return true;
 }
 
+struct OpPairCount {
+	uint32 count;
+	uint first;
+	uint second;
+};
+
+static bool opPairGreater(const OpPairCount &a, const OpPairCount &b) {
+	return a.count > b.count;
+}
+
+bool Console::Cmd_vmPairs(int argc, const char **argv) {
+	uint limit = 20;
+	if (argc > 1)
+		limit = atoi(argv[1]);
+
+	const VM::CodeCache &cache = g_engine->_vm._codeCache;
+
+	Common::Array<OpPairCount> pairs;
+	for (uint i = 0; i < VM::OP_MAX; i++) {
+		for (uint j = 0; j < VM::OP_MAX; j++) {
+			if (cache._pairCounts[i][j])
+				pairs.push_back({cache._pairCounts[i][j], i, j});
+		}
+	}
+
+	Common::sort(pairs.begin(), pairs.end(), opPairGreater);
+
+	debugPrintf("Decoded %u instructions, %u after fusion\n", cache._decodedCount, cache._fusedCount);
+	debugPrintf("%u basic blocks, %u touch only stack and object storage\n", cache._blockCount, cache._localBlockCount);
+
+	for (uint i = 0; i < pairs.size() && i < limit; i++)
+		debugPrintf("%8u  %-20s %s\n", pairs[i].count, VM::opName(pairs[i].first), VM::opName(pairs[i].second));
+
+	return true;
+}
+
+bool Console::Cmd_vmProfile(int argc, const char **argv) {
+	if (argc > 1) {
+		if (!scumm_stricmp(argv[1], "on")) {
+			g_engine->_vm._profiler._enabled = true;
+		} else if (!scumm_stricmp(argv[1], "off")) {
+			g_engine->_vm._profiler._enabled = false;
+		} else {
+			debugPrintf("Usage: %s [on|off]\n", argv[0]);
+			return true;
+		}
+	}
+
+	debugPrintf("VM profiler is %s\n", g_engine->_vm._profiler._enabled ? "on" : "off");
+	return true;
+}
+
+struct ScriptProfileEntry {
+	uint32 address;
+	VM::ScriptProfile prof;
+};
+
+static bool scriptProfileGreater(const ScriptProfileEntry &a, const ScriptProfileEntry &b) {
+	if (a.prof.time != b.prof.time)
+		return a.prof.time > b.prof.time;
+	return a.prof.instructions > b.prof.instructions;
+}
+
+bool Console::Cmd_vmTop(int argc, const char **argv) {
+	uint limit = 10;
+	bool disasm = true;
+	if (argc > 1)
+		limit = atoi(argv[1]);
+	if (argc > 2 && !scumm_stricmp(argv[2], "nodis"))
+		disasm = false;
+
+	Common::Array<ScriptProfileEntry> scripts;
+	for (Common::HashMap<uint32, VM::ScriptProfile>::const_iterator it = g_engine->_vm._profiler._scripts.begin(); it != g_engine->_vm._profiler._scripts.end(); ++it)
+		scripts.push_back({it->_key, it->_value});
+
+	Common::sort(scripts.begin(), scripts.end(), scriptProfileGreater);
+
+	debugPrintf("%u scripts profiled\n", scripts.size());
+	debugPrintf("  address     calls   instructions   ms\n");
+
+	for (uint i = 0; i < scripts.size() && i < limit; i++) {
+		const ScriptProfileEntry &e = scripts[i];
+		debugPrintf("%08x %9u %14llu %6u\n", e.address, e.prof.calls, (unsigned long long)e.prof.instructions, e.prof.time);
+		if (disasm)
+			debugPrintf("%s\n", g_engine->_vm.disassembly(e.address).c_str());
+	}
+
+	return true;
+}
+
+struct OpCountEntry {
+	uint64 count;
+	uint op;
+};
+
+static bool opCountGreater(const OpCountEntry &a, const OpCountEntry &b) {
+	return a.count > b.count;
+}
+
+bool Console::Cmd_vmOps(int argc, const char **argv) {
+	Common::Array<OpCountEntry> ops;
+	uint64 total = 0;
+	for (uint i = 0; i < VM::IOP_MAX; i++) {
+		if (g_engine->_vm._profiler._opCounts[i]) {
+			ops.push_back({g_engine->_vm._profiler._opCounts[i], i});
+			total += g_engine->_vm._profiler._opCounts[i];
+		}
+	}
+
+	Common::sort(ops.begin(), ops.end(), opCountGreater);
+
+	debugPrintf("%llu instructions dispatched\n", (unsigned long long)total);
+
+	for (uint i = 0; i < ops.size(); i++)
+		debugPrintf("%14llu  %s\n", (unsigned long long)ops[i].count, VM::iopName(ops[i].op));
+
+	return true;
+}
+
+bool Console::Cmd_vmReset(int argc, const char **argv) {
+	g_engine->_vm._profiler.reset();
+	debugPrintf("VM profile cleared\n");
+	return true;
+}
+
+struct VMCallEntry {
+	uint id;
+	VMCallStats stats;
+};
+
+static bool vmCallGreater(const VMCallEntry &a, const VMCallEntry &b) {
+	if (a.stats.totalTime != b.stats.totalTime)
+		return a.stats.totalTime > b.stats.totalTime;
+	return a.stats.calls > b.stats.calls;
+}
+
+bool Console::Cmd_vmCalls(int argc, const char **argv) {
+	if (argc > 1) {
+		if (!scumm_stricmp(argv[1], "on")) {
+			g_engine->_vmCallTiming = true;
+		} else if (!scumm_stricmp(argv[1], "off")) {
+			g_engine->_vmCallTiming = false;
+		} else if (!scumm_stricmp(argv[1], "reset")) {
+			g_engine->resetVMCallStats();
+		} else {
+			debugPrintf("Usage: %s [on|off|reset]\n", argv[0]);
+			return true;
+		}
+	}
+
+	debugPrintf("Call timing is %s\n", g_engine->_vmCallTiming ? "on" : "off");
+
+	Common::Array<VMCallEntry> calls;
+	for (uint i = 0; i < GamosEngine::VMCALL_COUNT; i++) {
+		if (g_engine->_vmCallStats[i].calls)
+			calls.push_back({i, g_engine->_vmCallStats[i]});
+	}
+
+	Common::sort(calls.begin(), calls.end(), vmCallGreater);
+
+	if (!calls.empty())
+		debugPrintf(" id  name                   calls    total ms  avg us  max ms  batches of %u by us per call (<16, 16-31, 32-63 ...)\n", (uint)VMCallStats::BATCH_CALLS);
+
+	for (uint i = 0; i < calls.size(); i++) {
+		const VMCallStats &st = calls[i].stats;
+		const char *name = GamosEngine::vmCallName(calls[i].id);
+
+		Common::String hist;
+		for (uint j = 0; j < VMCallStats::HIST_BUCKETS; j++)
+			hist += Common::String::format(" %u", st.histogram[j]);
+
+		const uint32 avg = (uint32)((uint64)st.totalTime * 1000 / st.calls);
+		debugPrintf("%3u  %-20s %8u %10u %7u %7u %s\n", calls[i].id, name ? name : "", st.calls, st.totalTime, avg, st.maxTime, hist.c_str());
+	}
+
+	for (Common::HashMap<uint32, uint32>::const_iterator it = g_engine->_vmCallUnknown.begin(); it != g_engine->_vmCallUnknown.end(); ++it)
+		debugPrintf("Unimplemented call %u: %u times\n", it->_key, it->_value);
+
+	return true;
+}
+
+bool Console::Cmd_vmContexts(int argc, const char **argv) {
+	VM::ContextPool &pool = g_engine->_vm._threads;
+
+	if (argc > 1 && !scumm_stricmp(argv[1], "reset"))
+		pool._maxDepth = pool._depth;
+
+	debugPrintf("%u contexts allocated, depth %u, max depth %u\n", pool._contexts.size(), pool._depth, pool._maxDepth);
+	return true;
+}
+
+bool Console::Cmd_vmMemo(int argc, const char **argv) {
+	VM::ConditionMemo &memo = g_engine->_vm._conditionMemo;
+
+	if (argc > 1) {
+		if (!scumm_stricmp(argv[1], "on"))
+			memo._enabled = true;
+		else if (!scumm_stricmp(argv[1], "off"))
+			memo._enabled = false;
+		else if (!scumm_stricmp(argv[1], "reset"))
+			memo.reset();
+	}
+
+	uint pure = 0;
+	for (Common::HashMap<uint32, VM::MemoEntry>::const_iterator it = memo._scripts.begin(); it != memo._scripts.end(); ++it) {
+		if (it->_value.pure)
+			pure++;
+	}
+
+	debugPrintf("Condition memo %s, %u of %u scripts are pure\n", memo._enabled ? "on" : "off", pure, memo._scripts.size());
+	debugPrintf("%u hits, %u misses, %u impure calls, %u invalidations\n", memo._hits, memo._misses, memo._uncached, memo._invalidations);
+	return true;
+}
+
+bool Console::Cmd_vmTranslate(int argc, const char **argv) {
+	if (argc < 2) {
+		debugPrintf("Usage: %s <file>\n", argv[0]);
+		debugPrintf("Translates scripts of loaded module to C++ for native_scripts.cpp\n");
+		return true;
+	}
+
+	Common::Array<int32> scripts;
+	for (const ObjectAction &obj : g_engine->_objectActions) {
+		scripts.push_back(obj.onCreateAddress);
+		scripts.push_back(obj.onDeleteAddress);
+		for (const Actions &act : obj.actions) {
+			scripts.push_back(act.conditionAddress);
+			scripts.push_back(act.functionAddress);
+		}
+	}
+	for (const Actions &act : g_engine->_subtitleActions) {
+		scripts.push_back(act.conditionAddress);
+		scripts.push_back(act.functionAddress);
+	}
+
+	Common::HashMap<uint32, bool> seen;
+	Common::HashMap<uint32, bool> hashes;
+	Common::String funcs;
+	Common::String table;
+	uint translated = 0;
+	uint skipped = 0;
+
+	for (int32 address : scripts) {
+		if (address < 0 || seen.contains(address))
+			continue;
+		seen[address] = true;
+
+		Common::String code;
+		VM::NativeEntry entry;
+		if (!VM::translateScript(g_engine->_vm.memory(), address, code, entry)) {
+			skipped++;
+			continue;
+		}
+
+		/* same script in several objects */
+		if (hashes.contains(entry.hash))
+			continue;
+		hashes[entry.hash] = true;
+
+		funcs += code + "\n";
+		table += Common::String::format("\t{ 0x%08x, 0x%x, code_%08x_%x, native_%08x_%x, nullptr },\n", entry.hash, entry.size,
+		                                entry.hash, entry.size, entry.hash, entry.size);
+		translated++;
+	}
+
+	Common::DumpFile f;
+	if (!f.open(argv[1], true)) {
+		debugPrintf("Can't create %s\n", argv[1]);
+		return true;
+	}
+
+	f.writeString(funcs);
+	f.writeString("/* VM::_nativeScripts entries */\n");
+	f.writeString(table);
+	f.flush();
+	f.close();
+
+	debugPrintf("%u scripts translated, %u left to interpreter\n", translated, skipped);
+	return true;
+}
+
+bool Console::Cmd_vmLoops(int argc, const char **argv) {
+	const VM::CodeCache &cache = g_engine->_vm._codeCache;
+
+	uint64 iterations = 0;
+	for (const VM::LoopIdiom *loop : cache._loops) {
+		debugPrintf("%08x  %-8s %3u ops  %8u hits %10u iterations\n", loop->header, VM::loopKindName(loop->kind),
+		            loop->ops, loop->hits, (uint32)loop->iterations);
+		iterations += loop->iterations;
+	}
+
+	debugPrintf("%u loops recognised, %u iterations done in bulk\n", cache._loops.size(), (uint32)iterations);
+	return true;
+}
+
+bool Console::Cmd_vmNatives(int argc, const char **argv) {
+	VM::NativeRegistry &natives = g_engine->_vm._natives;
+
+	if (argc > 1) {
+		if (!scumm_stricmp(argv[1], "on"))
+			natives._enabled = true;
+		else if (!scumm_stricmp(argv[1], "off"))
+			natives._enabled = false;
+		else if (!scumm_stricmp(argv[1], "validate"))
+			natives._validate = argc < 3 || scumm_stricmp(argv[2], "off");
+		else if (!scumm_stricmp(argv[1], "reset"))
+			natives.resetStats();
+	}
+
+	uint hit = 0;
+	for (const VM::NativeInfo &info : natives._natives) {
+		if (!info.calls)
+			continue;
+
+		debugPrintf("%08x %5x  %-24s %8u calls %8u checked %4u mismatches\n", info.entry->hash, info.entry->size,
+		            info.entry->name ? info.entry->name : "(translated)", info.calls, info.checked, info.mismatches);
+		hit++;
+	}
+
+	debugPrintf("Natives %s, validation %s, %u of %u registered hit\n", natives._enabled ? "on" : "off",
+	            natives._validate ? "on" : "off", hit, natives._natives.size());
+	return true;
+}
+
+bool Console::Cmd_vmBench(int argc, const char **argv) {
+	uint passes = 10;
+	if (argc > 1)
+		passes = MAX(atoi(argv[1]), 1);
+
+	/* scripts write VM memory, game goes on from state before benchmark */
+	VM::MemSnapshot snap;
+	g_engine->_vm.memory().takeSnapshot(snap);
+
+	VMBenchStats st;
+	st.module = g_engine->_currentModuleID;
+	g_engine->benchmarkScripts(passes, st);
+
+	g_engine->_vm.memory().restoreSnapshot(snap);
+
+	debugPrintf("%s\n%s\n", GamosEngine::benchHeader(), GamosEngine::formatBenchStats(st).c_str());
+	return true;
+}
+
+bool Console::Cmd_vmSelfTest(int argc, const char **argv) {
+	const uint failed = VM::selfTest();
+	if (failed)
+		debugPrintf("VM self test: %u scripts differ from interpreter\n", failed);
+	else
+		debugPrintf("VM self test passed\n");
+	return true;
+}
+
+/* Saves VM memory to savefile or puts saved memory back, for going back
+   to same game state while debugging scripts */
+bool Console::Cmd_vmSnapshot(int argc, const char **argv) {
+	if (argc < 3 || (scumm_stricmp(argv[1], "save") && scumm_stricmp(argv[1], "load"))) {
+		debugPrintf("Usage: %s save|load <file>\n", argv[0]);
+		return true;
+	}
+
+	Common::SaveFileManager *sm = g_system->getSavefileManager();
+	VM::MemAccess &mem = g_engine->_vm.memory();
+	VM::MemSnapshot snap;
+
+	if (!scumm_stricmp(argv[1], "save")) {
+		Common::OutSaveFile *out = sm->openForSaving(argv[2], false);
+		if (!out) {
+			debugPrintf("Can't create %s\n", argv[2]);
+			return true;
+		}
+
+		mem.takeSnapshot(snap);
+		out->writeUint32LE(g_engine->_currentModuleID);
+		snap.save(out);
+		out->finalize();
+
+		if (out->err())
+			debugPrintf("Error writing %s\n", argv[2]);
+		else
+			debugPrintf("VM memory saved to %s\n", argv[2]);
+		delete out;
+		return true;
+	}
+
+	Common::InSaveFile *in = sm->openForLoading(argv[2]);
+	if (!in) {
+		debugPrintf("Can't open %s\n", argv[2]);
+		return true;
+	}
+
+	/* addresses only mean the same within one module */
+	const int module = in->readUint32LE();
+	if (module != g_engine->_currentModuleID) {
+		debugPrintf("%s holds memory of module %d, current is %d\n", argv[2], module, g_engine->_currentModuleID);
+	} else if (!snap.load(&mem, in)) {
+		debugPrintf("%s is not a VM memory snapshot\n", argv[2]);
+	} else {
+		mem.restoreSnapshot(snap);
+		debugPrintf("VM memory restored from %s\n", argv[2]);
+	}
+
+	delete in;
+	return true;
+}
+
+struct LzssSample {
+	RawData packed;
+	uint32 size;
+};
+
+bool Console::Cmd_lzssBench(int argc, const char **argv) {
+	uint passes = 10;
+	if (argc > 1)
+		passes = MAX(atoi(argv[1]), 1);
+
+	Archive &arch = g_engine->_arch;
+	Common::Array<LzssSample> samples;
+
+	/* packed sprites loaded on demand and backgrounds of loaded module */
+	for (const Image *img : g_engine->_images) {
+		if (img->offset < 0 || img->cSize <= 0)
+			continue;
+
+		LzssSample smp;
+		smp.size = (img->surface.w * img->surface.h + 4 + 16) & ~0xf;
+		smp.packed.resize(img->cSize);
+		arch.seek(img->offset, SEEK_SET);
+		arch.read(smp.packed.data(), img->cSize);
+		samples.push_back(smp);
+	}
+
+	for (const GameScreen &gs : g_engine->_gameScreens) {
+		RawData data;
+		if (!gs.loaded || !arch.seek(gs.offset, SEEK_SET) || !arch.readCompressedData(&data) || !arch._lastReadDecompressedSize)
+			continue;
+
+		LzssSample smp;
+		smp.size = arch._lastReadDecompressedSize;
+		smp.packed.resize(arch._lastReadSize);
+		arch.seek(arch._lastReadDataOffset, SEEK_SET);
+		arch.read(smp.packed.data(), arch._lastReadSize);
+		samples.push_back(smp);
+	}
+
+	if (samples.empty()) {
+		debugPrintf("No packed resources in loaded module\n");
+		return true;
+	}
+
+	uint64 bytes = 0;
+	for (const LzssSample &smp : samples)
+		bytes += smp.size;
+
+	RawData out;
+	const uint32 startTime = g_system->getMillis();
+	for (uint i = 0; i < passes; i++) {
+		for (const LzssSample &smp : samples) {
+			out.resize(smp.size);
+			Archive::decompress(smp.packed.data(), smp.packed.size(), &out);
+		}
+	}
+	const uint32 time = MAX<uint32>(g_system->getMillis() - startTime, 1);
+
+	const double mb = (double)bytes * passes / (1024.0 * 1024.0);
+	debugPrintf("%u resources, %u KB unpacked, %u passes\n", samples.size(), (uint32)(bytes / 1024), passes);
+	debugPrintf("%u ms, %.1f MB/s\n", time, mb * 1000.0 / time);
+	return true;
+}
+
+bool Console::Cmd_prefetch(int argc, const char **argv) {
+	PrefetchStats &st = g_engine->_prefetch._stats;
+
+	if (argc > 1 && !strcmp(argv[1], "reset")) {
+		st = PrefetchStats();
+		debugPrintf("Prefetch stats cleared\n");
+		return true;
+	}
+
+	const uint32 queuedDraws = st.hits + st.misses;
+	debugPrintf("worker %s\n", g_engine->_prefetch.isRunning() ? "running" : "stopped");
+	debugPrintf("queued %u, decoded %u, dropped %u, over budget %u\n", st.queued, st.decoded, st.dropped, st.overBudget);
+	debugPrintf("hits %u, misses %u, hit rate %.1f%%\n", st.hits, st.misses, queuedDraws ? st.hits * 100.0 / queuedDraws : 0.0);
+	debugPrintf("miss stall %u ms (%.2f ms/miss)\n", st.stallTime, st.misses ? (double)st.stallTime / st.misses : 0.0);
+	debugPrintf("cold loads %u, %u ms\n", st.cold, st.coldTime);
+	return true;
+}
+
+bool Console::Cmd_images(int argc, const char **argv) {
+	ImageResidency &res = g_engine->_residency;
+	ResidencyStats &st = res._stats;
+
+	if (argc > 1) {
+		if (!strcmp(argv[1], "reset")) {
+			st.hits = st.misses = st.evictions = 0;
+			st.evictedBytes = 0;
+			st.peakBytes = st.residentBytes;
+			debugPrintf("Image residency stats cleared\n");
+		} else {
+			res.setBudget((uint64)MAX(atoi(argv[1]), 0) * 1024);
+			debugPrintf("Image budget set to %u KB\n", (uint32)(res.getBudget() / 1024));
+		}
+		return true;
+	}
+
+	if (res.getBudget())
+		debugPrintf("budget %u KB\n", (uint32)(res.getBudget() / 1024));
+	else
+		debugPrintf("budget unlimited\n");
+
+	const uint32 draws = st.hits + st.misses;
+	debugPrintf("resident %u images, %u KB (peak %u KB)\n", st.resident, (uint32)(st.residentBytes / 1024), (uint32)(st.peakBytes / 1024));
+	debugPrintf("hits %u, misses %u, hit rate %.1f%%\n", st.hits, st.misses, draws ? st.hits * 100.0 / draws : 0.0);
+	debugPrintf("evictions %u, %u KB\n", st.evictions, (uint32)(st.evictedBytes / 1024));
+	return true;
+}
+
+bool Console::Cmd_loadStats(int argc, const char **argv) {
+	debugPrintf("%s", g_engine->formatLoadStats().c_str());
+
+	if (argc > 1) {
+		if (g_engine->appendLoadStats(argv[1]))
+			debugPrintf("Appended to %s\n", argv[1]);
+		else
+			debugPrintf("Failed to write %s\n", argv[1]);
+	}
+	return true;
+}
+
 } // End of namespace Gamos
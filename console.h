@@ -30,6 +30,24 @@ namespace Gamos {
 class Console : public GUI::Debugger {
 private:
 	bool Cmd_test(int argc, const char **argv);
+	bool Cmd_vmPairs(int argc, const char **argv);
+	bool Cmd_vmProfile(int argc, const char **argv);
+	bool Cmd_vmTop(int argc, const char **argv);
+	bool Cmd_vmOps(int argc, const char **argv);
+	bool Cmd_vmReset(int argc, const char **argv);
+	bool Cmd_vmCalls(int argc, const char **argv);
+	bool Cmd_vmContexts(int argc, const char **argv);
+	bool Cmd_vmMemo(int argc, const char **argv);
+	bool Cmd_vmTranslate(int argc, const char **argv);
+	bool Cmd_vmLoops(int argc, const char **argv);
+	bool Cmd_vmNatives(int argc, const char **argv);
+	bool Cmd_vmBench(int argc, const char **argv);
+	bool Cmd_vmSelfTest(int argc, const char **argv);
+	bool Cmd_vmSnapshot(int argc, const char **argv);
+	bool Cmd_lzssBench(int argc, const char **argv);
+	bool Cmd_prefetch(int argc, const char **argv);
+	bool Cmd_images(int argc, const char **argv);
+	bool Cmd_loadStats(int argc, const char **argv);
 public:
 	Console();
 	~Console() override;
@@ -20,6 +20,10 @@
  */
 
 #include "gamos/gamos.h"
+#include "gamos/filemap.h"
+
+#include "common/config-manager.h"
+#include "common/fs.h"
 
 namespace Gamos {
 
@@ -27,14 +31,25 @@ Archive::Archive() {
 };
 
 Archive::~Archive() {
+	unmapFile();
 };
 
 bool Archive::open(const Common::Path &name) {
-	bool res = File::open(name);
+	close();
+
+	/* File in game directory is opened through its node, so the map is of
+	   the very file the stream reads. Found elsewhere it's only streamed. */
+	const Common::FSNode node = Common::FSNode(ConfMan.getPath("path")).getChild(name.baseName());
+	const bool inGameDir = node.exists() && !node.isDirectory();
+
+	bool res = inGameDir ? File::open(node) : File::open(name);
 
 	if (!res)
 		return false;
 
+	if (!inGameDir || !mapFile(node))
+		debug("Archive %s is read through stream", name.toString().c_str());
+
 	seek(-12, SEEK_END);
 
 	_dirOffset = 12 + readUint32LE();
@@ -60,9 +75,122 @@ bool Archive::open(const Common::Path &name) {
 		dir.id = readByte();
 	}
 
+	/* directory table and trailer change with any change of data layout */
+	seek(-(_dirOffset + _dirCount * 5), SEEK_END);
+
+	_hash = 2166136261u;
+	byte buf[256];
+	uint32 count;
+	while ((count = read(buf, sizeof(buf))) > 0) {
+		for (uint32 i = 0; i < count; ++i)
+			_hash = (_hash ^ buf[i]) * 16777619u;
+	}
+
 	return true;
 }
 
+void Archive::close() {
+	unmapFile();
+	File::close();
+}
+
+bool Archive::mapFile(const Common::FSNode &node) {
+	uint32 size;
+	const byte *map = mapFileNode(node, size);
+	if (!map)
+		return false;
+
+	/* file could be replaced between open and map */
+	if (size != File::size() || !sameAsStream(map, size)) {
+		warning("Archive %s changed while opening, reading it through stream", node.getPath().toString().c_str());
+		unmapFileData(map, size);
+		return false;
+	}
+
+	_map = map;
+	_mapSize = size;
+	_mapPos = 0;
+	_mapEos = false;
+	return true;
+}
+
+/* Compares head and tail of map with what stream reads there, tail holds
+   directory and trailer. Stream position is kept. */
+bool Archive::sameAsStream(const byte *map, uint32 size) {
+	const int64 pos = File::pos();
+	const uint32 count = MIN<uint32>(size, STREAM_WINDOW);
+	byte buf[STREAM_WINDOW];
+
+	bool same = File::seek(0, SEEK_SET) && File::read(buf, count) == count && !memcmp(buf, map, count);
+	same = same && File::seek(size - count, SEEK_SET) && File::read(buf, count) == count && !memcmp(buf, map + size - count, count);
+
+	File::seek(pos, SEEK_SET);
+	return same;
+}
+
+void Archive::unmapFile() {
+	if (!_map)
+		return;
+
+	unmapFileData(_map, _mapSize);
+	_map = nullptr;
+	_mapSize = 0;
+	_mapPos = 0;
+	_mapEos = false;
+}
+
+const byte *Archive::mappedData(uint32 offset, uint32 count) const {
+	if (!_map || offset > _mapSize || count > _mapSize - offset)
+		return nullptr;
+	return _map + offset;
+}
+
+uint32 Archive::read(void *dataPtr, uint32 dataSize) {
+	if (!_map)
+		return File::read(dataPtr, dataSize);
+
+	const uint32 count = MIN(dataSize, _mapSize - _mapPos);
+	memcpy(dataPtr, _map + _mapPos, count);
+	_mapPos += count;
+
+	if (count < dataSize)
+		_mapEos = true;
+	return count;
+}
+
+int64 Archive::pos() const {
+	if (!_map)
+		return File::pos();
+	return _mapPos;
+}
+
+bool Archive::seek(int64 offset, int whence) {
+	if (!_map)
+		return File::seek(offset, whence);
+
+	if (whence == SEEK_CUR)
+		offset += _mapPos;
+	else if (whence == SEEK_END)
+		offset += _mapSize;
+
+	if (offset < 0 || offset > _mapSize)
+		return false;
+
+	_mapPos = offset;
+	_mapEos = false;
+	return true;
+}
+
+bool Archive::skip(uint32 offset) {
+	return seek(offset, SEEK_CUR);
+}
+
+bool Archive::eos() const {
+	if (!_map)
+		return File::eos();
+	return _mapEos;
+}
+
 bool Archive::seekDir(uint id) {
 	int16 idx = findDirByID(id);
 	if (idx < 0)
@@ -117,6 +245,74 @@ int32 Archive::readPackedInt() {
 	return val;
 }
 
+enum {
+	RESINDEX_MAGIC = 0x58444947,   /* GIDX */
+	RESINDEX_VERSION = 1
+};
+
+bool ResIndex::load(Common::SeekableReadStream *stream) {
+	modules.clear();
+
+	if (stream->readUint32LE() != RESINDEX_MAGIC || stream->readUint32LE() != RESINDEX_VERSION)
+		return false;
+
+	archiveSize = stream->readUint32LE();
+	archiveHash = stream->readUint32LE();
+
+	const uint32 count = stream->readUint32LE();
+	for (uint32 i = 0; i < count && !stream->eos(); ++i) {
+		const uint32 id = stream->readUint32LE();
+		const uint32 entries = stream->readUint32LE();
+
+		ResIndexModule &mod = modules[id];
+		for (uint32 j = 0; j < entries && !stream->eos(); ++j) {
+			ResIndexEntry e;
+			e.kind = stream->readByte();
+			e.type = stream->readByte();
+			e.pid = stream->readSint32LE();
+			e.p1 = stream->readSint32LE();
+			e.p2 = stream->readSint32LE();
+			e.p3 = stream->readSint32LE();
+			e.offset = stream->readUint32LE();
+			e.size = stream->readUint32LE();
+			e.unpackedSize = stream->readUint32LE();
+			mod.push_back(e);
+		}
+	}
+
+	if (stream->eos() || stream->err()) {
+		modules.clear();
+		return false;
+	}
+
+	return true;
+}
+
+void ResIndex::save(Common::WriteStream *stream) const {
+	stream->writeUint32LE(RESINDEX_MAGIC);
+	stream->writeUint32LE(RESINDEX_VERSION);
+	stream->writeUint32LE(archiveSize);
+	stream->writeUint32LE(archiveHash);
+	stream->writeUint32LE(modules.size());
+
+	for (Common::HashMap<uint32, ResIndexModule>::const_iterator it = modules.begin(); it != modules.end(); ++it) {
+		stream->writeUint32LE(it->_key);
+		stream->writeUint32LE(it->_value.size());
+
+		for (const ResIndexEntry &e : it->_value) {
+			stream->writeByte(e.kind);
+			stream->writeByte(e.type);
+			stream->writeSint32LE(e.pid);
+			stream->writeSint32LE(e.p1);
+			stream->writeSint32LE(e.p2);
+			stream->writeSint32LE(e.p3);
+			stream->writeUint32LE(e.offset);
+			stream->writeUint32LE(e.size);
+			stream->writeUint32LE(e.unpackedSize);
+		}
+	}
+}
+
 RawData *Archive::readCompressedData() {
 	RawData *data = new RawData();
 	if (!readCompressedData(data)) {
@@ -126,7 +322,7 @@ RawData *Archive::readCompressedData() {
 	return data;
 }
 
-bool Archive::readCompressedData(RawData *out) {
+bool Archive::readDataHeader() {
 	const byte t = readByte();
 	if ((t & 0x80) == 0)
 		return false;
@@ -152,58 +348,324 @@ bool Archive::readCompressedData(RawData *out) {
 		}
 	}
 
-	if (!_lastReadSize)
+	return _lastReadSize != 0;
+}
+
+bool Archive::readCompressedData(RawData *out) {
+	ScopedLoadTimer timer(_readTime);
+	const int64 hdrOffset = _decoded ? pos() : -1;
+	if (!readDataHeader())
+		return false;
+
+	_lastReadDataOffset = pos();
+	if (takeDecoded(hdrOffset, out))
+		return true;
+
+	out->resize(_lastReadDecompressedSize ? _lastReadDecompressedSize : _lastReadSize);
+	readPayload(out->data(), out->size());
+	return true;
+}
+
+bool Archive::readCompressedData(ResData *out) {
+	ScopedLoadTimer timer(_readTime);
+	const int64 hdrOffset = _decoded ? pos() : -1;
+	if (!readDataHeader())
 		return false;
 
 	_lastReadDataOffset = pos();
-	out->resize(_lastReadSize);
-	read(out->data(), _lastReadSize);
+	if (takeDecoded(hdrOffset, &out->buffer)) {
+		out->ptr = out->buffer.data();
+		out->len = out->buffer.size();
+		return true;
+	}
 
-	if (!_lastReadDecompressedSize)
+	const byte *mapped = mappedData(_lastReadDataOffset, _lastReadSize);
+	if (mapped && !_lastReadDecompressedSize) {
+		skip(_lastReadSize);
+		out->buffer.clear();
+		out->ptr = mapped;
+		out->len = _lastReadSize;
 		return true;
+	}
 
-	/* looks hacky but we just allocate array for decompressed and swap it with compressed */
-	RawData compressed(_lastReadDecompressedSize);
-	out->swap(compressed);
+	out->buffer.resize(_lastReadDecompressedSize ? _lastReadDecompressedSize : _lastReadSize);
+	readPayload(out->buffer.data(), out->buffer.size());
 
-	decompress(&compressed, out);
+	out->ptr = out->buffer.data();
+	out->len = out->buffer.size();
+	return true;
+}
+
+bool Archive::skipCompressedData() {
+	if (!readDataHeader())
+		return false;
+
+	_lastReadDataOffset = pos();
+	return skip(_lastReadSize);
+}
+
+bool Archive::checkDataHeader(uint32 hdrOffset, uint32 size, uint32 unpackedSize) {
+	const int64 oldPos = pos();
+	const bool ok = seek(hdrOffset, SEEK_SET) && readDataHeader() &&
+	                _lastReadSize == size && _lastReadDecompressedSize == unpackedSize;
+	seek(oldPos, SEEK_SET);
+	return ok;
+}
+
+bool Archive::takeDecoded(int64 hdrOffset, RawData *out) {
+	if (!_decoded || (int64)_decodedOffset != hdrOffset)
+		return false;
+
+	RawData *data = _decoded;
+	_decoded = nullptr;
+
+	if (!_lastReadDecompressedSize || data->size() != _lastReadDecompressedSize)
+		return false;
+
+	out->swap(*data);
+	skip(_lastReadSize);
+	return true;
+}
+
+const byte *Archive::mappedPayload(uint32 hdrOffset, uint32 size) const {
+	const byte *hdr = mappedData(hdrOffset, 1);
+	if (!hdr || !(hdr[0] & 0x80))
+		return nullptr;
+
+	/* see readDataHeader, packed data has both sizes in header */
+	uint32 hdrSize = 1;
+	if (!(hdr[0] & 0x40))
+		hdrSize += ((hdr[0] & 3) + 1) * ((hdr[0] & 0xC) ? 2 : 1);
+
+	return mappedData(hdrOffset + hdrSize, size);
+}
+
+void Archive::readPayload(byte *out, uint32 outSize) {
+	if (!_lastReadDecompressedSize) {
+		read(out, MIN(_lastReadSize, outSize));
+		return;
+	}
+
+	ScopedLoadTimer timer(_decompressTime);
+
+	const byte *mapped = mappedData(pos(), _lastReadSize);
+	if (mapped) {
+		decompress(mapped, _lastReadSize, out, outSize);
+		skip(_lastReadSize);
+	} else {
+		decompress(this, _lastReadSize, out, outSize);
+	}
+}
+
+bool Archive::readAt(uint32 offset, uint32 inSize, bool packed, byte *out, uint32 outSize) {
+	const byte *mapped = mappedData(offset, inSize);
+	if (mapped) {
+		if (packed)
+			decompress(mapped, inSize, out, outSize);
+		else
+			memcpy(out, mapped, MIN(inSize, outSize));
+		return true;
+	}
+
+	if (!seek(offset, SEEK_SET))
+		return false;
+
+	if (packed)
+		decompress(this, inSize, out, outSize);
+	else
+		read(out, MIN(inSize, outSize));
 	return true;
 }
 
 void Archive::decompress(RawData const *in, RawData *out) {
-	uint pos = 0;
-	uint outPos = 0;
+	decompress(in->data(), in->size(), out->data(), out->size());
+}
+
+void Archive::decompress(const byte *in, uint32 inSize, RawData *out) {
+	decompress(in, inSize, out->data(), out->size());
+}
+
+namespace {
+
+/* Output side of LZSS decoding, kept between pieces of streamed input */
+struct LzssOutput {
+	byte *dst;
+	uint32 size;
+	uint32 pos;
+	bool done;
+};
+
+/* LZSS: control byte holds 8 flags, low bit first. Set flag is literal
+   byte, clear one is 2 byte back reference of 3..18 bytes at distance up
+   to 4095. Output is written into out.dst and never past its end.
+
+   Decodes groups of in and returns number of bytes used. Unless last is
+   set it stops before group which is not complete in input, so rest can
+   be passed again with more data appended. */
+uint32 lzssDecode(LzssOutput &out, const byte *in, uint32 inSize, bool last) {
+	byte *dst = out.dst;
+	const uint32 outSize = out.size;
+	uint32 outPos = out.pos;
+	uint32 pos = 0;
+
+	/* Fast path over whole groups while input and output are far from their
+	   ends. Group takes at most 17 bytes and gives at most 144, copies may
+	   write up to 14 bytes past reference and input left after group is
+	   enough to overwrite them. */
+	while (pos + 17 + 36 <= inSize && outPos + 144 + 16 <= outSize) {
+		byte ctrlBits = in[pos];
+		pos++;
+
+		if (ctrlBits == 0xff) {
+			memcpy(dst + outPos, in + pos, 8);
+			pos += 8;
+			outPos += 8;
+			continue;
+		}
+
+		for (int bitsLeft = 8; bitsLeft > 0; --bitsLeft) {
+			if (ctrlBits & 1) {
+				dst[outPos] = in[pos];
+				outPos++;
+				pos++;
+			} else {
+				const byte b1 = in[pos];
+				const byte b2 = in[pos + 1];
+				pos += 2;
+
+				const uint32 num = (b2 & 0xF) + 3;
+				const uint32 distance = b1 | ((b2 & 0xF0) << 4);
+
+				if (distance == 0 || distance > outPos) {
+					warning("Archive::decompress: bad reference %u at %u", distance, outPos);
+					out.pos = outPos;
+					out.done = true;
+					return pos;
+				}
+
+				byte *d = dst + outPos;
+				const byte *s = d - distance;
+
+				if (distance >= 16) {
+					memcpy(d, s, 16);
+					if (num > 16)
+						memcpy(d + 16, s + 16, 16);
+				} else if (distance >= 8) {
+					for (uint32 i = 0; i < num; i += 8)
+						memcpy(d + i, s + i, 8);
+				} else {
+					for (uint32 i = 0; i < num; ++i)
+						d[i] = s[i];
+				}
+
+				outPos += num;
+			}
+
+			ctrlBits >>= 1;
+		}
+	}
+
+	/* Tail, byte by byte with bounds checks */
+	while (pos < inSize) {
+		byte ctrlBits = in[pos];
+
+		if (!last) {
+			/* control byte, then 1 byte per literal and 2 per reference */
+			uint32 groupSize = 1;
+			for (int i = 0; i < 8; i++)
+				groupSize += ((ctrlBits >> i) & 1) ? 1 : 2;
+
+			if (pos + groupSize > inSize)
+				break;
+		}
 
-	while (pos < in->size()) {
-		byte ctrlBits = (*in)[pos];
 		pos++;
 
 		for (int bitsLeft = 8; bitsLeft > 0; --bitsLeft) {
-			if (pos >= in->size())
-				return;
+			if (pos >= inSize) {
+				out.done = true;
+				break;
+			}
 
 			if (ctrlBits & 1) {
-				(*out)[outPos] = (*in)[pos];
+				if (outPos >= outSize) {
+					out.done = true;
+					break;
+				}
+
+				dst[outPos] = in[pos];
 				outPos++;
 				pos++;
 			} else {
-				byte b1 = (*in)[pos];
-				byte b2 = (*in)[pos + 1];
+				if (pos + 1 >= inSize) {
+					out.done = true;
+					break;
+				}
+
+				const byte b1 = in[pos];
+				const byte b2 = in[pos + 1];
 				pos += 2;
 
-				byte num = (b2 & 0xF) + 3;
-				uint16 distance = b1 | ((b2 & 0xF0) << 4);
+				const uint32 num = (b2 & 0xF) + 3;
+				const uint32 distance = b1 | ((b2 & 0xF0) << 4);
+
+				if (distance == 0 || distance > outPos) {
+					warning("Archive::decompress: bad reference %u at %u", distance, outPos);
+					out.done = true;
+					break;
+				}
 
-				for (int i = 0; i < num; ++i) {
-					(*out)[outPos] = (*out)[outPos - distance];
+				for (uint32 i = 0; i < num && outPos < outSize; ++i) {
+					dst[outPos] = dst[outPos - distance];
 					outPos++;
 				}
 			}
 
 			ctrlBits >>= 1;
 		}
+
+		if (out.done)
+			break;
 	}
+
+	out.pos = outPos;
+	return pos;
+}
+
+} // End of anonymous namespace
+
+uint32 Archive::decompress(const byte *in, uint32 inSize, byte *out, uint32 outSize) {
+	LzssOutput lz = {out, outSize, 0, false};
+	lzssDecode(lz, in, inSize, true);
+	return lz.pos;
 }
 
+uint32 Archive::decompress(Common::SeekableReadStream *in, uint32 inSize, byte *out, uint32 outSize) {
+	byte window[STREAM_WINDOW];
+	LzssOutput lz = {out, outSize, 0, false};
+	uint32 left = inSize;
+	uint32 avail = 0;
+
+	while (!lz.done) {
+		const uint32 want = MIN<uint32>(left, STREAM_WINDOW - avail);
+		const uint32 got = in->read(window + avail, want);
+		avail += got;
+		left = (got == want) ? left - got : 0;
+
+		const uint32 used = lzssDecode(lz, window, avail, left == 0);
+		if (left == 0)
+			break;
+
+		/* incomplete group goes to window start */
+		avail -= used;
+		memmove(window, window + used, avail);
+	}
+
+	/* leave stream after packed data when output filled up early */
+	if (left)
+		in->skip(left);
+
+	return lz.pos;
+}
 
 }
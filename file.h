@@ -23,21 +23,109 @@
 #define GAMOS_FILE_H
 
 #include "common/file.h"
+#include "common/hashmap.h"
 
 namespace Gamos {
 
 typedef Common::Array<byte> RawData;
 
+/* Resource read from archive. Stored uncompressed in mapped archive it points
+   right into the map, otherwise into own buffer. */
+struct ResData {
+	const byte *ptr = nullptr;
+	uint32 len = 0;
+	RawData buffer;
+
+	inline const byte *data() const {
+		return ptr;
+	}
+
+	inline uint32 size() const {
+		return len;
+	}
+};
+
+enum ResIndexKind {
+	RESIDX_DATA = 0,     /* compressed data block of module directory */
+	RESIDX_MOVIE,
+	RESIDX_LOADER2,
+	RESIDX_REUSE         /* resource reuses previous one */
+};
+
+/* Step of module loading recorded on first scan, offset points to data
+   header, movie body or loader2 block */
+struct ResIndexEntry {
+	byte kind = RESIDX_DATA;
+	byte type = 0;
+	int32 pid = 0;
+	int32 p1 = 0;
+	int32 p2 = 0;
+	int32 p3 = 0;
+	uint32 offset = 0;
+	uint32 size = 0;           /* stored size */
+	uint32 unpackedSize = 0;   /* 0 for data stored uncompressed */
+
+	ResIndexEntry() {}
+	ResIndexEntry(byte k, byte t, int32 id, int32 a1, int32 a2, int32 a3, uint32 offs) :
+		kind(k), type(t), pid(id), p1(a1), p2(a2), p3(a3), offset(offs) {}
+};
+
+typedef Common::Array<ResIndexEntry> ResIndexModule;
+
+/* Index of archive modules kept in savefile area, valid while archive
+   size and hash match */
+struct ResIndex {
+	uint32 archiveSize = 0;
+	uint32 archiveHash = 0;
+	Common::HashMap<uint32, ResIndexModule> modules;
+
+	bool load(Common::SeekableReadStream *stream);
+	void save(Common::WriteStream *stream) const;
+};
+
 struct ArchiveDir {
 	uint32 offset;
 	byte id;
 };
 
+/* Reads go to memory mapped file when platform can map it and to the
+   file stream otherwise */
 class Archive : public Common::File {
 public:
 	Archive();
 	~Archive() override;
 	bool open(const Common::Path &name) override;
+	void close() override;
+
+	uint32 read(void *dataPtr, uint32 dataSize) override;
+	int64 pos() const override;
+	bool seek(int64 offset, int whence = SEEK_SET) override;
+	bool skip(uint32 offset) override;
+	bool eos() const override;
+
+	inline byte readByte() {
+		if (!_map)
+			return File::readByte();
+
+		if (_mapPos >= _mapSize) {
+			_mapEos = true;
+			return 0;
+		}
+		return _map[_mapPos++];
+	}
+
+	inline bool isMapped() const {
+		return _map != nullptr;
+	}
+
+	/* Pointer to count bytes at offset of mapped archive, nullptr if
+	   archive is not mapped */
+	const byte *mappedData(uint32 offset, uint32 count) const;
+
+	/* FNV-1a of directory table and trailer */
+	uint32 getHash() const {
+		return _hash;
+	}
 
 	uint16 getDirCount() const {
 		return _dirCount;
@@ -58,8 +146,35 @@ public:
 
 	RawData *readCompressedData();
 	bool readCompressedData(RawData *out);
+	bool readCompressedData(ResData *out);
+
+	/* Read data header and step over its data, sets _lastRead* fields */
+	bool skipCompressedData();
+
+	/* True if data header at hdrOffset has these sizes, position is kept */
+	bool checkDataHeader(uint32 hdrOffset, uint32 size, uint32 unpackedSize);
+
+	/* Read inSize bytes at offset into out, decompressing them if packed */
+	bool readAt(uint32 offset, uint32 inSize, bool packed, byte *out, uint32 outSize);
+
+	/* Mapped data of size bytes after data header at hdrOffset */
+	const byte *mappedPayload(uint32 hdrOffset, uint32 size) const;
+
+	/* Data for header at hdrOffset decoded ahead of time. Next
+	   readCompressedData of that header takes it instead of decoding. */
+	inline void setDecoded(uint32 hdrOffset, RawData *data) {
+		_decodedOffset = hdrOffset;
+		_decoded = data;
+	}
 
 	static void decompress(RawData const *in, RawData *out);
+	static void decompress(const byte *in, uint32 inSize, RawData *out);
+
+	/* Decompress into caller owned out, returns number of bytes written.
+	   Stream variant reads packed data through fixed window on stack and
+	   leaves stream right after it. */
+	static uint32 decompress(const byte *in, uint32 inSize, byte *out, uint32 outSize);
+	static uint32 decompress(Common::SeekableReadStream *in, uint32 inSize, byte *out, uint32 outSize);
 
 public:
 
@@ -67,15 +182,39 @@ public:
 	uint32 _lastReadDecompressedSize = 0;
 	uint32 _lastReadDataOffset = 0;
 
+	/* ms spent in readCompressedData and decompression inside it */
+	uint32 _readTime = 0;
+	uint32 _decompressTime = 0;
+
 
 private:
+	/* Packed input read per step by stream decompress */
+	static const uint32 STREAM_WINDOW = 4096;
+
+	bool readDataHeader();
+	/* Read data of last header into out */
+	void readPayload(byte *out, uint32 outSize);
+	bool takeDecoded(int64 hdrOffset, RawData *out);
+
+	bool mapFile(const Common::FSNode &node);
+	bool sameAsStream(const byte *map, uint32 size);
+	void unmapFile();
+
 	int32 _dirOffset;
 
 	byte _dirCount;
 	uint32 _dataOffset;
 
 	Common::Array<ArchiveDir> _directories;
+	uint32 _hash = 0;
+
+	const byte *_map = nullptr;
+	uint32 _mapSize = 0;
+	uint32 _mapPos = 0;
+	bool _mapEos = false;
 
+	RawData *_decoded = nullptr;
+	uint32 _decodedOffset = 0;
 
 	bool _error;
 };
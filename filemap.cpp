@@ -0,0 +1,66 @@
+/* ScummVM - Graphic Adventure Engine
+ *
+ * ScummVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* mmap is not wrapped by OSystem */
+#define FORBIDDEN_SYMBOL_ALLOW_ALL
+
+#include "gamos/filemap.h"
+
+#if defined(POSIX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Gamos {
+
+const byte *mapFileNode(const Common::FSNode &node, uint32 &size) {
+	size = 0;
+
+#if defined(POSIX)
+	const int fd = ::open(node.getPath().toString(Common::Path::kNativeSeparator).c_str(), O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= 0xffffffffLL)
+		map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (map == MAP_FAILED)
+		return nullptr;
+
+	size = st.st_size;
+	return (const byte *)map;
+#else
+	return nullptr;
+#endif
+}
+
+void unmapFileData(const byte *data, uint32 size) {
+#if defined(POSIX)
+	munmap((void *)data, size);
+#endif
+}
+
+} // End of namespace Gamos
@@ -0,0 +1,37 @@
+/* ScummVM - Graphic Adventure Engine
+ *
+ * ScummVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GAMOS_FILEMAP_H
+#define GAMOS_FILEMAP_H
+
+#include "common/fs.h"
+#include "common/scummsys.h"
+
+namespace Gamos {
+
+/* Read only map of whole file, nullptr when platform can't map it or file is
+   empty or larger than 4 GB. Only this unit deals with platform calls. */
+const byte *mapFileNode(const Common::FSNode &node, uint32 &size);
+void unmapFileData(const byte *data, uint32 size);
+
+} // End of namespace Gamos
+
+#endif // GAMOS_FILEMAP_H
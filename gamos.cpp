@@ -32,6 +32,7 @@
 #include "common/events.h"
 #include "common/keyboard.h"
 #include "common/rect.h"
+#include "common/savefile.h"
 #include "common/scummsys.h"
 #include "common/system.h"
 #include "common/util.h"
@@ -58,6 +59,7 @@ GamosEngine::GamosEngine(OSystem *syst, const GamosGameDescription *gameDesc) :
 }
 
 GamosEngine::~GamosEngine() {
+	_prefetch.stop();
 	freeImages();
 	freeSequences();
 	delete _screen;
@@ -80,6 +82,9 @@ uint32 GamosEngine::getEngineVersion() const {
 }
 
 void GamosEngine::freeImages() {
+	_prefetch.clear();
+	_residency.clear();
+
 	for (Image *img : _images)
 		delete img;
 
@@ -97,8 +102,23 @@ Common::Error GamosEngine::run() {
 	// Set the engine's debugger console
 	setDebugger(new Console());
 
-	VM::_callFuncs = callbackVMCallDispatcher;
-	VM::_callingObject = this;
+	_vm._callFuncs = callbackVMCallDispatcher;
+	_vm._callingObject = this;
+
+	_vm._natives._validate = ConfMan.hasKey("vm_native_validate") && ConfMan.getBool("vm_native_validate");
+
+	/* headless VM benchmark over all modules instead of game */
+	if (ConfMan.hasKey("vm_bench"))
+		return runVMBenchmark(MAX(ConfMan.getInt("vm_bench"), 1));
+
+	/* decode sprites in background ahead of drawing, worker shares timer
+	   thread with music so it is off unless asked for */
+	if (ConfMan.hasKey("image_prefetch") && ConfMan.getBool("image_prefetch"))
+		_prefetch.start();
+
+	/* keep decoded sprites under budget, evicting least recently drawn */
+	if (ConfMan.hasKey("image_budget_kb"))
+		_residency.setBudget((uint64)MAX(ConfMan.getInt("image_budget_kb"), 0) * 1024);
 
 	// If a savegame was selected from the launcher, load it
 	int saveSlot = ConfMan.getInt("save_slot");
@@ -179,10 +199,19 @@ bool GamosEngine::loader2() {
 	if (_arch.readByte() != 7)
 		return false;
 
-	RawData data;
+	const uint32 readStart = _arch._readTime;
+	const uint32 decompressStart = _arch._decompressTime;
+
+	ResData data;
 	if (!_arch.readCompressedData(&data))
 		return false;
 
+	_loadStats.loader2.count++;
+	_loadStats.loader2.packedBytes += _arch._lastReadSize;
+	_loadStats.loader2.unpackedBytes += data.size();
+	_loadStats.loader2.readTime += _arch._readTime - readStart;
+	_loadStats.loader2.decompressTime += _arch._decompressTime - decompressStart;
+
 	int32 p1 = 0;
 	int32 p2 = 0;
 	int32 pid = 0;
@@ -244,6 +273,116 @@ bool GamosEngine::loader2() {
 	return true;
 }
 
+bool GamosEngine::openArchive(const Common::String &name) {
+	if (!_arch.open(Common::Path(name)))
+		return false;
+
+	loadResIndex();
+	return true;
+}
+
+void GamosEngine::loadResIndex() {
+	_resIndex.modules.clear();
+	_resIndex.archiveSize = _arch.size();
+	_resIndex.archiveHash = _arch.getHash();
+
+	Common::InSaveFile *in = _system->getSavefileManager()->openForLoading(_targetName + ".idx");
+	if (!in)
+		return;
+
+	/* index of other version of game data is useless */
+	ResIndex stored;
+	if (stored.load(in) && stored.archiveSize == _resIndex.archiveSize && stored.archiveHash == _resIndex.archiveHash)
+		_resIndex.modules = stored.modules;
+
+	delete in;
+}
+
+void GamosEngine::saveResIndex() {
+	Common::OutSaveFile *out = _system->getSavefileManager()->openForSaving(_targetName + ".idx");
+	if (!out)
+		return;
+
+	_resIndex.save(out);
+	out->finalize();
+	delete out;
+}
+
+static Common::String formatLoadTypeStats(const char *name, const LoadTypeStats &st) {
+	return Common::String::format("%-8s %6u %10u %10u %8u %8u %8u\n", name, st.count,
+	                              (uint32)(st.packedBytes / 1024), (uint32)(st.unpackedBytes / 1024),
+	                              st.readTime, st.decompressTime, st.handlerTime);
+}
+
+Common::String GamosEngine::formatLoadStats() const {
+	const LoadStats &ls = _loadStats;
+	if (ls.module == -1)
+		return "No module loaded\n";
+
+	Common::String res = Common::String::format("Module %d: %u ms total, %u ms scan, %u ms Actions::parse, %u ms initial actions\n",
+	                                            ls.module, ls.totalTime, ls.scanTime, ls.parseTime, ls.initActionsTime);
+	res += Common::String::format("Decoder: %u packed resources, %u by worker, %u ms waiting\n",
+	                              ls.decoderJobs, ls.decoderWorker, ls.decoderWait);
+	res += "type      count  packed KB unpacked KB  read ms decomp ms handler ms\n";
+
+	LoadTypeStats total;
+	for (uint i = 0; i < ARRAYSIZE(ls.types); i++) {
+		const LoadTypeStats &st = ls.types[i];
+		if (!st.count && !st.packedBytes)
+			continue;
+
+		res += formatLoadTypeStats(Common::String::format("0x%02x", i).c_str(), st);
+
+		total.count += st.count;
+		total.packedBytes += st.packedBytes;
+		total.unpackedBytes += st.unpackedBytes;
+		total.readTime += st.readTime;
+		total.decompressTime += st.decompressTime;
+		total.handlerTime += st.handlerTime;
+	}
+
+	if (ls.loader2.count) {
+		res += formatLoadTypeStats("loader2", ls.loader2);
+
+		/* unpacked bytes are already counted under types of its resources */
+		total.packedBytes += ls.loader2.packedBytes;
+		total.readTime += ls.loader2.readTime;
+		total.decompressTime += ls.loader2.decompressTime;
+	}
+
+	res += formatLoadTypeStats("total", total);
+	return res;
+}
+
+bool GamosEngine::appendLoadStats(const Common::String &fileName) const {
+	Common::SaveFileManager *sm = _system->getSavefileManager();
+
+	/* savefiles can't be opened for append, so copy old log first */
+	Common::String log;
+	Common::InSaveFile *in = sm->openForLoading(fileName);
+	if (in) {
+		while (!in->eos() && !in->err()) {
+			char buf[1024];
+			const uint32 count = in->read(buf, sizeof(buf));
+			log += Common::String(buf, count);
+		}
+		delete in;
+	}
+
+	log += formatLoadStats();
+	log += "\n";
+
+	Common::OutSaveFile *out = sm->openForSaving(fileName, false);
+	if (!out)
+		return false;
+
+	out->write(log.c_str(), log.size());
+	out->finalize();
+	const bool ok = !out->err();
+	delete out;
+	return ok;
+}
+
 bool GamosEngine::loadModule(uint id) {
 	_keySeq.clear();
 
@@ -252,7 +391,6 @@ bool GamosEngine::loadModule(uint id) {
 		return false;
 
 	_currentModuleID = id;
-	const byte targetDir = 2 + id;
 
 	//DAT_004126e4 = 1;
 	_currentGameScreen = -1;
@@ -264,6 +402,7 @@ bool GamosEngine::loadModule(uint id) {
 	_xorSeq[0].clear();
 	_xorSeq[1].clear();
 	_xorSeq[2].clear();
+	_stateVMDataName.clear();
 
 	stopMidi();
 	stopMCI();
@@ -271,6 +410,89 @@ bool GamosEngine::loadModule(uint id) {
 
 	/* Complete me */
 
+	const uint32 startTime = _system->getMillis();
+	_loadStats = LoadStats();
+	_loadStats.module = id;
+
+	/* index from savefile is only trusted while its headers match archive */
+	if (_resIndex.modules.contains(id) && !checkModuleIndex(_resIndex.modules[id])) {
+		warning("Resource index of module %u doesn't match archive, rescanning", id);
+		_resIndex.modules.erase(id);
+	}
+
+	/* scan: find resources of module, once per archive thanks to index */
+	if (!_resIndex.modules.contains(id)) {
+		ResIndexModule entries;
+		{
+			ScopedLoadTimer timer(_loadStats.scanTime);
+			if (!scanModule(id, entries))
+				return false;
+		}
+
+		_resIndex.modules[id] = entries;
+		saveResIndex();
+	}
+
+	const ResIndexModule &entries = _resIndex.modules[id];
+
+	/* decode packed resources in background while they are committed in order */
+	ResDecoder decoder;
+	decoder.begin(_arch, entries);
+
+	if (!replayModule(id, entries, &decoder))
+		return false;
+
+	decoder.end();
+
+	_loadStats.decoderJobs = decoder._stats.jobs;
+	_loadStats.decoderWorker = decoder._stats.byWorker;
+	_loadStats.decoderWait = decoder._stats.waitTime;
+	_loadStats.totalTime = _system->getMillis() - startTime;
+
+	debug("Module %u loaded in %u ms, %u packed resources: %u by worker, %u by main thread, %u ms waiting",
+	      id, _loadStats.totalTime, decoder._stats.jobs, decoder._stats.byWorker, decoder._stats.byMain, decoder._stats.waitTime);
+
+	if (ConfMan.hasKey("load_stats_log"))
+		appendLoadStats(ConfMan.get("load_stats_log"));
+
+	/* Page table now covers whole module data and state ranges, runtime
+	   variables lays right after it. Scripts writing much further get sparse
+	   pages instead of growing table. */
+	uint64 top = (uint64)_loadedDataSize + VM::PAGE_SIZE;
+	for (uint i = 0; i < 3; i++) {
+		for (const XorArg &xarg : _xorSeq[i])
+			top = MAX<uint64>(top, (uint64)xarg.pos + xarg.len);
+	}
+	top = MIN<uint64>(top, VM::ADDRESS_MASK);
+
+	const uint32 slack = 0x100000;
+	_vm.memory().reserve(top);
+	_vm.memory().setGrowthLimit(MIN<uint64>(top + slack, VM::ADDRESS_MASK));
+
+	//FUN_00404a28();
+	if (BYTE_004177f7)
+		return true;
+
+	// Reverse Here
+	setCursor(0, false);
+
+	if (!loadStateFile())
+		return false;
+
+	int bkg = _readingBkgMainId;
+	if (bkg == -1)
+		bkg = 0;
+
+	if (!switchToGameScreen(bkg, false))
+		return false;
+
+	return true;
+}
+
+/* Only walks module layout, resources are loaded by replayModule */
+bool GamosEngine::scanModule(uint id, ResIndexModule &entries) {
+	const byte targetDir = 2 + id;
+
 	bool prefixLoaded = false;
 	byte prevByte = 0;
 	bool doLoad = true;
@@ -306,69 +528,14 @@ bool GamosEngine::loadModule(uint id) {
 			p3 = _arch.readPackedInt();
 			break;
 		case 4: {
-			_resReadOffset = _arch.pos();
-			bool isResource = true;
-			if (prevByte == RESTP_F) {
-				RawData data;
-				if (!_arch.readCompressedData(&data))
-					return false;
-				if (_runReadDataMod && BYTE_004177f7 == 0)
-					readData2(data);
-				if (BYTE_004177f7 == 0) {
-					//FUN_00403868();
-				}
-				isResource = false; /* do not loadResHandler */
-			} else if (prevByte == RESTP_10) {
-				if (!initMainDatas())
-					return false;
-				isResource = false; /* do not loadResHandler */
-			} else if (prevByte == RESTP_11) {
-				RawData data;
-				if (!_arch.readCompressedData(&data))
-					return false;
-				if (pid == id)
-					readElementsConfig(data);
-				isResource = false; /* do not loadResHandler */
-			} else if (prevByte == RESTP_18) {
-				/* free elements ? */
-				_readingBkgOffset = _arch.pos();
-			}
-
-			RawData data;
-			if (isResource) {
-				if (!_arch.readCompressedData(&data))
-					return false;
-
-				if (!loadResHandler(prevByte, pid, p1, p2, p3, data))
-					return false;
-
-			}
-
-			uint32 datasz = (data.size() + 3) & (~3);
-
-			switch (prevByte) {
-			case RESTP_11:
-			case RESTP_18:
-			case RESTP_19:
-			case RESTP_20:
-			case RESTP_40:
-			case RESTP_50:
-				break;
-
-			case RESTP_43:
-				//warning("t %x sz %x sum %x", prevByte, data.size(), _loadedDataSize);
-				if (_onlyScanImage)
-					_loadedDataSize += 0x10;
-				else
-					_loadedDataSize += datasz;
-				break;
+			ResIndexEntry e(RESIDX_DATA, prevByte, pid, p1, p2, p3, _arch.pos());
 
-			default:
-				//warning("t %x sz %x sum %x", prevByte, data.size(), _loadedDataSize);
-				_loadedDataSize += datasz;
-				break;
-			}
+			if (!_arch.skipCompressedData())
+				return false;
 
+			e.size = _arch._lastReadSize;
+			e.unpackedSize = _arch._lastReadDecompressedSize;
+			entries.push_back(e);
 			break;
 		}
 		case 5: {
@@ -381,19 +548,28 @@ bool GamosEngine::loadModule(uint id) {
 			for (uint i = 0; i < sz; ++i)
 				movieSize |= _arch.readByte() << (i * 8);
 
-			if (prevByte == 0x14)
-				_movieOffsets[pid] = _arch.pos();
+			if (prevByte == 0x14) {
+				ResIndexEntry e(RESIDX_MOVIE, prevByte, pid, p1, p2, p3, _arch.pos());
+				e.size = movieSize;
+				entries.push_back(e);
+			}
 
 			_arch.skip(movieSize);
 			break;
 		}
-		case 6:
-			if (!loader2())
+		case 6: {
+			entries.push_back(ResIndexEntry(RESIDX_LOADER2, prevByte, pid, p1, p2, p3, _arch.pos()));
+
+			/* same layout loader2() reads */
+			const int32 skipsz = _arch.readSint32LE();
+			_arch.skip(skipsz);
+
+			if (_arch.readByte() != 7 || !_arch.skipCompressedData())
 				return false;
 			break;
+		}
 		case 0xFF:
-			if (!reuseLastResource(prevByte, pid, p1, p2, 0))
-				return false;
+			entries.push_back(ResIndexEntry(RESIDX_REUSE, prevByte, pid, p1, p2, p3, _arch.pos()));
 			break;
 		default:
 			p1 = 0;
@@ -409,27 +585,177 @@ bool GamosEngine::loadModule(uint id) {
 		}
 	}
 
-	//FUN_00404a28();
-	if (BYTE_004177f7)
-		return true;
+	return true;
+}
 
-	// Reverse Here
-	setCursor(0, false);
+/* Data headers recorded by scanModule must still be where index says */
+bool GamosEngine::checkModuleIndex(const ResIndexModule &entries) {
+	for (const ResIndexEntry &e : entries) {
+		if (e.offset >= _arch.size())
+			return false;
 
-	if (!loadStateFile())
-		return false;
+		if (e.kind == RESIDX_DATA && !_arch.checkDataHeader(e.offset, e.size, e.unpackedSize))
+			return false;
+	}
 
-	int bkg = _readingBkgMainId;
-	if (bkg == -1)
-		bkg = 0;
+	return true;
+}
 
-	if (!switchToGameScreen(bkg, false))
-		return false;
+bool GamosEngine::replayModule(uint id, const ResIndexModule &entries, ResDecoder *decoder) {
+	for (const ResIndexEntry &e : entries) {
+		switch (e.kind) {
+		case RESIDX_DATA: {
+			if (!_arch.seek(e.offset, SEEK_SET))
+				return false;
+
+			/* decoding moved out of readCompressedData, so time of take()
+			   (own decode or wait for worker) is counted for its type here */
+			RawData *decoded = nullptr;
+			if (decoder) {
+				uint32 takeTime = 0;
+				{
+					ScopedLoadTimer timer(takeTime);
+					decoded = decoder->take(e.offset);
+				}
+
+				LoadTypeStats &st = _loadStats.types[e.type & CONFTP_RESMASK];
+				st.readTime += takeTime;
+				st.decompressTime += takeTime;
+			}
+			if (decoded)
+				_arch.setDecoded(e.offset, decoded);
+
+			const bool ok = loadModuleData(id, e.type, e.pid, e.p1, e.p2, e.p3);
+			_arch.setDecoded(0, nullptr);
+
+			if (!ok)
+				return false;
+			break;
+		}
+
+		case RESIDX_MOVIE:
+			_movieOffsets[e.pid] = e.offset;
+			break;
+
+		case RESIDX_LOADER2:
+			if (!_arch.seek(e.offset, SEEK_SET) || !loader2())
+				return false;
+			break;
+
+		case RESIDX_REUSE:
+			if (!reuseLastResource(e.type, e.pid, e.p1, e.p2, 0))
+				return false;
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool GamosEngine::loadModuleData(uint id, byte type, int32 pid, int32 p1, int32 p2, int32 p3) {
+	const uint32 startTime = _system->getMillis();
+	const uint32 readStart = _arch._readTime;
+	const uint32 decompressStart = _arch._decompressTime;
+
+	_resReadOffset = _arch.pos();
+	bool isResource = true;
+	if (type == RESTP_F) {
+		RawData data;
+		if (!_arch.readCompressedData(&data))
+			return false;
+		if (_runReadDataMod && BYTE_004177f7 == 0)
+			readData2(data);
+		if (BYTE_004177f7 == 0) {
+			//FUN_00403868();
+		}
+		isResource = false; /* do not loadResHandler */
+	} else if (type == RESTP_10) {
+		if (!initMainDatas())
+			return false;
+		isResource = false; /* do not loadResHandler */
+	} else if (type == RESTP_11) {
+		RawData data;
+		if (!_arch.readCompressedData(&data))
+			return false;
+		if (pid == id)
+			readElementsConfig(data);
+		isResource = false; /* do not loadResHandler */
+	} else if (type == RESTP_18) {
+		/* free elements ? */
+		_readingBkgOffset = _arch.pos();
+	}
+
+	ResData data;
+	if (type == RESTP_18 && pid >= 0 && pid < (int32)_gameScreens.size()) {
+		/* background is decoded right into its game screen */
+		RawData &bkg = _gameScreens[pid]._bkgImageData;
+		if (!_arch.readCompressedData(&bkg))
+			return false;
+
+		data.ptr = bkg.data();
+		data.len = bkg.size();
+
+		if (!loadResHandler(type, pid, p1, p2, p3, data.data(), data.size()))
+			return false;
+	} else if (isResource) {
+		if (!_arch.readCompressedData(&data))
+			return false;
+
+		if (!loadResHandler(type, pid, p1, p2, p3, data.data(), data.size()))
+			return false;
+
+	}
+
+	uint32 datasz = (data.size() + 3) & (~3);
+
+	switch (type) {
+	case RESTP_11:
+	case RESTP_18:
+	case RESTP_19:
+	case RESTP_20:
+	case RESTP_40:
+	case RESTP_50:
+		break;
+
+	case RESTP_43:
+		//warning("t %x sz %x sum %x", type, data.size(), _loadedDataSize);
+		if (_onlyScanImage)
+			_loadedDataSize += 0x10;
+		else
+			_loadedDataSize += datasz;
+		break;
+
+	default:
+		//warning("t %x sz %x sum %x", type, data.size(), _loadedDataSize);
+		_loadedDataSize += datasz;
+		break;
+	}
+
+	LoadTypeStats &st = _loadStats.types[type & CONFTP_RESMASK];
+	const uint32 readTime = _arch._readTime - readStart;
+	st.packedBytes += _arch._lastReadSize;
+	st.readTime += readTime;
+	st.decompressTime += _arch._decompressTime - decompressStart;
+
+	/* counted by loadResHandler otherwise */
+	if (!isResource) {
+		st.count++;
+		st.unpackedBytes += _arch._lastReadDecompressedSize ? _arch._lastReadDecompressedSize : _arch._lastReadSize;
+		st.handlerTime += _system->getMillis() - startTime - readTime;
+	}
 
 	return true;
 }
 
 bool GamosEngine::loadResHandler(uint tp, uint pid, uint p1, uint p2, uint p3, const byte *data, size_t dataSize) {
+	LoadTypeStats &st = _loadStats.types[tp & CONFTP_RESMASK];
+	st.count++;
+	st.unpackedBytes += dataSize;
+	ScopedLoadTimer timer(st.handlerTime);
+
 	if (tp == RESTP_12) {
 		Common::MemoryReadStream dataStream(data, dataSize, DisposeAfterUse::NO);
 
@@ -439,16 +765,16 @@ bool GamosEngine::loadResHandler(uint tp, uint pid, uint p1, uint p2, uint p3, c
 		_addrKeyCode = _loadedDataSize + 3;
 		_addrCurrentFrame = _loadedDataSize + 4;
 
-		VM::memory().setU8(_addrBlk12, dataStream.readByte());
+		_vm.memory().setU8(_addrBlk12, dataStream.readByte());
 		dataStream.skip(1);
-		VM::memory().setU8(_addrFPS, _fps);
-		VM::memory().setU8(_addrKeyDown, dataStream.readByte());
-		VM::memory().setU8(_addrKeyCode, dataStream.readByte());
-		VM::memory().setU32(_addrCurrentFrame, dataStream.readUint32LE());
+		_vm.memory().setU8(_addrFPS, _fps);
+		_vm.memory().setU8(_addrKeyDown, dataStream.readByte());
+		_vm.memory().setU8(_addrKeyCode, dataStream.readByte());
+		_vm.memory().setU32(_addrCurrentFrame, dataStream.readUint32LE());
 
 		setFPS(_fps);
 	} else if (tp == RESTP_13) {
-		VM::writeMemory(_loadedDataSize, data, dataSize);
+		_vm.writeMemory(_loadedDataSize, data, dataSize);
 	} else if (tp == RESTP_18) {
 		loadRes18(pid, data, dataSize);
 	} else if (tp == RESTP_19) {
@@ -459,8 +785,14 @@ bool GamosEngine::loadResHandler(uint tp, uint pid, uint p1, uint p2, uint p3, c
 			DAT_004177f8 = 1;
 
 			Actions acts;
-			acts.parse(data, dataSize);
-			doActions(acts, true);
+			{
+				ScopedLoadTimer parseTimer(_loadStats.parseTime);
+				acts.parse(data, dataSize);
+			}
+			{
+				ScopedLoadTimer actionsTimer(_loadStats.initActionsTime);
+				doActions(acts, true);
+			}
 
 			if (_needReload)
 				warning("needs reload from loadResHandler, CANT HAPPEN!");
@@ -474,12 +806,14 @@ bool GamosEngine::loadResHandler(uint tp, uint pid, uint p1, uint p2, uint p3, c
 			return false;
 		_objectActions[pid].unk1 = getU32(data);
 	} else if (tp == RESTP_21) {
-		VM::writeMemory(_loadedDataSize, data, dataSize);
+		_vm.writeMemory(_loadedDataSize, data, dataSize);
 		_objectActions[pid].onCreateAddress = _loadedDataSize + p3;
+		_vm.decodeScript(_objectActions[pid].onCreateAddress);
 		//warning("RESTP_21 %x pid %d sz %x", _loadedDataSize, pid, dataSize);
 	} else if (tp == RESTP_22) {
-		VM::writeMemory(_loadedDataSize, data, dataSize);
+		_vm.writeMemory(_loadedDataSize, data, dataSize);
 		_objectActions[pid].onDeleteAddress = _loadedDataSize + p3;
+		_vm.decodeScript(_objectActions[pid].onDeleteAddress);
 		//warning("RESTP_22 %x pid %d sz %x", _loadedDataSize, pid, dataSize);
 	} else if (tp == RESTP_23) {
 		if (dataSize % 4 != 0 || dataSize < 4)
@@ -487,14 +821,17 @@ bool GamosEngine::loadResHandler(uint tp, uint pid, uint p1, uint p2, uint p3, c
 		_objectActions[pid].actions.resize(dataSize / 4);
 	} else if (tp == RESTP_2A) {
 		Actions &scr = _objectActions[pid].actions[p1];
+		ScopedLoadTimer parseTimer(_loadStats.parseTime);
 		scr.parse(data, dataSize);
 	} else if (tp == RESTP_2B) {
-		VM::writeMemory(_loadedDataSize, data, dataSize);
+		_vm.writeMemory(_loadedDataSize, data, dataSize);
 		_objectActions[pid].actions[p1].conditionAddress = _loadedDataSize + p3;
+		_vm.decodeScript(_objectActions[pid].actions[p1].conditionAddress);
 		//warning("RESTP_2B %x pid %d p1 %d sz %x", _loadedDataSize, pid, p1, dataSize);
 	} else if (tp == RESTP_2C) {
-		VM::writeMemory(_loadedDataSize, data, dataSize);
+		_vm.writeMemory(_loadedDataSize, data, dataSize);
 		_objectActions[pid].actions[p1].functionAddress = _loadedDataSize + p3;
+		_vm.decodeScript(_objectActions[pid].actions[p1].functionAddress);
 		//warning("RESTP_2C %x pid %d p1 %d sz %x", _loadedDataSize, pid, p1, dataSize);
 	} else if (tp == RESTP_38) {
 		//warning("Data 38 size %zu", dataSize);
@@ -521,6 +858,7 @@ bool GamosEngine::loadResHandler(uint tp, uint pid, uint p1, uint p2, uint p3, c
 		return loadRes52(pid, data, dataSize);
 		//warning("midi  size %d", dataSize);
 	} else if (tp == RESTP_60) {
+		ScopedLoadTimer parseTimer(_loadStats.parseTime);
 		_subtitleActions[pid].parse(data, dataSize);
 	} else if (tp == RESTP_61) {
 		Common::MemoryReadStream dataStream(data, dataSize, DisposeAfterUse::NO);
@@ -622,7 +960,7 @@ bool GamosEngine::initMainDatas() {
 bool GamosEngine::init(const Common::String &moduleName) {
 	BYTE_004177f7 = 0;
 
-	if (!_arch.open(Common::Path(moduleName)))
+	if (!openArchive(moduleName))
 		return false;
 
 	if (!loadInitModule())
@@ -734,7 +1072,7 @@ void GamosEngine::readElementsConfig(const RawData &data) {
 	_subtitlePoints.resize(dat6xCount);
 
 	_loadedDataSize = 0;
-	VM::clearMemory();
+	_vm.clearMemory();
 }
 
 void GamosEngine::loadXorSeq(const byte *data, size_t dataSize, int id) {
@@ -853,7 +1191,8 @@ bool GamosEngine::loadRes18(int32 id, const byte *data, size_t dataSize) {
 	bimg._savedObjects.clear();
 	bimg.palette = nullptr;
 
-	bimg._bkgImageData.assign(data, data + dataSize);
+	if (data != bimg._bkgImageData.data())
+		bimg._bkgImageData.assign(data, data + dataSize);
 
 	Common::MemoryReadStream strm(data, dataSize);
 
@@ -1203,7 +1542,8 @@ void GamosEngine::changeVolume() {
 
 uint8 GamosEngine::update(Common::Point screenSize, Common::Point mouseMove, Common::Point actPos, uint8 act2, uint8 act1, uint16 keyCode, bool mouseInWindow) {
 	_needReload = false;
-	VM::_interrupt = false;
+	_vm._interrupt = false;
+	_vm._conditionMemo.beginFrame();
 
 	if (_d2_fld16 == 0) {
 		act1 = ACT_NONE;
@@ -1288,7 +1628,7 @@ int32 GamosEngine::doActions(const Actions &a, bool absolute) {
 
 	if (a.flags & Actions::HAS_CONDITION) {
 		if (a.conditionAddress != -1) {
-			if (!doScript(a.conditionAddress))
+			if (!_vm.doCondition(a.conditionAddress, PTR_004173e8))
 				return 0;
 			if (_needReload)
 				return 0;
@@ -2081,6 +2421,8 @@ bool GamosEngine::FUN_00402f34(bool p1, bool p2, Object *obj) {
 			obj->pImg = &_sprites[obj->sprId].sequences[obj->seqId]->operator[](obj->frame);
 		}
 
+		prefetchFrames(obj);
+
 		if ((obj->flags & 0x40) == 0)
 			FUN_0040921c(obj);
 
@@ -2261,700 +2603,852 @@ void GamosEngine::doDraw() {
 }
 
 bool GamosEngine::loadImage(Image *img) {
-	if (img->loaded)
+	if (img->loaded) {
+		if (img->offset >= 0)
+			_residency.touch(img);
 		return true;
+	}
 
 	if (img->offset < 0)
 		return false;
 
-	_arch.seek(img->offset, 0);
+	const PrefetchResult res = _prefetch.take(img);
+	if (res == PREFETCH_HIT) {
+		_residency.add(img);
+		return true;
+	}
 
-	if (img->cSize == 0) {
-		img->rawData.resize((img->surface.w * img->surface.h + 16) & ~0xf);
+	const uint32 startTime = _system->getMillis();
+	const uint32 pixels = img->surface.w * img->surface.h;
+	const bool packed = img->cSize != 0;
 
-		_arch.read(img->rawData.data(), img->surface.w * img->surface.h);
-		img->surface.setPixels(img->rawData.data());
-	} else {
-		img->rawData.resize((img->surface.w * img->surface.h + 4 + 16) & ~0xf);
+	/* decoded straight from archive into image buffer */
+	img->rawData.resize(ImagePrefetcher::bufferSize(pixels, packed));
+	_arch.readAt(img->offset, packed ? img->cSize : pixels, packed, img->rawData.data(), img->rawData.size());
+	ImagePrefetcher::attach(img);
+	_residency.add(img);
 
-		RawData tmp(img->cSize);
-		_arch.read(tmp.data(), tmp.size());
-		_arch.decompress(&tmp, &img->rawData);
-		img->surface.setPixels(img->rawData.data() + 4);
-	}
+	const uint32 elapsed = _system->getMillis() - startTime;
+	if (res == PREFETCH_MISS)
+		_prefetch._stats.stallTime += elapsed;
+	else
+		_prefetch._stats.coldTime += elapsed;
 
-	img->surface.format = Graphics::PixelFormat::createFormatCLUT8();
-	img->loaded = true;
 	return true;
 }
 
+/* Queue next frames of object's sequence. Current one is drawn in this
+   update, before worker could get to it. */
+void GamosEngine::prefetchFrames(const Object *obj) {
+	static const int32 FRAMES_AHEAD = 2;
+
+	if (!_prefetch.isRunning() || obj->sprId < 0 || obj->sprId >= (int32)_sprites.size())
+		return;
+
+	const Sprite &spr = _sprites[obj->sprId];
+	if (obj->seqId < 0 || obj->seqId >= (int32)spr.sequences.size() || !spr.sequences[obj->seqId])
+		return;
+
+	/* decoded but not yet drawn images count against residency budget */
+	uint64 limit = (uint64)-1;
+	if (_residency.getBudget()) {
+		const uint64 budget = _residency.getBudget();
+		const uint64 resident = _residency._stats.residentBytes;
+		limit = budget > resident ? budget - resident : 0;
+		_prefetch.trim(limit);
+	}
+
+	const ImageSeq &seq = *spr.sequences[obj->seqId];
+	for (int32 i = 1; i <= FRAMES_AHEAD && i < (int32)seq.size(); i++) {
+		Image *img = seq[(obj->frame + i) % seq.size()].image;
+		if (img)
+			_prefetch.queue(img, _arch, limit);
+	}
+}
+
 uint32 GamosEngine::doScript(uint32 scriptAddress) {
-	uint32 res = VM::doScript(scriptAddress, PTR_004173e8);
+	uint32 res = _vm.doScript(scriptAddress, PTR_004173e8);
 	return res;
 }
 
 
+/* fldN and FUN_ names follow still unnamed engine fields and functions */
+const GamosEngine::VMCallInfo GamosEngine::_vmCalls[GamosEngine::VMCALL_COUNT] = {
+	{"continueActions", 0, &GamosEngine::vmCallContinueActions},
+	{"isCellEmpty", 0, &GamosEngine::vmCallIsCellEmpty},
+	{"isCellSprite", 1, &GamosEngine::vmCallIsCellSprite},
+	{"fld4Is10", 0, &GamosEngine::vmCallFld4Is10},
+	{"fld4Is20", 0, &GamosEngine::vmCallFld4Is20},
+	{"fld4MaskB0", 1, &GamosEngine::vmCallFld4MaskB0},
+	{"fld4Mask4F", 1, &GamosEngine::vmCallFld4Mask4F},
+	{"fld4Dir", 1, &GamosEngine::vmCallFld4Dir},
+	{"fld5Is", 1, &GamosEngine::vmCallFld5Is},
+	{"savedDoActions", 1, &GamosEngine::vmCallSavedDoActions},
+	{"fld2IsFE", 0, &GamosEngine::vmCallFld2IsFE},
+	{"fld2Is", 1, &GamosEngine::vmCallFld2Is},
+	{"thing2Bit", 1, &GamosEngine::vmCallThing2Bit},
+	{"checkKeyPressed", 1, &GamosEngine::vmCallCheckKeyPressed},
+	{"loadModule", 1, &GamosEngine::vmCallLoadModule},
+	{"switchToGameScreen", 1, &GamosEngine::vmCallSwitchToGameScreen},
+	{"playMidi", 1, &GamosEngine::vmCallPlayMidi},
+	{"playSound", 1, &GamosEngine::vmCallPlaySound},
+	{"playMovieId", 1, &GamosEngine::vmCallPlayMovieId},
+	{"createCellSprite", 1, &GamosEngine::vmCallCreateCellSprite},
+	{"showSubtitlePoints", 1, &GamosEngine::vmCallShowSubtitlePoints},
+	{"txtInputAtCell", 2, &GamosEngine::vmCallTxtInputAtCell},
+	{"txtInputAtPoint", 2, &GamosEngine::vmCallTxtInputAtPoint},
+	{"addSubtitlesAtCell", 2, &GamosEngine::vmCallAddSubtitlesAtCell},
+	{"addSubtitlesAtPoint", 2, &GamosEngine::vmCallAddSubtitlesAtPoint},
+	{"setFld5", 1, &GamosEngine::vmCallSetFld5},
+	{"removeSubtitles", 0, &GamosEngine::vmCallRemoveSubtitles},
+	{"FUN_004025d0", 0, &GamosEngine::vmCallFUN_004025d0},
+	{"FUN_0040279c", 1, &GamosEngine::vmCallFUN_0040279c},
+	{"FUN_0040279c_rnd", 1, &GamosEngine::vmCallFUN_0040279c_rnd},
+	{"removeCellObject", 0, &GamosEngine::vmCallRemoveCellObject},
+	{"setCursor", 1, &GamosEngine::vmCallSetCursor},
+	{"resetCursor", 0, &GamosEngine::vmCallResetCursor},
+	{"setFld5FromBlk", 0, &GamosEngine::vmCallSetFld5FromBlk},
+	{"getFld5", 1, &GamosEngine::vmCallGetFld5},
+	{"FUN_00408648", 1, &GamosEngine::vmCallFUN_00408648},
+	{"FUN_00408648_arg", 2, &GamosEngine::vmCallFUN_00408648_arg},
+	{"FUN_004088cc", 2, &GamosEngine::vmCallFUN_004088cc},
+	{"moveDirIs", 1, &GamosEngine::vmCallMoveDirIs},
+	{"moveDir2Is", 1, &GamosEngine::vmCallMoveDir2Is},
+	{"moveDirNear", 1, &GamosEngine::vmCallMoveDirNear},
+	{"moveDir2Near", 1, &GamosEngine::vmCallMoveDir2Near},
+	{"moveControl", 1, &GamosEngine::vmCallMoveControl},
+	{"moveAct", 1, &GamosEngine::vmCallMoveAct},
+	{"moveActFlag", 1, &GamosEngine::vmCallMoveActFlag},
+	{"testFlags", 1, &GamosEngine::vmCallTestFlags},
+	{"copyString", 2, &GamosEngine::vmCallCopyString},
+	{"getSettings", 1, &GamosEngine::vmCallGetSettings},
+	{"setSettings", 1, &GamosEngine::vmCallSetSettings},
+	{"saveLoad", 2, &GamosEngine::vmCallSaveLoad},
+	{"setThing2", 1, &GamosEngine::vmCallSetThing2},
+	{"clearThing2", 0, &GamosEngine::vmCallClearThing2},
+	{"help", 1, &GamosEngine::vmCallHelp},
+	{"setKeyCode", 2, &GamosEngine::vmCallSetKeyCode},
+	{"rndRange", 1, &GamosEngine::vmCallRndRange},
+	{"playMovie", 1, &GamosEngine::vmCallPlayMovie},
+	{"createProcess", 1, &GamosEngine::vmCallCreateProcess},
+	{"checkKeySequence", 1, &GamosEngine::vmCallCheckKeySequence},
+	{"cdAudio58", 1, &GamosEngine::vmCallCdAudio58},
+	{"cdAudio59", 1, &GamosEngine::vmCallCdAudio59},
+	{"scrollTrack", 1, &GamosEngine::vmCallScrollTrack},
+	{"scrollParams", 2, &GamosEngine::vmCallScrollParams},
+};
+
 void GamosEngine::vmCallDispatcher(VM *vm, uint32 funcID) {
-	uint32 arg1 = 0, arg2 = 0;
+	if (funcID >= VMCALL_COUNT) {
+		vmCallUnknown(vm, funcID);
+		return;
+	}
 
-	switch (funcID) {
-	case 0:
-		DAT_004177ff = true;
-		vm->EAX.setVal(1);
-		break;
-	case 1:
-		vm->EAX.setVal( PTR_00417218->y == -1 ? 1 : 0 );
-		break;
+	if (_vmCallTiming)
+		vmCallTimed(vm, funcID);
+	else
+		(this->*_vmCalls[funcID].handler)(vm);
+}
 
-	case 2:
-		arg1 = vm->pop32();
-		if (PTR_00417218->x == -1)
-			vm->EAX.setVal(0);
-		else
-			vm->EAX.setVal( _objects[ PTR_00417218->x ].sprId == arg1 ? 1 : 0 );
-		break;
-	case 3:
-		vm->EAX.setVal( (PTR_00417218->fld_4 & 0x90) == 0x10 ? 1 : 0 );
-		break;
-	case 4:
-		vm->EAX.setVal( (PTR_00417218->fld_4 & 0xa0) == 0x20 ? 1 : 0 );
-		break;
-	case 5:
-		arg1 = vm->pop32();
-		vm->EAX.setVal( (PTR_00417218->fld_4 & 0xb0) == arg1 ? 1 : 0 );
-		break;
-	case 6:
-		arg1 = vm->pop32();
-		vm->EAX.setVal( (PTR_00417218->fld_4 & 0x4f) == arg1 ? 1 : 0 );
-		break;
-	case 7:
-		arg1 = vm->pop32();
-		if ((PTR_00417218->fld_4 & 0x40) == 0 || (PTR_00417218->fld_4 & 8) != (arg1 & 8))
-			vm->EAX.setVal(0);
-		else
-			vm->EAX.setVal( FUN_0040705c(arg1 & 7, PTR_00417218->fld_4 & 7) ? 1 : 0 );
-		break;
-	case 8:
-		arg1 = vm->pop32();
-		vm->EAX.setVal( PTR_00417218->fld_5 == arg1 ? 1 : 0 );
-		break;
-	case 9:
-		arg1 = vm->pop32();
-		vm->EAX.setVal( savedDoActions(_subtitleActions[arg1]) );
-		break;
-	case 10:
-		vm->EAX.setVal( PTR_00417218->fld_2 == 0xfe ? 1 : 0 );
-		break;
-	case 11:
-		arg1 = vm->pop32();
-		vm->EAX.setVal( PTR_00417218->fld_2 == arg1 ? 1 : 0 );
-		break;
-	case 12:
-		arg1 = vm->pop32();
-		vm->EAX.setVal( (1 << (PTR_00417218->fld_2 & 7)) & _thing2[arg1].field_0[PTR_00417218->fld_2 >> 3] );
-		break;
-	case 13: {
-		VM::ValAddr regRef = vm->popReg();
-		Common::String str = vm->getString(regRef);
+void GamosEngine::vmCallTimed(VM *vm, uint32 funcID) {
+	const uint32 startTime = _system->getMillis();
 
-		vm->EAX.setVal(0);
+	(this->*_vmCalls[funcID].handler)(vm);
 
-		for(uint i = 0; i < str.size(); i++) {
-			if (str[i] == RawKeyCode) {
-				vm->EAX.setVal(1);
-				break;
-			}
-		}
-		break;
-	}
+	const uint32 dt = _system->getMillis() - startTime;
 
-	case 14:
-		arg1 = vm->pop32();
-		loadModule(arg1);
-		setNeedReload();
-		vm->EAX.setVal(1);
-		break;
+	VMCallStats &st = _vmCallStats[funcID];
+	st.calls++;
+	st.totalTime += dt;
+	if (dt > st.maxTime)
+		st.maxTime = dt;
 
-	case 15:
-		arg1 = vm->pop32();
-		switchToGameScreen(arg1, false);
-		setNeedReload();
-		break;
+	st.batchTime += dt;
+	if (++st.batchCalls < VMCallStats::BATCH_CALLS)
+		return;
 
-	case 16:
-		arg1 = vm->pop32();
-		vm->EAX.setVal( scriptFunc16(arg1) );
-		break;
+	const uint32 us = st.batchTime * 1000 / VMCallStats::BATCH_CALLS;
+	st.batchCalls = 0;
+	st.batchTime = 0;
 
-	case 17:
-		arg1 = vm->pop32();
-		playSound(arg1);
-		vm->EAX.setVal(1);
-		break;
+	uint bucket = 0;
+	while (bucket < VMCallStats::HIST_BUCKETS - 1 && (us >> (bucket + 4)) != 0)
+		bucket++;
+	st.histogram[bucket]++;
+}
 
-	case 18:
-		arg1 = vm->pop32();
-		vm->EAX.setVal( scriptFunc18(arg1) ? 1 : 0 );
-		break;
+void GamosEngine::vmCallUnknown(VM *vm, uint32 funcID) {
+	uint32 &count = _vmCallUnknown.getOrCreateVal(funcID);
+	if (count == 0)
+		warning("Call Dispatcher %d", funcID);
+	count++;
 
-	case 19:
-		arg1 = vm->pop32();
-		vm->EAX.setVal( scriptFunc19(arg1) );
-		break;
+	vm->EAX.setVal(0);
+}
 
-	case 20: {
-		arg1 = vm->pop32();
-		for (const SubtitlePoint &d : _subtitlePoints[arg1]) {
-			FUN_0040738c(d.sprId, d.x, d.y, true);
-		}
-		vm->EAX.setVal( savedDoActions(_subtitleActions[arg1]) );
-	} break;
-
-	case 21: {
-		VM::ValAddr regRef = vm->popReg();
-		arg2 = vm->pop32();
-		vm->EAX.setVal( txtInputBegin(vm, regRef.getMemType(), regRef.getOffset(), arg2, DAT_00417220 * _gridCellW, DAT_00417224 * _gridCellH) );
-	} break;
-
-	case 22: {
-		VM::ValAddr regRef = vm->popReg();
-		arg2 = vm->pop32();
-		const SubtitlePoint &d = _subtitlePoints[arg2][0];
-		vm->EAX.setVal( txtInputBegin(vm, regRef.getMemType(), regRef.getOffset(), d.sprId, d.x, d.y) );
-	} break;
-
-	case 23: {
-		VM::ValAddr regRef = vm->popReg();
-		arg2 = vm->pop32();
-		addSubtitles(vm, regRef.getMemType(), regRef.getOffset(), arg2, DAT_00417220 * _gridCellW, DAT_00417224 * _gridCellH);
-		vm->EAX.setVal(1);
-	} break;
+void GamosEngine::resetVMCallStats() {
+	for (uint i = 0; i < VMCALL_COUNT; i++)
+		_vmCallStats[i] = VMCallStats();
+}
 
-	case 24: {
-		VM::ValAddr regRef = vm->popReg();
-		arg2 = vm->pop32();
-		const SubtitlePoint &d = _subtitlePoints[arg2][0];
-		addSubtitles(vm, regRef.getMemType(), regRef.getOffset(), d.sprId, d.x, d.y);
+const char *GamosEngine::vmCallName(uint32 funcID) {
+	if (funcID >= VMCALL_COUNT)
+		return nullptr;
+	return _vmCalls[funcID].name;
+}
 
-		vm->EAX.setVal(1);
-	}
-	break;
+void GamosEngine::vmCallContinueActions(VM *vm) {
+	DAT_004177ff = true;
+	vm->EAX.setVal(1);
+}
 
-	case 25: {
-		arg1 = vm->pop32();
-		if (PTR_00417218->fld_5 != arg1) {
-			PTR_00417218->fld_5 = arg1;
-			if (PTR_00417218->x != -1) {
-				Object &obj = _objects[PTR_00417218->x];
-				obj.fld_3 = arg1;
-			}
-			if (PTR_00417218->y != -1) {
-				Object &obj = _objects[PTR_00417218->y];
-				obj.fld_3 = arg1;
-				addDirtRectOnObject(&obj);
-			}
-		}
-		vm->EAX.setVal(1);
-	}
-	break;
+void GamosEngine::vmCallIsCellEmpty(VM *vm) {
+	vm->EAX.setVal( PTR_00417218->y == -1 ? 1 : 0 );
+}
 
-	case 26:
-		removeSubtitles(PTR_00417218);
-		vm->EAX.setVal(1);
-		break;
+void GamosEngine::vmCallIsCellSprite(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if (PTR_00417218->x == -1)
+		vm->EAX.setVal(0);
+	else
+		vm->EAX.setVal( _objects[ PTR_00417218->x ].sprId == arg1 ? 1 : 0 );
+}
 
-	case 27:
-		FUN_004025d0();
-		vm->EAX.setVal(1);
-		break;
+void GamosEngine::vmCallFld4Is10(VM *vm) {
+	vm->EAX.setVal( (PTR_00417218->fld_4 & 0x90) == 0x10 ? 1 : 0 );
+}
 
-	case 28:
-		arg1 = vm->pop32();
-		FUN_0040279c(arg1, false);
-		vm->EAX.setVal(1);
-		break;
+void GamosEngine::vmCallFld4Is20(VM *vm) {
+	vm->EAX.setVal( (PTR_00417218->fld_4 & 0xa0) == 0x20 ? 1 : 0 );
+}
 
-	case 29:
-		arg1 = vm->pop32();
-		FUN_0040279c(arg1, true);
-		vm->EAX.setVal(1);
-		break;
+void GamosEngine::vmCallFld4MaskB0(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal( (PTR_00417218->fld_4 & 0xb0) == arg1 ? 1 : 0 );
+}
 
-	case 30: {
-		if (PTR_00417218->y != -1) {
-			Object *obj = &_objects[PTR_00417218->y];
-			PTR_00417218->x = -1;
-			PTR_00417218->y = -1;
-			removeObjectMarkDirty(obj);
-		}
-	} break;
+void GamosEngine::vmCallFld4Mask4F(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal( (PTR_00417218->fld_4 & 0x4f) == arg1 ? 1 : 0 );
+}
 
-	case 31:
-		arg1 = vm->pop32();
-		setCursor(arg1, true);
-		vm->EAX.setVal(1);
-		break;
+void GamosEngine::vmCallFld4Dir(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if ((PTR_00417218->fld_4 & 0x40) == 0 || (PTR_00417218->fld_4 & 8) != (arg1 & 8))
+		vm->EAX.setVal(0);
+	else
+		vm->EAX.setVal( FUN_0040705c(arg1 & 7, PTR_00417218->fld_4 & 7) ? 1 : 0 );
+}
 
-	case 32:
-		setCursor(0, false);
-		vm->EAX.setVal(1);
-		break;
+void GamosEngine::vmCallFld5Is(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal( PTR_00417218->fld_5 == arg1 ? 1 : 0 );
+}
 
-	case 33:
-		PTR_00417218->fld_5 = _statesHeight - PTR_00417218->blk;
-		vm->EAX.setVal(1);
-		break;
+void GamosEngine::vmCallSavedDoActions(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal( savedDoActions(_subtitleActions[arg1]) );
+}
 
-	case 34: {
-		VM::ValAddr regRef = vm->popReg();
-		vm->setMem8(regRef, PTR_00417218->fld_5);
-		vm->EAX.setVal(1);
-	} break;
-
-	case 35: {
-		arg1 = vm->pop32();
-		uint ret = 0;
-		switch (arg1) {
-		case 3:
-			ret = FUN_00408648(0xe, 0xff, 0xff);
-			break;
+void GamosEngine::vmCallFld2IsFE(VM *vm) {
+	vm->EAX.setVal( PTR_00417218->fld_2 == 0xfe ? 1 : 0 );
+}
 
-		case 4:
-			ret = FUN_00408648(0xe, 0xfe, 0xff);
-			break;
+void GamosEngine::vmCallFld2Is(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal( PTR_00417218->fld_2 == arg1 ? 1 : 0 );
+}
 
-		case 5:
-			ret = FUN_00408648(0xe, 0xfe, 0xfe);
-			break;
+void GamosEngine::vmCallThing2Bit(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal( (1 << (PTR_00417218->fld_2 & 7)) & _thing2[arg1].field_0[PTR_00417218->fld_2 >> 3] );
+}
 
-		case 6:
-			ret = FUN_00408648(0x82, 0xff, 0xff);
-			break;
+void GamosEngine::vmCallCheckKeyPressed(VM *vm) {
+	VM::ValAddr regRef = vm->popReg();
+	const VM::MemString str = vm->viewString(regRef);
 
-		case 7:
-			ret = FUN_00408648(0x82, 0xfe, 0xff);
-			break;
+	vm->EAX.setVal(str.contains(RawKeyCode) ? 1 : 0);
+}
 
-		case 8:
-			ret = FUN_00408648(0x82, 0xfe, 0xfe);
-			break;
+void GamosEngine::vmCallLoadModule(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	loadModule(arg1);
+	setNeedReload();
+	vm->EAX.setVal(1);
+}
 
-		case 9:
-			ret = FUN_00408648(0x83, 0xff, 0xff);
-			break;
+void GamosEngine::vmCallSwitchToGameScreen(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	switchToGameScreen(arg1, false);
+	setNeedReload();
+}
 
-		case 10:
-			ret = FUN_00408648(0x83, 0xfe, 0xff);
-			break;
+void GamosEngine::vmCallPlayMidi(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal( scriptFunc16(arg1) );
+}
 
-		case 11:
-			ret = FUN_00408648(0x83, 0xfe, 0xfe);
-			break;
+void GamosEngine::vmCallPlaySound(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	playSound(arg1);
+	vm->EAX.setVal(1);
+}
 
-		default:
-			break;
-		}
-		vm->EAX.setVal(ret);
-	} break;
+void GamosEngine::vmCallPlayMovieId(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal( scriptFunc18(arg1) ? 1 : 0 );
+}
 
-	case 36: {
-		arg1 = vm->pop32();
-		arg2 = vm->pop32();
+void GamosEngine::vmCallCreateCellSprite(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal( scriptFunc19(arg1) );
+}
 
-		uint ret = 0;
-		switch (arg1) {
-		case 1:
-			ret = FUN_00408648(0, arg2, 0xff);
-			break;
+void GamosEngine::vmCallShowSubtitlePoints(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	for (const SubtitlePoint &d : _subtitlePoints[arg1]) {
+		FUN_0040738c(d.sprId, d.x, d.y, true);
+	}
+	vm->EAX.setVal( savedDoActions(_subtitleActions[arg1]) );
+}
 
-		case 2:
-			ret = FUN_00408648(0, arg2, 0xfe);
-			break;
+void GamosEngine::vmCallTxtInputAtCell(VM *vm) {
+	VM::ValAddr regRef = vm->popReg();
+	uint32 arg2 = vm->pop32();
+	vm->EAX.setVal( txtInputBegin(vm, regRef.getMemType(), regRef.getOffset(), arg2, DAT_00417220 * _gridCellW, DAT_00417224 * _gridCellH) );
+}
 
-		case 3:
-			ret = FUN_00408648(0xe, arg2, 0xff);
-			break;
+void GamosEngine::vmCallTxtInputAtPoint(VM *vm) {
+	VM::ValAddr regRef = vm->popReg();
+	uint32 arg2 = vm->pop32();
+	const SubtitlePoint &d = _subtitlePoints[arg2][0];
+	vm->EAX.setVal( txtInputBegin(vm, regRef.getMemType(), regRef.getOffset(), d.sprId, d.x, d.y) );
+}
 
-		case 4:
-			ret = FUN_00408648(0xe, arg2, 0xfe);
-			break;
+void GamosEngine::vmCallAddSubtitlesAtCell(VM *vm) {
+	VM::ValAddr regRef = vm->popReg();
+	uint32 arg2 = vm->pop32();
+	addSubtitles(vm, regRef.getMemType(), regRef.getOffset(), arg2, DAT_00417220 * _gridCellW, DAT_00417224 * _gridCellH);
+	vm->EAX.setVal(1);
+}
 
-		case 5:
-			ret = FUN_00408648(0xe, arg2, arg2);
-			break;
+void GamosEngine::vmCallAddSubtitlesAtPoint(VM *vm) {
+	VM::ValAddr regRef = vm->popReg();
+	uint32 arg2 = vm->pop32();
+	const SubtitlePoint &d = _subtitlePoints[arg2][0];
+	addSubtitles(vm, regRef.getMemType(), regRef.getOffset(), d.sprId, d.x, d.y);
 
-		case 6:
-			ret = FUN_00408648(0x82, arg2, 0xff);
-			break;
+	vm->EAX.setVal(1);
+}
 
-		case 7:
-			ret = FUN_00408648(0x82, arg2, 0xfe);
-			break;
+void GamosEngine::vmCallSetFld5(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if (PTR_00417218->fld_5 != arg1) {
+		PTR_00417218->fld_5 = arg1;
+		if (PTR_00417218->x != -1) {
+			Object &obj = _objects[PTR_00417218->x];
+			obj.fld_3 = arg1;
+		}
+		if (PTR_00417218->y != -1) {
+			Object &obj = _objects[PTR_00417218->y];
+			obj.fld_3 = arg1;
+			addDirtRectOnObject(&obj);
+		}
+	}
+	vm->EAX.setVal(1);
+}
 
-		case 8:
-			ret = FUN_00408648(0x82, arg2, arg2);
-			break;
+void GamosEngine::vmCallRemoveSubtitles(VM *vm) {
+	removeSubtitles(PTR_00417218);
+	vm->EAX.setVal(1);
+}
 
-		case 9:
-			ret = FUN_00408648(0x83, arg2, 0xff);
-			break;
+void GamosEngine::vmCallFUN_004025d0(VM *vm) {
+	FUN_004025d0();
+	vm->EAX.setVal(1);
+}
 
-		case 10:
-			ret = FUN_00408648(0x83, arg2, 0xfe);
-			break;
+void GamosEngine::vmCallFUN_0040279c(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	FUN_0040279c(arg1, false);
+	vm->EAX.setVal(1);
+}
 
-		case 11:
-			ret = FUN_00408648(0x83, arg2, arg2);
-			break;
+void GamosEngine::vmCallFUN_0040279c_rnd(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	FUN_0040279c(arg1, true);
+	vm->EAX.setVal(1);
+}
 
-		default:
-			break;
-		}
-		vm->EAX.setVal(ret);
-	} break;
+void GamosEngine::vmCallRemoveCellObject(VM *vm) {
+	if (PTR_00417218->y != -1) {
+		Object *obj = &_objects[PTR_00417218->y];
+		PTR_00417218->x = -1;
+		PTR_00417218->y = -1;
+		removeObjectMarkDirty(obj);
+	}
+}
 
-	case 37: {
-		arg1 = vm->pop32();
-		arg2 = vm->pop32();
+void GamosEngine::vmCallSetCursor(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	setCursor(arg1, true);
+	vm->EAX.setVal(1);
+}
 
-		uint ret = 0;
-		switch (arg1) {
-		case 1:
-			ret = FUN_004088cc(0, arg2, 0xff);
-			break;
+void GamosEngine::vmCallResetCursor(VM *vm) {
+	setCursor(0, false);
+	vm->EAX.setVal(1);
+}
 
-		case 2:
-			ret = FUN_004088cc(0, arg2, 0xfe);
-			break;
+void GamosEngine::vmCallSetFld5FromBlk(VM *vm) {
+	PTR_00417218->fld_5 = _statesHeight - PTR_00417218->blk;
+	vm->EAX.setVal(1);
+}
 
-		case 3:
-			ret = FUN_004088cc(0xe, arg2, 0xff);
-			break;
+void GamosEngine::vmCallGetFld5(VM *vm) {
+	VM::ValAddr regRef = vm->popReg();
+	vm->setMem8(regRef, PTR_00417218->fld_5);
+	vm->EAX.setVal(1);
+}
 
-		case 4:
-			ret = FUN_004088cc(0xe, arg2, 0xfe);
-			break;
+void GamosEngine::vmCallFUN_00408648(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	uint ret = 0;
+	switch (arg1) {
+	case 3:
+		ret = FUN_00408648(0xe, 0xff, 0xff);
+		break;
 
-		case 5:
-			ret = FUN_004088cc(0xe, arg2, arg2);
-			break;
+	case 4:
+		ret = FUN_00408648(0xe, 0xfe, 0xff);
+		break;
 
-		case 6:
-			ret = FUN_004088cc(0x82, arg2, 0xff);
-			break;
+	case 5:
+		ret = FUN_00408648(0xe, 0xfe, 0xfe);
+		break;
 
-		case 7:
-			ret = FUN_004088cc(0x82, arg2, 0xfe);
-			break;
+	case 6:
+		ret = FUN_00408648(0x82, 0xff, 0xff);
+		break;
 
-		case 8:
-			ret = FUN_004088cc(0x82, arg2, arg2);
-			break;
+	case 7:
+		ret = FUN_00408648(0x82, 0xfe, 0xff);
+		break;
 
-		case 9:
-			ret = FUN_004088cc(0x83, arg2, 0xff);
-			break;
+	case 8:
+		ret = FUN_00408648(0x82, 0xfe, 0xfe);
+		break;
 
-		case 10:
-			ret = FUN_004088cc(0x83, arg2, 0xfe);
-			break;
+	case 9:
+		ret = FUN_00408648(0x83, 0xff, 0xff);
+		break;
 
-		case 11:
-			ret = FUN_004088cc(0x83, arg2, arg2);
-			break;
+	case 10:
+		ret = FUN_00408648(0x83, 0xfe, 0xff);
+		break;
 
-		default:
-			break;
-		}
-		vm->EAX.setVal(ret);
-	} break;
+	case 11:
+		ret = FUN_00408648(0x83, 0xfe, 0xfe);
+		break;
 
-	case 38:
-		arg1 = vm->pop32();
-		if (DAT_00417804 == 0 || (int32)arg1 != INT_00412ca0)
-			vm->EAX.setVal(0);
-		else
-			vm->EAX.setVal(1);
+	default:
 		break;
+	}
+	vm->EAX.setVal(ret);
+}
 
-	case 39:
-		arg1 = vm->pop32();
-		if (DAT_00417804 == 0 || (int32)arg1 != INT_00412c9c)
-			vm->EAX.setVal(0);
-		else
-			vm->EAX.setVal(1);
+void GamosEngine::vmCallFUN_00408648_arg(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	uint32 arg2 = vm->pop32();
+
+	uint ret = 0;
+	switch (arg1) {
+	case 1:
+		ret = FUN_00408648(0, arg2, 0xff);
 		break;
 
-	case 40:
-		arg1 = vm->pop32();
-		if (DAT_00417804 != 0 && FUN_0040705c(arg1, INT_00412ca0) != 0)
-			vm->EAX.setVal(1);
-		else
-			vm->EAX.setVal(0);
+	case 2:
+		ret = FUN_00408648(0, arg2, 0xfe);
 		break;
 
-	case 41:
-		arg1 = vm->pop32();
-		if (DAT_00417804 != 0 && FUN_0040705c(arg1, INT_00412c9c) != 0)
-			vm->EAX.setVal(1);
-		else
-			vm->EAX.setVal(0);
+	case 3:
+		ret = FUN_00408648(0xe, arg2, 0xff);
 		break;
 
-	case 42: {
-		arg1 = vm->pop32();
-		if (DAT_00417804 != 0) {
-			if (arg1 == 0) {
-				DAT_00417804 = 0;
-				DAT_004177fe = 255;
-				DAT_00417805 = 255;
-				DAT_004177fd = 255;
-			} else if (arg1 == 1) {
-				ActEntry tmp;
-				tmp.value = 0xfe;
-				tmp.t = BYTE_004177f6;
-				tmp.flags = 0;
-				FUN_0040283c(tmp, DAT_00412c94, DAT_00412c98);
-			} else if (arg1 == 2) {
-				ActEntry tmp;
-				tmp.value = 0;
-				tmp.t = BYTE_004177f6;
-				tmp.flags = 0;
-				tmp.x = DAT_00412c94 - DAT_00412c8c;
-				tmp.y = DAT_00412c98 - DAT_00412c90;
-				FUN_00402a68(tmp);
-			}
-		}
-		vm->EAX.setVal(1);
-	} break;
+	case 4:
+		ret = FUN_00408648(0xe, arg2, 0xfe);
+		break;
 
-	case 43: {
-		arg1 = vm->pop32();
-		if (DAT_00417804) {
-			ActEntry tmp;
-			tmp.value = arg1;
-			tmp.t = BYTE_004177f6;
-			tmp.flags = 0;
-			FUN_0040283c(tmp, DAT_00412c94, DAT_00412c98);
-		}
-		vm->EAX.setVal(1);
-	} break;
+	case 5:
+		ret = FUN_00408648(0xe, arg2, arg2);
+		break;
 
-	case 44: {
-		arg1 = vm->pop32();
-		if (DAT_00417804) {
-			ActEntry tmp;
-			tmp.value = arg1;
-			tmp.t = BYTE_004177f6;
-			tmp.flags = 1;
-			FUN_0040283c(tmp, DAT_00412c94, DAT_00412c98);
-		}
-		vm->EAX.setVal(1);
-	} break;
+	case 6:
+		ret = FUN_00408648(0x82, arg2, 0xff);
+		break;
 
-	case 45:
-		arg1 = vm->pop32();
-		vm->EAX.setVal( (PTR_00417218->flags & arg1) ? 1 : 0 );
+	case 7:
+		ret = FUN_00408648(0x82, arg2, 0xfe);
 		break;
 
-	case 46: {
-		VM::ValAddr a1 = vm->popReg();
-		VM::ValAddr a2 = vm->popReg();
-		Common::String s = vm->getString(a1);
-		for(int i = 0; i <= s.size(); i++) {
-			vm->setMem8(a2.getMemType(), a2.getOffset() + i, s.c_str()[i]);
-		}
-	} break;
+	case 8:
+		ret = FUN_00408648(0x82, arg2, arg2);
+		break;
 
-	case 47: {
-		arg1 = vm->pop32();
+	case 9:
+		ret = FUN_00408648(0x83, arg2, 0xff);
+		break;
 
-		switch (arg1) {
-		case 0:
-			vm->EAX.setVal(_d2_fld16 != 0 ? 1 : 0);
-			break;
+	case 10:
+		ret = FUN_00408648(0x83, arg2, 0xfe);
+		break;
 
-		case 1:
-			vm->EAX.setVal(_d2_fld14 != 0 ? 1 : 0);
-			break;
+	case 11:
+		ret = FUN_00408648(0x83, arg2, arg2);
+		break;
 
-		case 2:
-			vm->EAX.setVal(1); //BYTE_004177fb != 0 ? 1 : 0;
-			break;
+	default:
+		break;
+	}
+	vm->EAX.setVal(ret);
+}
 
-		case 3:
-			vm->EAX.setVal(_d2_fld17 != 0 ? 1 : 0);
-			break;
+void GamosEngine::vmCallFUN_004088cc(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	uint32 arg2 = vm->pop32();
 
-		case 4:
-			vm->EAX.setVal(_d2_fld18 != 0 ? 1 : 0);
-			break;
+	uint ret = 0;
+	switch (arg1) {
+	case 1:
+		ret = FUN_004088cc(0, arg2, 0xff);
+		break;
 
-		default:
-			break;
-		}
-	}
-	break;
+	case 2:
+		ret = FUN_004088cc(0, arg2, 0xfe);
+		break;
 
-	case 48: {
-		arg1 = vm->pop32();
+	case 3:
+		ret = FUN_004088cc(0xe, arg2, 0xff);
+		break;
 
-		switch (arg1) {
-		case 0:
-			_d2_fld16 = 0;
-			break;
-		case 1:
-			_d2_fld16 = 1;
-			break;
-		case 2:
-			_d2_fld14 = 0;
-			_sndVolumeTarget = 0;
-			break;
-		case 3:
-			_d2_fld14 = 1;
-			_sndVolumeTarget = _savedSndVolume;
-			break;
-		case 4:
-			_midiVolumeTarget = 0;
-			break;
-		case 5:
-			_midiVolumeTarget = _savedMidiVolume;
-			break;
-		case 6:
-			_d2_fld17 = 0;
-			break;
-		case 7:
-			_d2_fld17 = 1;
-			break;
-		case 8:
-			//FUN_0040a9c0(0);
-			_d2_fld18 = 0;
-			break;
-		case 9:
-			if (_d2_fld19 != 0xff) {
-				//FUN_0040a958(_d2_fld19);
-			}
-			_d2_fld18 = 1;
-			break;
-		default:
-			break;
-		}
-		vm->EAX.setVal(1);
-	} break;
+	case 4:
+		ret = FUN_004088cc(0xe, arg2, 0xfe);
+		break;
 
-	case 49: {
-		arg1 = vm->pop32();
-		arg2 = vm->pop32();
+	case 5:
+		ret = FUN_004088cc(0xe, arg2, arg2);
+		break;
 
-		warning("Do save-load %d %d", arg1, arg2);
-	}
-	break;
+	case 6:
+		ret = FUN_004088cc(0x82, arg2, 0xff);
+		break;
 
-	case 50:
-		arg1 = vm->pop32();
-		PTR_00417388 = _thing2[arg1].field_0.data();
-		vm->EAX.setVal(1);
+	case 7:
+		ret = FUN_004088cc(0x82, arg2, 0xfe);
 		break;
 
-	case 51:
-		PTR_00417388 = nullptr;
-		vm->EAX.setVal(1);
+	case 8:
+		ret = FUN_004088cc(0x82, arg2, arg2);
 		break;
 
-	case 52:
-		arg1 = vm->pop32();
-		/* HELP */
-		//FUN_0040c614(arg1);
-		vm->EAX.setVal(1);
+	case 9:
+		ret = FUN_004088cc(0x83, arg2, 0xff);
 		break;
 
-	case 53: {
-		arg1 = vm->pop32();
-		VM::ValAddr adr = vm->popReg();
-		uint kode = vm->getMem8(adr);
-		_messageProc._keyCodes[arg1] = kode;
-		vm->EAX.setVal(kode);
-	} break;
-
-	case 54:
-		arg1 = vm->pop32();
-		vm->EAX.setVal(rndRange16(arg1));
+	case 10:
+		ret = FUN_004088cc(0x83, arg2, 0xfe);
 		break;
 
-	case 55: {
-		VM::ValAddr regRef = vm->popReg(); //implement
-		Common::String str = vm->getString(regRef);
-		warning("PlayMovie 55: %s", str.c_str());
-		vm->EAX.setVal(1);
+	case 11:
+		ret = FUN_004088cc(0x83, arg2, arg2);
+		break;
+
+	default:
+		break;
 	}
-	break;
+	vm->EAX.setVal(ret);
+}
 
-	case 56: {
-		VM::ValAddr regRef = vm->popReg(); //implement
-		Common::String str = vm->getString(regRef);
-		warning("Create process: %s", str.c_str());
+void GamosEngine::vmCallMoveDirIs(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if (DAT_00417804 == 0 || (int32)arg1 != INT_00412ca0)
+		vm->EAX.setVal(0);
+	else
 		vm->EAX.setVal(1);
-	} break;
-
-	case 57: {
-		VM::ValAddr regRef = vm->popReg(); //implement
-		Common::String str = vm->getString(regRef);
-		if (_keySeq.find(str) != Common::String::npos) {
-			_keySeq.clear();
-			vm->EAX.setVal(1);
-		} else
-			vm->EAX.setVal(0);
-	} break;
-
-	case 58: {
-		arg1 = vm->pop32();
-		/* CD AUDIO */
+}
+
+void GamosEngine::vmCallMoveDir2Is(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if (DAT_00417804 == 0 || (int32)arg1 != INT_00412c9c)
+		vm->EAX.setVal(0);
+	else
 		vm->EAX.setVal(1);
-	} break;
+}
 
-	case 59: {
-		arg1 = vm->pop32();
-		/* CD AUDIO */
+void GamosEngine::vmCallMoveDirNear(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if (DAT_00417804 != 0 && FUN_0040705c(arg1, INT_00412ca0) != 0)
 		vm->EAX.setVal(1);
-	} break;
+	else
+		vm->EAX.setVal(0);
+}
 
-	case 60:
-		arg1 = vm->pop32();
-		if (arg1 == 0)
-			_scrollTrackObj = -1;
-		else
-			_scrollTrackObj = _curObjIndex;
+void GamosEngine::vmCallMoveDir2Near(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if (DAT_00417804 != 0 && FUN_0040705c(arg1, INT_00412c9c) != 0)
 		vm->EAX.setVal(1);
+	else
+		vm->EAX.setVal(0);
+}
+
+void GamosEngine::vmCallMoveControl(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if (DAT_00417804 != 0) {
+		if (arg1 == 0) {
+			DAT_00417804 = 0;
+			DAT_004177fe = 255;
+			DAT_00417805 = 255;
+			DAT_004177fd = 255;
+		} else if (arg1 == 1) {
+			ActEntry tmp;
+			tmp.value = 0xfe;
+			tmp.t = BYTE_004177f6;
+			tmp.flags = 0;
+			FUN_0040283c(tmp, DAT_00412c94, DAT_00412c98);
+		} else if (arg1 == 2) {
+			ActEntry tmp;
+			tmp.value = 0;
+			tmp.t = BYTE_004177f6;
+			tmp.flags = 0;
+			tmp.x = DAT_00412c94 - DAT_00412c8c;
+			tmp.y = DAT_00412c98 - DAT_00412c90;
+			FUN_00402a68(tmp);
+		}
+	}
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallMoveAct(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if (DAT_00417804) {
+		ActEntry tmp;
+		tmp.value = arg1;
+		tmp.t = BYTE_004177f6;
+		tmp.flags = 0;
+		FUN_0040283c(tmp, DAT_00412c94, DAT_00412c98);
+	}
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallMoveActFlag(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if (DAT_00417804) {
+		ActEntry tmp;
+		tmp.value = arg1;
+		tmp.t = BYTE_004177f6;
+		tmp.flags = 1;
+		FUN_0040283c(tmp, DAT_00412c94, DAT_00412c98);
+	}
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallTestFlags(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal( (PTR_00417218->flags & arg1) ? 1 : 0 );
+}
+
+void GamosEngine::vmCallCopyString(VM *vm) {
+	VM::ValAddr a1 = vm->popReg();
+	VM::ValAddr a2 = vm->popReg();
+	VM::MemString s = vm->viewString(a1);
+	/* view must not change while copying into itself */
+	if (a1.getMemType() == a2.getMemType() && a2.getOffset() <= a1.getOffset() + s.size() && a1.getOffset() <= a2.getOffset() + s.size())
+		s.own();
+	for(uint i = 0; i <= s.size(); i++) {
+		vm->setMem8(a2.getMemType(), a2.getOffset() + i, s.c_str()[i]);
+	}
+}
+
+void GamosEngine::vmCallGetSettings(VM *vm) {
+	uint32 arg1 = vm->pop32();
+
+	switch (arg1) {
+	case 0:
+		vm->EAX.setVal(_d2_fld16 != 0 ? 1 : 0);
 		break;
 
-	case 61: {
-		arg1 = vm->pop32();
-		VM::ValAddr adr = vm->popReg();
-		Common::String tmp = vm->getString(adr);
+	case 1:
+		vm->EAX.setVal(_d2_fld14 != 0 ? 1 : 0);
+		break;
 
-		int val1 = 0, val2 = 0, val3 = 0, val4 = 0;
-		sscanf(tmp.c_str(), "%d %d %d %d", &val1, &val2, &val3, &val4);
+	case 2:
+		vm->EAX.setVal(1); //BYTE_004177fb != 0 ? 1 : 0;
+		break;
 
-		if (arg1 == 0) {
-			_scrollBorderL = val1;
-			_scrollBorderR = val2;
-			_scrollBorderU = val3;
-			_scrollBorderB = val4;
-		} else {
-			_scrollSpeed = val1;
-			_scrollCutoff = val2;
-			_scrollSpeedReduce = val3;
-		}
-		vm->EAX.setVal(1);
-	} break;
+	case 3:
+		vm->EAX.setVal(_d2_fld17 != 0 ? 1 : 0);
+		break;
+
+	case 4:
+		vm->EAX.setVal(_d2_fld18 != 0 ? 1 : 0);
+		break;
 
 	default:
-		warning("Call Dispatcher %d", funcID);
-		vm->EAX.setVal(0);
 		break;
 	}
 }
 
+void GamosEngine::vmCallSetSettings(VM *vm) {
+	uint32 arg1 = vm->pop32();
+
+	switch (arg1) {
+	case 0:
+		_d2_fld16 = 0;
+		break;
+	case 1:
+		_d2_fld16 = 1;
+		break;
+	case 2:
+		_d2_fld14 = 0;
+		_sndVolumeTarget = 0;
+		break;
+	case 3:
+		_d2_fld14 = 1;
+		_sndVolumeTarget = _savedSndVolume;
+		break;
+	case 4:
+		_midiVolumeTarget = 0;
+		break;
+	case 5:
+		_midiVolumeTarget = _savedMidiVolume;
+		break;
+	case 6:
+		_d2_fld17 = 0;
+		break;
+	case 7:
+		_d2_fld17 = 1;
+		break;
+	case 8:
+		//FUN_0040a9c0(0);
+		_d2_fld18 = 0;
+		break;
+	case 9:
+		if (_d2_fld19 != 0xff) {
+			//FUN_0040a958(_d2_fld19);
+		}
+		_d2_fld18 = 1;
+		break;
+	default:
+		break;
+	}
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallSaveLoad(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	uint32 arg2 = vm->pop32();
+
+	warning("Do save-load %d %d", arg1, arg2);
+}
+
+void GamosEngine::vmCallSetThing2(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	PTR_00417388 = _thing2[arg1].field_0.data();
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallClearThing2(VM *vm) {
+	PTR_00417388 = nullptr;
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallHelp(VM *vm) {
+	vm->pop32();
+	/* HELP */
+	//FUN_0040c614(arg1);
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallSetKeyCode(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	VM::ValAddr adr = vm->popReg();
+	uint kode = vm->getMem8(adr);
+	_messageProc._keyCodes[arg1] = kode;
+	vm->EAX.setVal(kode);
+}
+
+void GamosEngine::vmCallRndRange(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	vm->EAX.setVal(rndRange16(arg1));
+}
+
+void GamosEngine::vmCallPlayMovie(VM *vm) {
+	VM::ValAddr regRef = vm->popReg(); //implement
+	const VM::MemString str = vm->viewString(regRef);
+	warning("PlayMovie 55: %s", str.c_str());
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallCreateProcess(VM *vm) {
+	VM::ValAddr regRef = vm->popReg(); //implement
+	const VM::MemString str = vm->viewString(regRef);
+	warning("Create process: %s", str.c_str());
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallCheckKeySequence(VM *vm) {
+	VM::ValAddr regRef = vm->popReg(); //implement
+	const VM::MemString str = vm->viewString(regRef);
+	if (_keySeq.find(str.c_str()) != Common::String::npos) {
+		_keySeq.clear();
+		vm->EAX.setVal(1);
+	} else
+		vm->EAX.setVal(0);
+}
+
+void GamosEngine::vmCallCdAudio58(VM *vm) {
+	vm->pop32();
+	/* CD AUDIO */
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallCdAudio59(VM *vm) {
+	vm->pop32();
+	/* CD AUDIO */
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallScrollTrack(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	if (arg1 == 0)
+		_scrollTrackObj = -1;
+	else
+		_scrollTrackObj = _curObjIndex;
+	vm->EAX.setVal(1);
+}
+
+void GamosEngine::vmCallScrollParams(VM *vm) {
+	uint32 arg1 = vm->pop32();
+	VM::ValAddr adr = vm->popReg();
+	const VM::MemString tmp = vm->viewString(adr);
+
+	int val1 = 0, val2 = 0, val3 = 0, val4 = 0;
+	sscanf(tmp.c_str(), "%d %d %d %d", &val1, &val2, &val3, &val4);
+
+	if (arg1 == 0) {
+		_scrollBorderL = val1;
+		_scrollBorderR = val2;
+		_scrollBorderU = val3;
+		_scrollBorderB = val4;
+	} else {
+		_scrollSpeed = val1;
+		_scrollCutoff = val2;
+		_scrollSpeedReduce = val3;
+	}
+	vm->EAX.setVal(1);
+}
+
 void GamosEngine::callbackVMCallDispatcher(void *engine, VM *vm, uint32 funcID) {
 	GamosEngine *gamos = (GamosEngine *)engine;
 	gamos->vmCallDispatcher(vm, funcID);
@@ -3116,6 +3610,9 @@ void GamosEngine::FUN_00409378(int32 sprId, Object *obj, bool p) {
 		obj->pImg = &spr.sequences[frm]->operator[](0);
 		obj->seqId = frm;
 	}
+
+	prefetchFrames(obj);
+
 	if (!p) {
 		obj->fld_4 = DAT_00417228;
 		obj->fld_5 = DAT_0041722c;
@@ -3347,37 +3844,42 @@ void GamosEngine::addSubtitles(VM *vm, byte memtype, int32 offset, int32 sprId,
 						offset += 4;
 					}
 
-					Common::String tmp;
+					Common::String num;
+					VM::MemString tmp;
 					switch (flg & 7) {
 					case 0:
-						tmp = gamos_itoa((int32)(int8)vm->getMem8(btp, boff), 10);
+						num = gamos_itoa((int32)(int8)vm->getMem8(btp, boff), 10);
 						break;
 
 					case 1: {
 						VM::ValAddr addr;
 						addr.setVal( vm->getMem32(btp, boff) );
-						tmp = vm->getString(addr, b2);
+						tmp = vm->viewString(addr, b2);
 					} break;
 
 					case 2:
-						tmp = vm->getString(btp, boff, b2);
+						tmp = vm->viewString(btp, boff, b2);
 						break;
 
 					case 3:
-						tmp = gamos_itoa(vm->getMem32(btp, boff), 10);
+						num = gamos_itoa(vm->getMem32(btp, boff), 10);
 						break;
 
 					case 4: {
 						VM::ValAddr addr;
 						addr.setVal( vm->getMem32(btp, boff) );
-						tmp = gamos_itoa(vm->getMem32(addr), 10);
+						num = gamos_itoa(vm->getMem32(addr), 10);
 					} break;
 
 					case 5:
 						break;
 					}
 
-					for (int i = 0; i < tmp.size(); i++) {
+					for (uint i = 0; i < num.size(); i++) {
+						addSubtitleImage((uint8)num[i], sprId, &x, y);
+					}
+
+					for (uint i = 0; i < tmp.size(); i++) {
 						addSubtitleImage((uint8)tmp[i], sprId, &x, y);
 					}
 				}
@@ -3414,27 +3916,27 @@ Object *GamosEngine::addSubtitleImage(uint32 frame, int32 spr, int32 *pX, int32
 
 bool GamosEngine::FUN_00402bc4() {
 	if (RawKeyCode == ACT_NONE) {
-		VM::memory().setU8(_addrKeyCode, 0);
-		VM::memory().setU8(_addrKeyDown, 0);
+		_vm.memory().setU8(_addrKeyCode, 0);
+		_vm.memory().setU8(_addrKeyDown, 0);
 	} else {
-		VM::memory().setU8(_addrKeyCode, RawKeyCode);
-		VM::memory().setU8(_addrKeyDown, 1);
+		_vm.memory().setU8(_addrKeyCode, RawKeyCode);
+		_vm.memory().setU8(_addrKeyDown, 1);
 	}
 
-	if (VM::memory().getU8(_addrBlk12) != 0)
+	if (_vm.memory().getU8(_addrBlk12) != 0)
 		return false;
 
-	uint32 frameval = VM::memory().getU32(_addrCurrentFrame);
-	VM::memory().setU32(_addrCurrentFrame, frameval + 1);
+	uint32 frameval = _vm.memory().getU32(_addrCurrentFrame);
+	_vm.memory().setU32(_addrCurrentFrame, frameval + 1);
 
-	uint8 fpsval = VM::memory().getU8(_addrFPS);
+	uint8 fpsval = _vm.memory().getU8(_addrFPS);
 
 	if (fpsval == 0) {
 		fpsval = 1;
-		VM::memory().setU8(_addrFPS, 1);
+		_vm.memory().setU8(_addrFPS, 1);
 	} else if (fpsval > 50) {
 		fpsval = 50;
-		VM::memory().setU8(_addrFPS, 50);
+		_vm.memory().setU8(_addrFPS, 50);
 	}
 
 	if (fpsval != _fps) {
@@ -4002,16 +4504,20 @@ bool GamosEngine::updateMouseCursor(Common::Point mouseMove) {
 				_cursorFrame = 0;
 
 			ImagePos &impos = cursorSpr.sequences[0]->operator[](_cursorFrame);
-			Graphics::Surface &surf = impos.image->surface;
-			CursorMan.replaceCursor(surf, -impos.xoffset, -impos.yoffset, 0);
-			CursorMan.disableCursorPalette(true);
-		} else {
-			if (_currentCursor != _mouseCursorImgId) {
-				ImagePos &impos = cursorSpr.sequences[0]->operator[](0);
+			if (loadImage(impos.image)) {
 				Graphics::Surface &surf = impos.image->surface;
 				CursorMan.replaceCursor(surf, -impos.xoffset, -impos.yoffset, 0);
 				CursorMan.disableCursorPalette(true);
 			}
+		} else {
+			if (_currentCursor != _mouseCursorImgId) {
+				ImagePos &impos = cursorSpr.sequences[0]->operator[](0);
+				if (loadImage(impos.image)) {
+					Graphics::Surface &surf = impos.image->surface;
+					CursorMan.replaceCursor(surf, -impos.xoffset, -impos.yoffset, 0);
+					CursorMan.disableCursorPalette(true);
+				}
+			}
 		}
 	} else {
 		if (_currentCursor != _mouseCursorImgId)
@@ -4199,7 +4705,7 @@ void GamosEngine::txtInputProcess(uint8 c) {
 			}
 			_txtInputActive = true;
 			_txtInputTyped = false;
-			ib = VM::memory().getU8(_txtInputVmOffset);
+			ib = _vm.memory().getU8(_txtInputVmOffset);
 			_txtInputVmOffset++;
 			continue;
 		} else if (ib == KeyCodes::WIN_BACK) {
@@ -4218,6 +4724,7 @@ void GamosEngine::txtInputProcess(uint8 c) {
 
 					case 1: {
 						VmTxtFmtAccess adr;
+						adr.runtime = &_vm;
 						adr.setVal( _txtInputVMAccess.getU32() );
 						adr.write(_txtInputBuffer, _txtInputLength + 1);
 					} break;
@@ -4232,33 +4739,35 @@ void GamosEngine::txtInputProcess(uint8 c) {
 
 					case 4: {
 						VmTxtFmtAccess adr;
+						adr.runtime = &_vm;
 						adr.setVal( _txtInputVMAccess.getU32() );
 						adr.setU32( atoi((char *)_txtInputBuffer) );
 					} break;
 				}
 
 				_txtInputTyped = false;
-				ib = VM::memory().getU8(_txtInputVmOffset);
+				ib = _vm.memory().getU8(_txtInputVmOffset);
 				_txtInputVmOffset++;
 				continue;
 			}
 		} else if (ib == 0xf) {
-			_txtInputFlags = VM::memory().getU8(_txtInputVmOffset);
+			_txtInputFlags = _vm.memory().getU8(_txtInputVmOffset);
 			_txtInputVmOffset++;
-			_txtInputMaxLength = VM::memory().getU8(_txtInputVmOffset);
+			_txtInputMaxLength = _vm.memory().getU8(_txtInputVmOffset);
 			_txtInputVmOffset++;
 
 			if ((_txtInputFlags & 0x70) == 0 || (_txtInputFlags & 0x70) == 0x10) {
+				_txtInputVMAccess.runtime = &_vm;
 				_txtInputVMAccess.setMemType(VM::REF_EDI);
 				if ((_txtInputFlags & 0x70) == 0x10) {
 					_txtInputVMAccess.setMemType(VM::REF_EBX);
 					_txtInputVMAccess.objMem = PTR_004173e8;
 				}
 				if ( (_txtInputFlags & 0x80) == 0 ) {
-					_txtInputVMAccess.setOffset( VM::memory().getU8(_txtInputVmOffset) );
+					_txtInputVMAccess.setOffset( _vm.memory().getU8(_txtInputVmOffset) );
 					_txtInputVmOffset++;
 				} else {
-					_txtInputVMAccess.setOffset( VM::memory().getU32(_txtInputVmOffset) );
+					_txtInputVMAccess.setOffset( _vm.memory().getU32(_txtInputVmOffset) );
 					_txtInputVmOffset += 4;
 				}
 				switch (_txtInputFlags & 7) {
@@ -4292,7 +4801,7 @@ void GamosEngine::txtInputProcess(uint8 c) {
 				}
 				_txtInputActive = true;
 				_txtInputTyped = false;
-				ib = VM::memory().getU8(_txtInputVmOffset);
+				ib = _vm.memory().getU8(_txtInputVmOffset);
 				_txtInputVmOffset++;
 				continue;
 			}
@@ -4314,7 +4823,7 @@ void GamosEngine::txtInputProcess(uint8 c) {
 			return;
 		} else {
 			addSubtitleImage(ib, _txtInputSpriteID, &_txtInputX, _txtInputY);
-			ib = VM::memory().getU8(_txtInputVmOffset);
+			ib = _vm.memory().getU8(_txtInputVmOffset);
 			_txtInputVmOffset++;
 		}
 	}
@@ -4364,12 +4873,12 @@ void GamosEngine::dumpActions() {
 	for (ObjectAction &act : _objectActions) {
 		f.writeString(Common::String::format("Act %d : %x\n", i, act.unk1));
 		if (act.onCreateAddress != -1) {
-			t = VM::disassembly(act.onCreateAddress);
+			t = _vm.disassembly(act.onCreateAddress);
 			f.writeString(Common::String::format("Script1 : \n%s\n", t.c_str()));
 		}
 
 		if (act.onDeleteAddress != -1) {
-			t = VM::disassembly(act.onDeleteAddress);
+			t = _vm.disassembly(act.onDeleteAddress);
 			f.writeString(Common::String::format("Script2 : \n%s\n", t.c_str()));
 		}
 
@@ -4378,12 +4887,12 @@ void GamosEngine::dumpActions() {
 			f.writeString(Common::String::format("subscript %d : \n", j));
 
 			if (sc.conditionAddress != -1) {
-				t = VM::disassembly(sc.conditionAddress);
+				t = _vm.disassembly(sc.conditionAddress);
 				f.writeString(Common::String::format("condition : \n%s\n", t.c_str()));
 			}
 
 			if (sc.functionAddress != -1) {
-				t = VM::disassembly(sc.functionAddress);
+				t = _vm.disassembly(sc.functionAddress);
 				f.writeString(Common::String::format("action : \n%s\n", t.c_str()));
 			}
 
@@ -4399,12 +4908,12 @@ void GamosEngine::dumpActions() {
 	i = 0;
 	for (const Actions &act : _subtitleActions) {
 		if (act.flags & Actions::HAS_CONDITION) {
-			t = VM::disassembly(act.conditionAddress);
+			t = _vm.disassembly(act.conditionAddress);
 			f.writeString(Common::String::format("SubAct %d condition : \n%s\n", i, t.c_str()));
 		}
 
 		if (act.flags & Actions::HAS_FUNCTION) {
-			t = VM::disassembly(act.functionAddress);
+			t = _vm.disassembly(act.functionAddress);
 			f.writeString(Common::String::format("SubAct %d action : \n%s\n", i, t.c_str()));
 		}
 
@@ -52,6 +52,9 @@
 
 #include "gamos/detection.h"
 #include "gamos/file.h"
+#include "gamos/prefetch.h"
+#include "gamos/resdecode.h"
+#include "gamos/residency.h"
 
 #include "gamos/array2d.h"
 
@@ -108,6 +111,11 @@ struct Image {
 	int32 offset = -1;
 	int32 size = 0;
 	int32 cSize = 0;
+	bool prefetch = false; /* queued on ImagePrefetcher */
+	bool resident = false; /* decoded and linked in ImageResidency */
+
+	Image *lruPrev = nullptr;
+	Image *lruNext = nullptr;
 
 	Graphics::Surface surface;
 
@@ -240,57 +248,130 @@ struct GameScreen {
 };
 
 struct VmTxtFmtAccess : VM::ValAddr {
+	VM::Runtime *runtime = nullptr;
 	byte *objMem = nullptr;
 
 	inline bool isObjMem() const { return getMemType() == VM::REF_EBX;}
 
-	inline Common::String getString(uint maxLen = 256) const {
+	inline VM::MemString viewString(uint maxLen = 256) const {
 		if (isObjMem()) {
-			Common::String s = Common::String((const char *)objMem + getOffset());
-			if (s.size() > maxLen)
-				s.erase(maxLen);
+			VM::MemString s;
+			s.set((const char *)objMem + getOffset(), maxLen);
 			return s;
 		}
 
-		return VM::readMemString(getOffset(), maxLen);
+		return runtime->memory().getString(getOffset(), maxLen);
+	}
+
+	inline Common::String getString(uint maxLen = 256) const {
+		return viewString(maxLen).toString();
 	}
 
 	inline uint8 getU8() const {
 		if (isObjMem())
 			return objMem[getOffset()];
-		return VM::memory().getU8(getOffset());
+		return runtime->memory().getU8(getOffset());
 	}
 
 	inline uint32 getU32() const {
 		if (isObjMem())
 			return VM::getU32(objMem + getOffset());
-		return VM::memory().getU32(getOffset());
+		return runtime->memory().getU32(getOffset());
 	}
 
 	inline void write(byte *src, uint len) {
 		if (isObjMem())
 			memcpy(objMem + getOffset(), src, len);
 		else
-			VM::writeMemory(getOffset(), src, len);
+			runtime->writeMemory(getOffset(), src, len);
 	}
 
 	inline void setU8(uint8 v) {
 		if (isObjMem())
 			objMem[getOffset()] = v;
 		else
-			VM::memory().setU8(getOffset(), v);
+			runtime->memory().setU8(getOffset(), v);
 	}
 
 	inline void setU32(uint32 v) {
 		if (isObjMem())
 			VM::setU32(objMem + getOffset(), v);
 		else
-			VM::memory().setU32(getOffset(), v);
+			runtime->memory().setU32(getOffset(), v);
+	}
+};
+
+/* Builtin call timing, see Console "vm_calls". One call is mostly 0 or 1 ms
+   of getMillis, so histogram counts batches of calls by their average time
+   per call. */
+struct VMCallStats {
+	enum {
+		BATCH_CALLS = 64,
+		HIST_BUCKETS = 12  /* <16us, 16-31us, 32-63us, ... 16ms and longer */
+	};
+
+	uint32 calls = 0;
+	uint32 totalTime = 0;      /* ms, sum of getMillis deltas */
+	uint32 maxTime = 0;        /* ms of longest single call */
+	uint32 batchCalls = 0;
+	uint32 batchTime = 0;
+	uint32 histogram[HIST_BUCKETS] = {};
+};
+
+/* Scripts of one module run by VM benchmark, see vmbench.cpp */
+struct VMBenchStats {
+	int32 module = -1;
+	uint32 scripts = 0;
+	uint32 runs = 0;
+	uint32 aborted = 0;         /* runs stopped by builtin call limit */
+	uint64 instructions = 0;
+	uint32 loadTime = 0;        /* ms, loadModule without game screen */
+	uint32 runTime = 0;         /* ms of timed passes */
+	uint32 blockAllocs = 0;     /* VM memory blocks taken by timed passes */
+	uint32 arenaAllocs = 0;     /* arena chunks allocated by them */
+	uint32 codeAllocs = 0;      /* decoded regions and loops allocated by them */
+};
+
+/* Cost of loading one resource type by last loadModule */
+struct LoadTypeStats {
+	uint32 count = 0;
+	uint64 packedBytes = 0;     /* as stored in archive */
+	uint64 unpackedBytes = 0;
+	uint32 readTime = 0;        /* ms reading data, including decompression */
+	uint32 decompressTime = 0;  /* ms of readTime spent decompressing */
+	uint32 handlerTime = 0;     /* ms processing data */
+};
+
+/* Telemetry of last loadModule, see Console "load_stats". Times are sums
+   of getMillis deltas, so they are only close to real over many resources. */
+struct LoadStats {
+	int32 module = -1;
+	uint32 totalTime = 0;
+	uint32 scanTime = 0;         /* walking module layout, 0 when indexed */
+	uint32 parseTime = 0;        /* Actions::parse inside handlers */
+	uint32 initActionsTime = 0;  /* RESTP_19 doActions pass */
+	uint32 decoderJobs = 0;      /* packed resources queued on ResDecoder */
+	uint32 decoderWorker = 0;    /* decoded by its worker, not in decompressTime */
+	uint32 decoderWait = 0;      /* ms commit waited for worker */
+
+	LoadTypeStats loader2;       /* loader2 blocks, their resources count under own type */
+	LoadTypeStats types[CONFTP_RESMASK + 1];
+};
+
+/* Adds getMillis time spent in its scope to counter */
+struct ScopedLoadTimer {
+	uint32 &_counter;
+	uint32 _startTime;
+
+	ScopedLoadTimer(uint32 &counter) : _counter(counter), _startTime(g_system->getMillis()) {}
+	~ScopedLoadTimer() {
+		_counter += g_system->getMillis() - _startTime;
 	}
 };
 
 class GamosEngine : public Engine {
 	friend class MoviePlayer;
+	friend class Console;
 
 private:
 	const GamosGameDescription *_gameDescription;
@@ -300,6 +381,14 @@ private:
 	Common::String _errMessage;
 
 	Archive _arch;
+	ResIndex _resIndex;
+	LoadStats _loadStats;
+
+	/* after _arch, jobs may point into archive map */
+	ImagePrefetcher _prefetch;
+	ImageResidency _residency;
+
+	VM::Runtime _vm;
 
 	byte _cmdByte;
 
@@ -358,6 +447,11 @@ private:
 
 	Common::Array<XorArg> _xorSeq[3];
 
+	/* VM part of state file as it was last read or written. While the name
+	   matches, only ranges dirty since then need to be refreshed */
+	Common::Array<byte> _stateVMData;
+	Common::String _stateVMDataName;
+
 	static const byte _xorKeys[32];
 
 	uint32 _seed = 1;
@@ -520,6 +614,26 @@ private:
 
 	bool _needReload = false;
 
+	typedef void (GamosEngine::*VMCallHandler)(VM *vm);
+
+	struct VMCallInfo {
+		const char *name;
+		uint8 args;            /* dwords popped from VM stack */
+		VMCallHandler handler;
+	};
+
+	enum {
+		VMCALL_COUNT = 62
+	};
+
+	static const VMCallInfo _vmCalls[VMCALL_COUNT];
+
+	bool _vmCallTiming = false;
+	VMCallStats _vmCallStats[VMCALL_COUNT];
+	Common::HashMap<uint32, uint32> _vmCallUnknown;
+
+	uint32 _benchCalls = 0;
+
 protected:
 	// Engine APIs
 	Common::Error run() override;
@@ -529,6 +643,14 @@ protected:
 	}
 
 	bool loadModule(uint id);
+	bool scanModule(uint id, ResIndexModule &entries);
+	bool checkModuleIndex(const ResIndexModule &entries);
+	bool replayModule(uint id, const ResIndexModule &entries, ResDecoder *decoder = nullptr);
+	bool loadModuleData(uint id, byte type, int32 pid, int32 p1, int32 p2, int32 p3);
+
+	bool openArchive(const Common::String &name);
+	void loadResIndex();
+	void saveResIndex();
 	bool loader2();
 
 	bool loadResHandler(uint tp, uint pid, uint p1, uint p2, uint p3, const byte *data, size_t dataSize);
@@ -629,6 +751,7 @@ protected:
 	bool setPaletteCurrentGS();
 
 	bool loadImage(Image *img);
+	void prefetchFrames(const Object *obj);
 
 	uint32 doScript(uint32 scriptAddress);
 
@@ -647,7 +770,7 @@ protected:
 
 	void setNeedReload() {
 		_needReload = true;
-		VM::_interrupt = true;
+		_vm._interrupt = true;
 	};
 
 	Object *addSubtitleImage(uint32 frame, int32 spr, int32 *pX, int32 y);
@@ -686,9 +809,13 @@ protected:
 
 	Common::String makeSaveName(const Common::String &main, int id, const Common::String &ext) const;
 
-	void writeVMData(Common::SeekableWriteStream *stream, const Common::Array<XorArg> &seq);
+	void storeVMData(Common::Array<byte> &image, const Common::Array<XorArg> &seq);
 	void readVMData(Common::SeekableReadStream *stream, const Common::Array<XorArg> &seq);
 
+	void getDirtyVMRanges(const XorArg &xarg, Common::Array<XorArg> &ranges) const;
+	void getDirtyVMRanges(const Common::Array<XorArg> &seq, Common::Array<XorArg> &ranges) const;
+	bool patchVMData(Common::Array<byte> &image, uint32 offset, const Common::Array<XorArg> &seq);
+
 	bool writeStateFile();
 	void writeStateData(Common::SeekableWriteStream *stream);
 
@@ -698,6 +825,83 @@ protected:
 	void loadStateData(Common::SeekableReadStream *stream);
 
 	void vmCallDispatcher(VM *vm, uint32 funcID);
+	void vmCallTimed(VM *vm, uint32 funcID);
+	void vmCallUnknown(VM *vm, uint32 funcID);
+	void resetVMCallStats();
+	static const char *vmCallName(uint32 funcID);
+
+	Common::Error runVMBenchmark(uint passes);
+	void benchmarkScripts(uint passes, VMBenchStats &st);
+	void benchmarkPass(const Common::Array<uint32> &scripts, VMBenchStats &st);
+	static const char *benchHeader();
+	static Common::String formatBenchStats(const VMBenchStats &st);
+
+	Common::String formatLoadStats() const;
+	bool appendLoadStats(const Common::String &fileName) const;
+	static void callbackVMBenchDispatcher(void *engine, VM *vm, uint32 funcID);
+
+	void vmCallContinueActions(VM *vm);
+	void vmCallIsCellEmpty(VM *vm);
+	void vmCallIsCellSprite(VM *vm);
+	void vmCallFld4Is10(VM *vm);
+	void vmCallFld4Is20(VM *vm);
+	void vmCallFld4MaskB0(VM *vm);
+	void vmCallFld4Mask4F(VM *vm);
+	void vmCallFld4Dir(VM *vm);
+	void vmCallFld5Is(VM *vm);
+	void vmCallSavedDoActions(VM *vm);
+	void vmCallFld2IsFE(VM *vm);
+	void vmCallFld2Is(VM *vm);
+	void vmCallThing2Bit(VM *vm);
+	void vmCallCheckKeyPressed(VM *vm);
+	void vmCallLoadModule(VM *vm);
+	void vmCallSwitchToGameScreen(VM *vm);
+	void vmCallPlayMidi(VM *vm);
+	void vmCallPlaySound(VM *vm);
+	void vmCallPlayMovieId(VM *vm);
+	void vmCallCreateCellSprite(VM *vm);
+	void vmCallShowSubtitlePoints(VM *vm);
+	void vmCallTxtInputAtCell(VM *vm);
+	void vmCallTxtInputAtPoint(VM *vm);
+	void vmCallAddSubtitlesAtCell(VM *vm);
+	void vmCallAddSubtitlesAtPoint(VM *vm);
+	void vmCallSetFld5(VM *vm);
+	void vmCallRemoveSubtitles(VM *vm);
+	void vmCallFUN_004025d0(VM *vm);
+	void vmCallFUN_0040279c(VM *vm);
+	void vmCallFUN_0040279c_rnd(VM *vm);
+	void vmCallRemoveCellObject(VM *vm);
+	void vmCallSetCursor(VM *vm);
+	void vmCallResetCursor(VM *vm);
+	void vmCallSetFld5FromBlk(VM *vm);
+	void vmCallGetFld5(VM *vm);
+	void vmCallFUN_00408648(VM *vm);
+	void vmCallFUN_00408648_arg(VM *vm);
+	void vmCallFUN_004088cc(VM *vm);
+	void vmCallMoveDirIs(VM *vm);
+	void vmCallMoveDir2Is(VM *vm);
+	void vmCallMoveDirNear(VM *vm);
+	void vmCallMoveDir2Near(VM *vm);
+	void vmCallMoveControl(VM *vm);
+	void vmCallMoveAct(VM *vm);
+	void vmCallMoveActFlag(VM *vm);
+	void vmCallTestFlags(VM *vm);
+	void vmCallCopyString(VM *vm);
+	void vmCallGetSettings(VM *vm);
+	void vmCallSetSettings(VM *vm);
+	void vmCallSaveLoad(VM *vm);
+	void vmCallSetThing2(VM *vm);
+	void vmCallClearThing2(VM *vm);
+	void vmCallHelp(VM *vm);
+	void vmCallSetKeyCode(VM *vm);
+	void vmCallRndRange(VM *vm);
+	void vmCallPlayMovie(VM *vm);
+	void vmCallCreateProcess(VM *vm);
+	void vmCallCheckKeySequence(VM *vm);
+	void vmCallCdAudio58(VM *vm);
+	void vmCallCdAudio59(VM *vm);
+	void vmCallScrollTrack(VM *vm);
+	void vmCallScrollParams(VM *vm);
 
 
 	void dumpActions();
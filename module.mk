@@ -4,14 +4,20 @@ MODULE_OBJS = \
 	blit.o \
 	gamos.o \
 	file.o \
+	filemap.o \
 	console.o \
 	metaengine.o \
 	keycodes.o \
 	music.o \
+	native_scripts.o \
 	proc.o \
+	resdecode.o \
+	residency.o \
 	movie.o \
 	saveload.o \
-	vm.o
+	prefetch.o \
+	vm.o \
+	vmbench.o
 
 # This module can be built as a plugin
 ifeq ($(ENABLE_GAMOS), DYNAMIC_PLUGIN)
@@ -35,14 +35,12 @@ bool MoviePlayer::init(Common::File *file, uint32 offset, GamosEngine *gamos) {
 	_soundBufferSize = 0;
 	_paletteBufferSize = 0;
 	_bufferSize = 0;
-	_packedBufferSize = 0;
 	_frameTime = 0;
 	_loopPoint = 0;
 	_midiBuffer.clear();
 	_soundBuffer.clear();
 	_paletteBuffer.clear();
 	_buffer.clear();
-	_packedBuffer.clear();
 	_midiStarted = false;
 	_soundPlaying = false;
 	_frameSize = Common::Point(_screen->w, _screen->h);
@@ -156,13 +154,6 @@ int MoviePlayer::processControlChunk() {
 			_frameTime = _hdrValue2;
 		break;
 
-	case 2:
-		if (_hdrBytes[2] != 0) {
-			_packedBufferSize = _hdrValue1;
-			_packedBuffer.resize(_hdrValue1);
-		}
-		break;
-
 	case 3:
 		if (_hdrBytes[2] != 0) {
 			_bufferSize = _hdrValue1;
@@ -407,10 +398,8 @@ bool MoviePlayer::readCompressed(int32_t count, Common::Array<byte> *buf) {
 		return true;
 
 	if (_hdrValue1 != _hdrValue2) {
-		_packedBuffer.resize(_hdrValue1);
-		_file->read(_packedBuffer.data(), _hdrValue1);
 		buf->resize(_hdrValue2);
-		Archive::decompress(&_packedBuffer, buf);
+		Archive::decompress(_file, _hdrValue1, buf->data(), buf->size());
 	} else {
 		buf->resize(_hdrValue1);
 		_file->read(buf->data(), _hdrValue1);
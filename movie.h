@@ -83,14 +83,12 @@ private:
 	int _soundBufferSize = 0;
 	int _paletteBufferSize = 0;
 	int _bufferSize = 0;
-	int _packedBufferSize = 0;
 	int _frameTime = 0;
 
 	Common::Array<byte> _midiBuffer;
 	Common::Array<byte> _soundBuffer;
 	Common::Array<byte> _paletteBuffer;
 	Common::Array<byte> _buffer;
-	Common::Array<byte> _packedBuffer;
 
 	bool _midiStarted = false;
 	bool _soundPlaying = false;
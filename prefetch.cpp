@@ -0,0 +1,236 @@
+/* ScummVM - Graphic Adventure Engine
+ *
+ * ScummVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "common/system.h"
+#include "gamos/gamos.h"
+
+namespace Gamos {
+
+ImagePrefetcher::~ImagePrefetcher() {
+	stop();
+}
+
+void ImagePrefetcher::start() {
+	if (_running)
+		return;
+
+	_running = true;
+	g_system->getTimerManager()->installTimerProc(_timerProc, 10 * 1000, this, "Gamos::Prefetch");
+}
+
+void ImagePrefetcher::stop() {
+	if (!_running)
+		return;
+
+	/* timer manager waits for running proc, so no job is active after it */
+	g_system->getTimerManager()->removeTimerProc(_timerProc);
+	_running = false;
+
+	clear();
+}
+
+void ImagePrefetcher::clear() {
+	Common::StackLock lock(_mutex);
+
+	for (Job *job : _pending) {
+		job->img->prefetch = false;
+		delete job;
+	}
+	for (Job *job : _done) {
+		job->img->prefetch = false;
+		delete job;
+	}
+
+	_stats.dropped += _pending.size() + _done.size();
+	_pending.clear();
+	_done.clear();
+
+	/* worker deletes it when finished */
+	if (_active) {
+		_active->img->prefetch = false;
+		_active->cancelled = true;
+		_stats.dropped++;
+	}
+}
+
+bool ImagePrefetcher::queue(Image *img, Archive &arch, uint64 limit) {
+	if (!_running || img->loaded || img->prefetch || img->offset < 0)
+		return false;
+
+	const uint32 pixels = img->surface.w * img->surface.h;
+	const bool packed = img->cSize != 0;
+	const uint32 bytes = bufferSize(pixels, packed);
+	{
+		Common::StackLock lock(_mutex);
+		if (heldBytes() + bytes > limit) {
+			_stats.overBudget++;
+			return false;
+		}
+	}
+
+	Job *job = new Job();
+	job->img = img;
+	job->pixels = pixels;
+	job->packed = packed;
+	job->bytes = bytes;
+	job->srcSize = packed ? img->cSize : pixels;
+	job->src = arch.mappedData(img->offset, job->srcSize);
+
+	/* without map read it here, worker can't share archive position */
+	if (!job->src) {
+		const int64 pos = arch.pos();
+		job->source.resize(job->srcSize);
+
+		const bool ok = arch.seek(img->offset, SEEK_SET) && arch.read(job->source.data(), job->srcSize) == job->srcSize;
+		arch.seek(pos, SEEK_SET);
+
+		if (!ok) {
+			delete job;
+			return false;
+		}
+		job->src = job->source.data();
+	}
+
+	img->prefetch = true;
+
+	Common::StackLock lock(_mutex);
+	_pending.push_back(job);
+	_stats.queued++;
+	return true;
+}
+
+PrefetchResult ImagePrefetcher::take(Image *img) {
+	if (!img->prefetch) {
+		_stats.cold++;
+		return PREFETCH_COLD;
+	}
+
+	img->prefetch = false;
+
+	Common::StackLock lock(_mutex);
+
+	Job *job = removeJob(_done, img);
+	if (job) {
+		img->rawData.swap(job->data);
+		attach(img);
+		delete job;
+
+		_stats.hits++;
+		return PREFETCH_HIT;
+	}
+
+	/* caller decodes it now, worker result would be thrown away */
+	job = removeJob(_pending, img);
+	if (job)
+		delete job;
+	else if (_active && _active->img == img)
+		_active->cancelled = true;
+
+	_stats.misses++;
+	return PREFETCH_MISS;
+}
+
+void ImagePrefetcher::trim(uint64 limit) {
+	Common::StackLock lock(_mutex);
+
+	/* oldest finished ones are least likely to be drawn soon */
+	while (!_done.empty() && heldBytes() > limit) {
+		Job *job = _done.remove_at(0);
+		job->img->prefetch = false;
+		delete job;
+		_stats.dropped++;
+	}
+}
+
+uint32 ImagePrefetcher::bufferSize(uint32 pixels, bool packed) {
+	/* packed data starts with 4 byte header */
+	return packed ? (pixels + 4 + 16) & ~0xf : (pixels + 16) & ~0xf;
+}
+
+void ImagePrefetcher::decode(const byte *src, uint32 srcSize, bool packed, uint32 pixels, RawData *out) {
+	out->resize(bufferSize(pixels, packed));
+
+	if (!packed)
+		memcpy(out->data(), src, pixels);
+	else
+		Archive::decompress(src, srcSize, out->data(), out->size());
+}
+
+void ImagePrefetcher::attach(Image *img) {
+	img->surface.setPixels(img->rawData.data() + (img->cSize ? 4 : 0));
+	img->surface.format = Graphics::PixelFormat::createFormatCLUT8();
+	img->loaded = true;
+}
+
+/* One job per tick, timer thread is shared with music */
+void ImagePrefetcher::work() {
+	Job *job = nullptr;
+	{
+		Common::StackLock lock(_mutex);
+		if (_pending.empty())
+			return;
+
+		job = _pending.remove_at(0);
+		_active = job;
+	}
+
+	decode(job->src, job->srcSize, job->packed, job->pixels, &job->data);
+
+	Common::StackLock lock(_mutex);
+	_active = nullptr;
+
+	if (job->cancelled) {
+		delete job;
+	} else {
+		job->source.clear();
+		job->src = nullptr;
+		_done.push_back(job);
+		_stats.decoded++;
+	}
+}
+
+/* Caller holds _mutex. Lists are a few frames long, so they are summed
+   instead of keeping count in step with every path that drops a job. */
+uint64 ImagePrefetcher::heldBytes() const {
+	uint64 bytes = _active ? _active->bytes : 0;
+	for (const Job *job : _pending)
+		bytes += job->bytes;
+	for (const Job *job : _done)
+		bytes += job->bytes;
+	return bytes;
+}
+
+ImagePrefetcher::Job *ImagePrefetcher::removeJob(Common::Array<Job *> &list, const Image *img) {
+	for (uint i = 0; i < list.size(); i++) {
+		if (list[i]->img == img)
+			return list.remove_at(i);
+	}
+	return nullptr;
+}
+
+void ImagePrefetcher::_timerProc(void *data) {
+	if (!data)
+		return;
+
+	((ImagePrefetcher *)data)->work();
+}
+
+} // End of namespace Gamos
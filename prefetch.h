@@ -0,0 +1,115 @@
+/* ScummVM - Graphic Adventure Engine
+ *
+ * ScummVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GAMOS_PREFETCH_H
+#define GAMOS_PREFETCH_H
+
+#include "common/array.h"
+#include "common/mutex.h"
+#include "common/scummsys.h"
+#include "common/timer.h"
+#include "common/system.h"
+
+#include "gamos/file.h"
+
+namespace Gamos {
+
+struct Image;
+
+struct PrefetchStats {
+	uint32 queued = 0;   /* images put on queue */
+	uint32 decoded = 0;  /* images decoded by worker */
+	uint32 hits = 0;     /* drawn after worker finished */
+	uint32 misses = 0;   /* queued, but drawn before worker got to it */
+	uint32 cold = 0;     /* drawn without being queued */
+	uint32 dropped = 0;  /* thrown away by clear() or trim() */
+	uint32 overBudget = 0; /* not queued, held jobs would exceed budget */
+	uint32 stallTime = 0; /* ms of decoding in doDraw caused by misses */
+	uint32 coldTime = 0;  /* ms of decoding in doDraw for cold images */
+};
+
+enum PrefetchResult {
+	PREFETCH_HIT,
+	PREFETCH_MISS,
+	PREFETCH_COLD
+};
+
+/* Decodes images on timer thread ahead of use, so doDraw only has to pick
+   up finished surfaces. Worker never touches Image itself: it decodes into
+   job buffer, which main thread moves into image in take(). */
+class ImagePrefetcher {
+public:
+	~ImagePrefetcher();
+
+	void start();
+	void stop();
+
+	/* Drop all jobs, must be called before queued images are freed */
+	void clear();
+
+	/* Queue fails when decoded buffers of held jobs would pass limit */
+	bool queue(Image *img, Archive &arch, uint64 limit);
+	PrefetchResult take(Image *img);
+
+	/* Drop oldest finished jobs until held jobs fit in limit bytes */
+	void trim(uint64 limit);
+
+	inline bool isRunning() const {
+		return _running;
+	}
+
+	/* Image buffer layout and decoding, shared with loadImage */
+	static uint32 bufferSize(uint32 pixels, bool packed);
+	static void decode(const byte *src, uint32 srcSize, bool packed, uint32 pixels, RawData *out);
+	static void attach(Image *img);
+
+public:
+	PrefetchStats _stats;
+
+private:
+	struct Job {
+		Image *img = nullptr;
+		const byte *src = nullptr;
+		uint32 srcSize = 0;
+		uint32 pixels = 0;
+		uint32 bytes = 0;    /* size of decoded buffer */
+		bool packed = false;
+		bool cancelled = false;
+
+		RawData source; /* copy of archive bytes when archive is not mapped */
+		RawData data;
+	};
+
+	Common::Mutex _mutex;
+	Common::Array<Job *> _pending;
+	Common::Array<Job *> _done;
+	Job *_active = nullptr;
+	bool _running = false;
+
+	void work();
+	uint64 heldBytes() const;
+	static Job *removeJob(Common::Array<Job *> &list, const Image *img);
+	static void _timerProc(void *data);
+};
+
+} // End of namespace Gamos
+
+#endif // GAMOS_PREFETCH_H
@@ -0,0 +1,156 @@
+/* ScummVM - Graphic Adventure Engine
+ *
+ * ScummVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "common/system.h"
+#include "gamos/gamos.h"
+
+namespace Gamos {
+
+ResDecoder::~ResDecoder() {
+	end();
+}
+
+bool ResDecoder::begin(const Archive &arch, const ResIndexModule &entries) {
+	end();
+
+	if (!arch.isMapped())
+		return false;
+
+	for (const ResIndexEntry &e : entries) {
+		if (e.kind != RESIDX_DATA || !e.unpackedSize)
+			continue;
+
+		const byte *src = arch.mappedPayload(e.offset, e.size);
+		if (!src)
+			continue;
+
+		Job job;
+		job.src = src;
+		job.srcSize = e.size;
+		job.offset = e.offset;
+		job.size = e.unpackedSize;
+		_jobs.push_back(job);
+	}
+
+	_next = 0;
+	_last = _jobs.size();
+	_stats = ResDecodeStats();
+	_stats.jobs = _jobs.size();
+
+	if (_jobs.empty())
+		return false;
+
+	_running = true;
+	g_system->getTimerManager()->installTimerProc(_timerProc, 1000, this, "Gamos::ResDecoder");
+	return true;
+}
+
+void ResDecoder::end() {
+	if (_running) {
+		/* timer manager waits for running proc */
+		g_system->getTimerManager()->removeTimerProc(_timerProc);
+		_running = false;
+	}
+
+	_jobs.clear();
+	_next = 0;
+	_last = 0;
+}
+
+RawData *ResDecoder::take(uint32 hdrOffset) {
+	Job *job = nullptr;
+	byte state = JOB_PENDING;
+	{
+		Common::StackLock lock(_mutex);
+		if (_next >= _jobs.size() || _jobs[_next].offset != hdrOffset)
+			return nullptr;
+
+		job = &_jobs[_next];
+		_next++;
+
+		state = job->state;
+		if (state == JOB_PENDING)
+			job->state = JOB_BUSY;
+	}
+
+	if (state == JOB_PENDING) {
+		decode(*job);
+		_stats.byMain++;
+		return &job->data;
+	}
+
+	if (state == JOB_BUSY) {
+		/* worker is on it right now, it is quicker to wait than redo it */
+		const uint32 startTime = g_system->getMillis();
+		for (;;) {
+			{
+				Common::StackLock lock(_mutex);
+				if (job->state == JOB_DONE)
+					break;
+			}
+			g_system->delayMillis(1);
+		}
+		_stats.waitTime += g_system->getMillis() - startTime;
+	}
+
+	return &job->data;
+}
+
+void ResDecoder::decode(Job &job) {
+	job.data.resize(job.size);
+	Archive::decompress(job.src, job.srcSize, job.data.data(), job.data.size());
+}
+
+void ResDecoder::work() {
+	const uint32 startTime = g_system->getMillis();
+
+	while (g_system->getMillis() - startTime < TICK_BUDGET) {
+		Job *job = nullptr;
+		{
+			Common::StackLock lock(_mutex);
+			while (_last > _next && !job) {
+				_last--;
+				if (_jobs[_last].state == JOB_PENDING) {
+					job = &_jobs[_last];
+					job->state = JOB_BUSY;
+				}
+			}
+		}
+
+		if (!job)
+			return;
+
+		decode(*job);
+
+		Common::StackLock lock(_mutex);
+		job->state = JOB_DONE;
+		_stats.byWorker++;
+	}
+}
+
+void ResDecoder::_timerProc(void *data) {
+	if (!data)
+		return;
+
+	((ResDecoder *)data)->work();
+}
+
+} // End of namespace Gamos
@@ -0,0 +1,93 @@
+/* ScummVM - Graphic Adventure Engine
+ *
+ * ScummVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GAMOS_RESDECODE_H
+#define GAMOS_RESDECODE_H
+
+#include "common/array.h"
+#include "common/mutex.h"
+#include "common/scummsys.h"
+#include "common/timer.h"
+#include "common/system.h"
+
+#include "gamos/file.h"
+
+namespace Gamos {
+
+struct ResDecodeStats {
+	uint32 jobs = 0;
+	uint32 byWorker = 0;
+	uint32 byMain = 0;
+	uint32 waitTime = 0; /* ms main thread waited for worker */
+};
+
+/* Decodes packed resources of module while loadModule commits them in
+   order. Worker on timer thread takes jobs from far end of list, main
+   thread takes them in entry order and decodes itself when worker has
+   not got to them yet. Needs mapped archive, worker never touches
+   archive position. */
+class ResDecoder {
+public:
+	~ResDecoder();
+
+	bool begin(const Archive &arch, const ResIndexModule &entries);
+	void end();
+
+	/* Decoded data of resource with header at hdrOffset, nullptr if it
+	   was not queued. Main thread only, in entry order. */
+	RawData *take(uint32 hdrOffset);
+
+public:
+	ResDecodeStats _stats;
+
+private:
+	enum JobState {
+		JOB_PENDING,
+		JOB_BUSY,
+		JOB_DONE
+	};
+
+	struct Job {
+		const byte *src = nullptr;
+		uint32 srcSize = 0;
+		uint32 offset = 0;
+		uint32 size = 0;
+		byte state = JOB_PENDING;
+		RawData data;
+	};
+
+	/* Loading blocks the game anyway, so worker may run long */
+	static const uint32 TICK_BUDGET = 20;
+
+	Common::Mutex _mutex;
+	Common::Array<Job> _jobs;
+	uint _next = 0;   /* next job taken by main thread */
+	uint _last = 0;   /* worker looks for pending jobs below this */
+	bool _running = false;
+
+	static void decode(Job &job);
+	void work();
+	static void _timerProc(void *data);
+};
+
+} // End of namespace Gamos
+
+#endif // GAMOS_RESDECODE_H
@@ -0,0 +1,120 @@
+/* ScummVM - Graphic Adventure Engine
+ *
+ * ScummVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "gamos/gamos.h"
+
+namespace Gamos {
+
+void ImageResidency::setBudget(uint64 bytes) {
+	_budget = bytes;
+	trim(nullptr);
+}
+
+void ImageResidency::touch(Image *img) {
+	_stats.hits++;
+
+	if (!img->resident || _head == img)
+		return;
+
+	unlink(img);
+	link(img);
+}
+
+void ImageResidency::add(Image *img) {
+	_stats.misses++;
+
+	if (img->resident)
+		unlink(img);
+	else {
+		img->resident = true;
+		_stats.resident++;
+		_stats.residentBytes += img->rawData.size();
+		_stats.peakBytes = MAX(_stats.peakBytes, _stats.residentBytes);
+	}
+
+	link(img);
+	trim(img);
+}
+
+void ImageResidency::clear() {
+	for (Image *img = _head; img; ) {
+		Image *next = img->lruNext;
+		img->lruPrev = img->lruNext = nullptr;
+		img->resident = false;
+		img = next;
+	}
+
+	_head = _tail = nullptr;
+	_stats.resident = 0;
+	_stats.residentBytes = 0;
+}
+
+void ImageResidency::link(Image *img) {
+	img->lruPrev = nullptr;
+	img->lruNext = _head;
+
+	if (_head)
+		_head->lruPrev = img;
+	else
+		_tail = img;
+
+	_head = img;
+}
+
+void ImageResidency::unlink(Image *img) {
+	if (img->lruPrev)
+		img->lruPrev->lruNext = img->lruNext;
+	else
+		_head = img->lruNext;
+
+	if (img->lruNext)
+		img->lruNext->lruPrev = img->lruPrev;
+	else
+		_tail = img->lruPrev;
+
+	img->lruPrev = img->lruNext = nullptr;
+}
+
+void ImageResidency::evict(Image *img) {
+	const uint32 bytes = img->rawData.size();
+
+	unlink(img);
+	img->resident = false;
+	img->loaded = false;
+	img->surface.setPixels(nullptr);
+	img->rawData.clear();
+
+	_stats.resident--;
+	_stats.residentBytes -= bytes;
+	_stats.evictions++;
+	_stats.evictedBytes += bytes;
+}
+
+void ImageResidency::trim(const Image *keep) {
+	if (!_budget)
+		return;
+
+	/* image being drawn stays even if it alone is over budget */
+	while (_stats.residentBytes > _budget && _tail && _tail != keep)
+		evict(_tail);
+}
+
+} // End of namespace Gamos
@@ -0,0 +1,77 @@
+/* ScummVM - Graphic Adventure Engine
+ *
+ * ScummVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GAMOS_RESIDENCY_H
+#define GAMOS_RESIDENCY_H
+
+#include "common/scummsys.h"
+
+namespace Gamos {
+
+struct Image;
+
+struct ResidencyStats {
+	uint64 residentBytes = 0;
+	uint64 peakBytes = 0;
+	uint32 resident = 0;   /* decoded on-disk images kept in memory */
+	uint32 hits = 0;       /* draws of already resident image */
+	uint32 misses = 0;     /* draws which had to decode image */
+	uint32 evictions = 0;
+	uint64 evictedBytes = 0;
+};
+
+/* Keeps decoded on-disk images (offset >= 0) in least recently drawn order
+   and drops pixels of oldest ones back to their offset/cSize form when
+   budget is exceeded. Images are linked through Image::lruPrev/lruNext. */
+class ImageResidency {
+public:
+	/* Budget in bytes, 0 means unlimited */
+	void setBudget(uint64 bytes);
+
+	inline uint64 getBudget() const {
+		return _budget;
+	}
+
+	/* Image was drawn while resident */
+	void touch(Image *img);
+	/* Image was just decoded */
+	void add(Image *img);
+
+	/* Forget all images without evicting, used before they are freed */
+	void clear();
+
+public:
+	ResidencyStats _stats;
+
+private:
+	Image *_head = nullptr; /* most recently drawn */
+	Image *_tail = nullptr;
+	uint64 _budget = 0;
+
+	void link(Image *img);
+	void unlink(Image *img);
+	void evict(Image *img);
+	void trim(const Image *keep);
+};
+
+} // End of namespace Gamos
+
+#endif // GAMOS_RESIDENCY_H
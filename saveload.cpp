@@ -106,6 +106,10 @@ bool GamosEngine::switchToGameScreen(int id, bool doNotStore) {
 		}
 
 		*nobj = obj;
+
+		/* restored animations go on right after switch */
+		if (nobj->pImg)
+			prefetchFrames(nobj);
 	}
 
 	gs._savedObjects.clear();
@@ -135,6 +139,22 @@ bool GamosEngine::writeStateFile() {
 
 	if (!_runReadDataMod) {
 		if (sm->exists(fname)) {
+			if (_stateVMDataName == fname) {
+				bool changed = patchVMData(_stateVMData, 0, _xorSeq[0]);
+				uint32 offset = 0;
+				for (const XorArg &xarg : _xorSeq[0])
+					offset += xarg.len;
+				changed |= patchVMData(_stateVMData, offset, _xorSeq[1]);
+
+				/* file already holds current data */
+				if (!changed)
+					return true;
+			} else {
+				_stateVMData.clear();
+				storeVMData(_stateVMData, _xorSeq[0]);
+				storeVMData(_stateVMData, _xorSeq[1]);
+			}
+
 			Common::InSaveFile *rsv = sm->openForLoading(fname);
 			byte svdata[0x4c];
 			rsv->read(svdata, 0x4c);
@@ -142,23 +162,30 @@ bool GamosEngine::writeStateFile() {
 
 			Common::OutSaveFile *osv = sm->openForSaving(fname);
 			osv->write(svdata, 0x4c);
-
-			writeVMData(osv, _xorSeq[0]);
-			writeVMData(osv, _xorSeq[1]);
+			osv->write(_stateVMData.data(), _stateVMData.size());
 
 			osv->finalize();
 			delete osv;
+
+			_stateVMDataName = fname;
+			_vm.memory().clearDirty();
 		}
 	} else {
 		_d2_fld10 = 0;
 		Common::OutSaveFile *osv = sm->openForSaving(fname);
 
+		_stateVMData.clear();
+		storeVMData(_stateVMData, _xorSeq[0]);
+		storeVMData(_stateVMData, _xorSeq[1]);
+
 		writeStateData(osv);
-		writeVMData(osv, _xorSeq[0]);
-		writeVMData(osv, _xorSeq[1]);
+		osv->write(_stateVMData.data(), _stateVMData.size());
 
 		osv->finalize();
 		delete osv;
+
+		_stateVMDataName = fname;
+		_vm.memory().clearDirty();
 	}
 	return true;
 }
@@ -173,6 +200,13 @@ bool GamosEngine::loadStateFile() {
 			rs->seek(0x4c);
 			readVMData(rs, _xorSeq[0]);
 			readVMData(rs, _xorSeq[1]);
+			delete rs;
+
+			_stateVMData.clear();
+			storeVMData(_stateVMData, _xorSeq[0]);
+			storeVMData(_stateVMData, _xorSeq[1]);
+			_stateVMDataName = fname;
+			_vm.memory().clearDirty();
 		}
 	} else {
 		if (!sm->exists(fname))
@@ -184,6 +218,12 @@ bool GamosEngine::loadStateFile() {
 			readVMData(rs, _xorSeq[0]);
 			readVMData(rs, _xorSeq[1]);
 
+			_stateVMData.clear();
+			storeVMData(_stateVMData, _xorSeq[0]);
+			storeVMData(_stateVMData, _xorSeq[1]);
+			_stateVMDataName = fname;
+			_vm.memory().clearDirty();
+
 			zeroVMData(_xorSeq[1]);
 
 			_runReadDataMod = false;
@@ -274,15 +314,14 @@ void GamosEngine::loadStateData(Common::SeekableReadStream *dataStream) {
 }
 
 
-void GamosEngine::writeVMData(Common::SeekableWriteStream *stream, const Common::Array<XorArg> &seq) {
+void GamosEngine::storeVMData(Common::Array<byte> &image, const Common::Array<XorArg> &seq) {
 	for (const XorArg &xarg : seq) {
-		Common::Array<byte> tmp = VM::readMemBlocks(xarg.pos, xarg.len);
+		const uint32 pos = image.size();
+		image.resize(pos + xarg.len);
+		_vm.readMemBlocks(image.data() + pos, xarg.pos, xarg.len);
 
-		//xor data in tmp
+		//xor data in image
 		//...
-
-		// and write it
-		stream->write(tmp.data(), xarg.len);
 	}
 }
 
@@ -296,13 +335,68 @@ void GamosEngine::readVMData(Common::SeekableReadStream *stream, const Common::A
 		//...
 
 		// and write it
-		VM::writeMemory(xarg.pos, buf.data(), xarg.len);
+		_vm.writeMemory(xarg.pos, buf.data(), xarg.len);
 	}
 }
 
 void GamosEngine::zeroVMData(const Common::Array<XorArg> &seq) {
 	for (const XorArg &xarg : seq)
-		VM::zeroMemory(xarg.pos, xarg.len);
+		_vm.zeroMemory(xarg.pos, xarg.len);
+}
+
+void GamosEngine::getDirtyVMRanges(const XorArg &xarg, Common::Array<XorArg> &ranges) const {
+	if (!xarg.len)
+		return;
+
+	const VM::MemAccess &mem = _vm.memory();
+	const uint32 end = xarg.pos + xarg.len;
+	const uint32 lastPage = (end - 1) >> VM::PAGE_SHIFT;
+
+	uint32 page = xarg.pos >> VM::PAGE_SHIFT;
+	while (page <= lastPage) {
+		if (!mem.isDirty(page)) {
+			page++;
+			continue;
+		}
+
+		const uint32 first = page;
+		while (page <= lastPage && mem.isDirty(page))
+			page++;
+
+		XorArg range;
+		range.pos = MAX<uint32>(xarg.pos, first << VM::PAGE_SHIFT);
+		range.len = MIN<uint32>(end, page << VM::PAGE_SHIFT) - range.pos;
+		ranges.push_back(range);
+	}
+}
+
+void GamosEngine::getDirtyVMRanges(const Common::Array<XorArg> &seq, Common::Array<XorArg> &ranges) const {
+	for (const XorArg &xarg : seq)
+		getDirtyVMRanges(xarg, ranges);
+}
+
+/* Refresh dirty parts of the image built by storeVMData, returns true if anything was refreshed */
+bool GamosEngine::patchVMData(Common::Array<byte> &image, uint32 offset, const Common::Array<XorArg> &seq) {
+	bool changed = false;
+	Common::Array<XorArg> ranges;
+
+	for (const XorArg &xarg : seq) {
+		ranges.clear();
+		getDirtyVMRanges(xarg, ranges);
+
+		for (const XorArg &range : ranges) {
+			_vm.readMemBlocks(image.data() + offset + (range.pos - xarg.pos), range.pos, range.len);
+
+			//xor data in image
+			//...
+
+			changed = true;
+		}
+
+		offset += xarg.len;
+	}
+
+	return changed;
 }
 
 }
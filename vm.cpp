@@ -23,100 +23,2673 @@
 
 namespace Gamos {
 
-VM::CallDispatcher VM::_callFuncs = nullptr;
-void *VM::_callingObject = nullptr;
 
-Common::HashMap<uint32, VM::MemoryBlock> VM::_memMap;
-bool VM::_interrupt = false;
 
-VM VM::_threads[THREADS_COUNT];
 
-VM::MemAccess VM::_memAccess;
 
+VM::MemoryBlock VM::MemAccess::_zeroBlock;
 
 
+VM::MemAccess::~MemAccess() {
+	for (ArenaChunk &chunk : _arena)
+		delete[] chunk.blocks;
+}
+
+uint32 VM::MemAccess::getU32Split(uint32 address) const {
+	uint32 val = 0;
+	for (int i = 0; i < 4; i++)
+		val |= getU8(address + i) << (i * 8);
+
+	return val;
+}
+
+VM::MemString VM::MemAccess::getString(uint32 address, uint32 maxLen) const {
+	MemString str;
+
+	uint32 page = address >> PAGE_SHIFT;
+	uint32 span = MIN<uint32>(maxLen, PAGE_SIZE - (address & PAGE_MASK));
+	const char *data = (const char *)pageBlock(page)->data + (address & PAGE_MASK);
+	const char *end = (const char *)memchr(data, 0, span);
+
+	if (end || span == maxLen) {
+		str.set(data, span);
+		return str;
+	}
+
+	/* string goes on in next pages */
+	str._owned = true;
+	str._copy = Common::String(data, span);
+
+	while (!end) {
+		address += span;
+		maxLen -= span;
+		page = address >> PAGE_SHIFT;
+		if (!maxLen)
+			break;
+
+		span = MIN<uint32>(maxLen, PAGE_SIZE);
+		data = (const char *)pageBlock(page)->data;
+		end = (const char *)memchr(data, 0, span);
+		str._copy += Common::String(data, end ? end - data : span);
+	}
+
+	str._size = str._copy.size();
+	return str;
+}
+
+void VM::MemString::own() {
+	if (_owned)
+		return;
+
+	_copy = Common::String(_data, _size);
+	_owned = true;
+}
+
+void VM::MemString::set(const char *str, uint32 maxLen) {
+	const char *end = (const char *)memchr(str, 0, maxLen);
+
+	_data = str;
+	_size = end ? end - str : maxLen;
+	_owned = false;
+
+	if (!end)
+		own();
+}
+
+VM::MemoryBlock *VM::MemAccess::allocBlock() {
+	MemoryBlock *blk;
+	_blockAllocs++;
+	if (!_freeBlocks.empty()) {
+		blk = _freeBlocks.back();
+		_freeBlocks.pop_back();
+	} else {
+		if (_arena.empty() || _arena.back().count == ARENA_CHUNK_PAGES) {
+			ArenaChunk chunk;
+			chunk.blocks = new MemoryBlock[ARENA_CHUNK_PAGES];
+			_arena.push_back(chunk);
+		}
+
+		ArenaChunk &chunk = _arena.back();
+		blk = &chunk.blocks[chunk.count++];
+	}
+
+	blk->refs = 1;
+	return blk;
+}
+
+void VM::MemAccess::releaseBlock(MemoryBlock *blk) {
+	blk->refs--;
+	if (blk->refs == 0) {
+		memset(blk->data, 0, PAGE_SIZE);
+		_freeBlocks.push_back(blk);
+	}
+}
+
+/* returns block of page which can be written, allocating it or
+   making private copy of block shared with snapshot */
+VM::MemoryBlock *VM::MemAccess::createBlock(uint32 address) {
+	const uint32 page = address >> PAGE_SHIFT;
+	if (page >= _pages.size())
+		growPages(page + 1);
+
+	MemoryBlock *blk = _pages[page];
+	if (blk == &_zeroBlock) {
+		blk = allocBlock();
+		_pages[page] = blk;
+	} else if (blk->refs > 1) {
+		MemoryBlock *copy = allocBlock();
+		memcpy(copy->data, blk->data, PAGE_SIZE);
+		blk->refs--;
+		blk = copy;
+		_pages[page] = blk;
+	}
+
+	markDirty(page);
+
+	if (canWriteDirect(page))
+		_writePages[page] = blk;
+
+	return blk;
+}
+
+void VM::MemAccess::markDirty(uint32 page) {
+	if (_pageFlags[page] & PAGE_DIRTY)
+		return;
+
+	_pageFlags[page] |= PAGE_DIRTY;
+	_dirtyPages.push_back(page);
+}
+
+void VM::MemAccess::clearDirty() {
+	for (uint32 page : _dirtyPages) {
+		_pageFlags[page] &= ~PAGE_DIRTY;
+		_writePages[page] = nullptr;
+	}
+
+	_dirtyPages.clear();
+}
+
+void VM::MemAccess::reserve(uint32 size) {
+	growPages(((uint64)size + PAGE_MASK) >> PAGE_SHIFT);
+}
+
+void VM::MemAccess::setGrowthLimit(uint32 size) {
+	_pageLimit = ((uint64)size + PAGE_MASK) >> PAGE_SHIFT;
+}
+
+void VM::MemAccess::growPages(uint32 pages) {
+	if (pages <= _pages.size())
+		return;
+
+	/* grow geometrically so scattered writes past the end don't reallocate table each time */
+	uint32 newSize = _pages.size() * 2;
+	if (_pageLimit && newSize > _pageLimit)
+		newSize = _pageLimit;
+	if (newSize < pages)
+		newSize = pages;
+
+	_pages.reserve(newSize);
+	_writePages.reserve(newSize);
+	_pageFlags.reserve(newSize);
+	while (_pages.size() < newSize) {
+		_pages.push_back(&_zeroBlock);
+		_writePages.push_back(nullptr);
+		_pageFlags.push_back(0);
+	}
+
+	/* sparse pages now covered by table move into it */
+	Common::Array<uint32> moved;
+	for (Common::HashMap<uint32, MemoryBlock *>::iterator it = _sparsePages.begin(); it != _sparsePages.end(); ++it) {
+		if (it->_key < newSize) {
+			_pages[it->_key] = it->_value;
+			markDirty(it->_key);
+			moved.push_back(it->_key);
+		}
+	}
+	for (uint32 page : moved)
+		_sparsePages.erase(page);
+}
+
+/* false when page is past limit and has to be kept sparse */
+bool VM::MemAccess::growTo(uint32 page) {
+	if (page < _pages.size())
+		return true;
+	if (_pageLimit && page >= _pageLimit)
+		return false;
+
+	growPages(page + 1);
+	return true;
+}
+
+const VM::MemoryBlock *VM::MemAccess::sparseBlock(uint32 page) const {
+	Common::HashMap<uint32, MemoryBlock *>::const_iterator it = _sparsePages.find(page);
+	return it != _sparsePages.end() ? it->_value : &_zeroBlock;
+}
+
+VM::MemoryBlock *VM::MemAccess::writeSparse(uint32 page) {
+	Common::HashMap<uint32, MemoryBlock *>::iterator it = _sparsePages.find(page);
+
+	MemoryBlock *blk;
+	if (it == _sparsePages.end()) {
+		blk = allocBlock();
+		_sparsePages[page] = blk;
+	} else if (it->_value->refs > 1) {
+		blk = allocBlock();
+		memcpy(blk->data, it->_value->data, PAGE_SIZE);
+		it->_value->refs--;
+		it->_value = blk;
+	} else {
+		blk = it->_value;
+	}
+
+	/* there are no masks for these pages */
+	_watchGeneration++;
+	return blk;
+}
+
+void VM::MemAccess::clear() {
+	_dirtyPages.clear();
+
+	for (Common::HashMap<uint32, MemoryBlock *>::iterator it = _sparsePages.begin(); it != _sparsePages.end(); ++it)
+		releaseBlock(it->_value);
+	_sparsePages.clear();
+	_pageLimit = 0;
+
+	for (uint32 i = 0; i < _pages.size(); i++) {
+		_writePages[i] = nullptr;
+		_pageFlags[i] = 0;
+
+		if (_pages[i] != &_zeroBlock) {
+			releaseBlock(_pages[i]);
+			_pages[i] = &_zeroBlock;
+			markDirty(i);
+		}
+	}
+
+	_codeMasks.clear();
+	_codeGeneration++;
+
+	_watchMasks.clear();
+	_watchGeneration++;
+}
+
+void VM::MemAccess::write(uint32 address, const byte *data, uint32 dataSize) {
+	uint32 pos = 0;
+	while (pos < dataSize) {
+		const uint32 addr = address + pos;
+		const uint32 blockPos = addr & PAGE_MASK;
+		uint32 copyCnt = PAGE_SIZE - blockPos;
+		if (copyCnt > dataSize - pos)
+			copyCnt = dataSize - pos;
+
+		if (!growTo(addr >> PAGE_SHIFT)) {
+			memcpy(writeSparse(addr >> PAGE_SHIFT)->data + blockPos, data + pos, copyCnt);
+			pos += copyCnt;
+			continue;
+		}
+
+		MemoryBlock *blk = createBlock(addr);
+		if (_pageFlags[addr >> PAGE_SHIFT] & PAGE_CODE)
+			checkCodeWrite(addr >> PAGE_SHIFT, blockPos, copyCnt);
+		if (_pageFlags[addr >> PAGE_SHIFT] & PAGE_WATCH)
+			checkWatchWrite(addr >> PAGE_SHIFT, blockPos, copyCnt);
+
+		memcpy(blk->data + blockPos, data + pos, copyCnt);
+		pos += copyCnt;
+	}
+}
+
+void VM::MemAccess::read(byte *dst, uint32 address, uint32 count) const {
+	uint32 pos = 0;
+	while (pos < count) {
+		const uint32 addr = address + pos;
+		const uint32 blockPos = addr & PAGE_MASK;
+		uint32 copyCnt = PAGE_SIZE - blockPos;
+		if (copyCnt > count - pos)
+			copyCnt = count - pos;
+
+		memcpy(dst + pos, pageBlock(addr >> PAGE_SHIFT)->data + blockPos, copyCnt);
+		pos += copyCnt;
+	}
+}
+
+void VM::MemAccess::zero(uint32 address, uint32 count) {
+	uint32 pos = 0;
+	while (pos < count) {
+		const uint32 addr = address + pos;
+		const uint32 blockPos = addr & PAGE_MASK;
+		uint32 zeroCnt = PAGE_SIZE - blockPos;
+		if (zeroCnt > count - pos)
+			zeroCnt = count - pos;
+
+		const uint32 page = addr >> PAGE_SHIFT;
+		if (page < _pages.size() && _pages[page] != &_zeroBlock) {
+			if (_pageFlags[page] & PAGE_CODE)
+				checkCodeWrite(page, blockPos, zeroCnt);
+			if (_pageFlags[page] & PAGE_WATCH)
+				checkWatchWrite(page, blockPos, zeroCnt);
+			memset(createBlock(addr)->data + blockPos, 0, zeroCnt);
+		} else if (page >= _pages.size() && _sparsePages.contains(page)) {
+			memset(writeSparse(page)->data + blockPos, 0, zeroCnt);
+		}
+
+		pos += zeroCnt;
+	}
+}
+
+void VM::MemAccess::markCode(uint32 address, uint32 count) {
+	reserve(address + count);
+
+	for (uint32 i = 0; i < count; i++) {
+		const uint32 addr = address + i;
+		const uint32 page = addr >> PAGE_SHIFT;
+		const uint32 pos = addr & PAGE_MASK;
+
+		CodeMask &mask = _codeMasks.getOrCreateVal(page);
+		mask.bits[pos >> 5] |= 1 << (pos & 31);
+
+		_pageFlags[page] |= PAGE_CODE;
+		_writePages[page] = nullptr;
+	}
+}
+
+void VM::MemAccess::invalidateCode() {
+	for (Common::HashMap<uint32, CodeMask>::iterator it = _codeMasks.begin(); it != _codeMasks.end(); ++it) {
+		const uint32 page = it->_key;
+		_pageFlags[page] &= ~PAGE_CODE;
+		if (_pages[page] != &_zeroBlock && _pages[page]->refs == 1 && (_pageFlags[page] & PAGE_DIRTY) && canWriteDirect(page))
+			_writePages[page] = _pages[page];
+	}
+
+	_codeMasks.clear();
+	_codeGeneration++;
+}
+
+void VM::MemAccess::checkCodeWrite(uint32 page, uint32 pos, uint32 count) {
+	Common::HashMap<uint32, CodeMask>::const_iterator it = _codeMasks.find(page);
+	if (it == _codeMasks.end())
+		return;
+
+	for (uint32 i = pos; i < pos + count; i++) {
+		if (it->_value.bits[i >> 5] & (1 << (i & 31))) {
+			invalidateCode();
+			return;
+		}
+	}
+}
+
+void VM::MemAccess::markWatch(uint32 address, uint32 count) {
+	for (uint32 i = 0; i < count; i++) {
+		const uint32 addr = address + i;
+		const uint32 page = addr >> PAGE_SHIFT;
+		const uint32 pos = addr & PAGE_MASK;
+
+		/* sparse pages bump generation on every write */
+		if (!growTo(page))
+			continue;
+
+		CodeMask &mask = _watchMasks.getOrCreateVal(page);
+		mask.bits[pos >> 5] |= 1 << (pos & 31);
+
+		_pageFlags[page] |= PAGE_WATCH;
+		_writePages[page] = nullptr;
+	}
+}
+
+void VM::MemAccess::checkWatchWrite(uint32 page, uint32 pos, uint32 count) {
+	Common::HashMap<uint32, CodeMask>::const_iterator it = _watchMasks.find(page);
+	if (it == _watchMasks.end())
+		return;
+
+	for (uint32 i = pos; i < pos + count; i++) {
+		if (it->_value.bits[i >> 5] & (1 << (i & 31))) {
+			_watchGeneration++;
+			return;
+		}
+	}
+}
+
+
+void VM::MemAccess::takeSnapshot(MemSnapshot &snap) {
+	snap.release();
+	snap._mem = this;
+	snap._pages.resize(_pages.size());
+
+	for (uint32 i = 0; i < _pages.size(); i++) {
+		MemoryBlock *blk = _pages[i];
+		if (blk == &_zeroBlock) {
+			snap._pages[i] = nullptr;
+		} else {
+			blk->refs++;
+			snap._pages[i] = blk;
+			_writePages[i] = nullptr;
+		}
+	}
+
+	for (Common::HashMap<uint32, MemoryBlock *>::iterator it = _sparsePages.begin(); it != _sparsePages.end(); ++it) {
+		it->_value->refs++;
+		snap._sparsePages[it->_key] = it->_value;
+	}
+}
+
+void VM::MemAccess::restoreSnapshot(const MemSnapshot &snap) {
+	if (!restore(snap, false))
+		return;
+
+	/* restored bytes may overlap decoded scripts and watched bytes */
+	invalidateCode();
+	_watchGeneration++;
+}
+
+void VM::MemAccess::rollback(const MemSnapshot &snap) {
+	restore(snap, true);
+}
+
+bool VM::MemAccess::restore(const MemSnapshot &snap, bool checkWrites) {
+	/* blocks of other memory would be released into our free list */
+	if (snap._mem != this) {
+		warning("VM: snapshot is not of this memory");
+		return false;
+	}
+
+	growPages(snap._pages.size());
+
+	for (uint32 i = 0; i < _pages.size(); i++) {
+		MemoryBlock *blk = snap.block(i);
+		if (_pages[i] == blk || (_pages[i] == &_zeroBlock && !blk))
+			continue;
+
+		if (checkWrites && (_pageFlags[i] & (PAGE_CODE | PAGE_WATCH)))
+			checkRestore(i, blk ? blk : &_zeroBlock);
+
+		if (_pages[i] != &_zeroBlock)
+			releaseBlock(_pages[i]);
+
+		if (blk) {
+			blk->refs++;
+			_pages[i] = blk;
+		} else {
+			_pages[i] = &_zeroBlock;
+		}
+		_writePages[i] = nullptr;
+		markDirty(i);
+	}
+
+	/* sparse pages have no masks, any of them may hold watched bytes */
+	if (checkWrites && (!_sparsePages.empty() || !snap._sparsePages.empty()))
+		_watchGeneration++;
+
+	for (Common::HashMap<uint32, MemoryBlock *>::iterator it = _sparsePages.begin(); it != _sparsePages.end(); ++it)
+		releaseBlock(it->_value);
+	_sparsePages.clear();
+
+	/* ones table grew over are restored by loop above */
+	for (Common::HashMap<uint32, MemoryBlock *>::const_iterator it = snap._sparsePages.begin(); it != snap._sparsePages.end(); ++it) {
+		if (it->_key >= _pages.size()) {
+			it->_value->refs++;
+			_sparsePages[it->_key] = it->_value;
+		}
+	}
+
+	return true;
+}
+
+/* Restoring page to blk is write of bytes which differ, so decoded code
+   and watches of the rest stay valid */
+void VM::MemAccess::checkRestore(uint32 page, const MemoryBlock *blk) {
+	const byte *cur = _pages[page]->data;
+
+	uint32 pos = 0;
+	while (pos < PAGE_SIZE) {
+		if (cur[pos] == blk->data[pos]) {
+			pos++;
+			continue;
+		}
+
+		uint32 end = pos + 1;
+		while (end < PAGE_SIZE && cur[end] != blk->data[end])
+			end++;
+
+		if (_pageFlags[page] & PAGE_CODE)
+			checkCodeWrite(page, pos, end - pos);
+		if (_pageFlags[page] & PAGE_WATCH)
+			checkWatchWrite(page, pos, end - pos);
+		pos = end;
+	}
+}
+
+
+
+void VM::MemSnapshot::release() {
+	if (!_mem)
+		return;
+
+	for (MemoryBlock *blk : _pages) {
+		if (blk)
+			_mem->releaseBlock(blk);
+	}
+	for (Common::HashMap<uint32, MemoryBlock *>::iterator it = _sparsePages.begin(); it != _sparsePages.end(); ++it)
+		_mem->releaseBlock(it->_value);
+
+	_pages.clear();
+	_sparsePages.clear();
+	_mem = nullptr;
+}
+
+VM::MemoryBlock *VM::MemSnapshot::block(uint32 page) const {
+	if (page < _pages.size())
+		return _pages[page];
+
+	Common::HashMap<uint32, MemoryBlock *>::const_iterator it = _sparsePages.find(page);
+	return it != _sparsePages.end() ? it->_value : nullptr;
+}
+
+void VM::MemSnapshot::read(byte *dst, uint32 address, uint32 count) const {
+	uint32 pos = 0;
+	while (pos < count) {
+		const uint32 addr = address + pos;
+		const uint32 blockPos = addr & PAGE_MASK;
+		uint32 copyCnt = PAGE_SIZE - blockPos;
+		if (copyCnt > count - pos)
+			copyCnt = count - pos;
+
+		const MemoryBlock *blk = block(addr >> PAGE_SHIFT);
+		if (blk)
+			memcpy(dst + pos, blk->data + blockPos, copyCnt);
+		else
+			memset(dst + pos, 0, copyCnt);
+
+		pos += copyCnt;
+	}
+}
+
+/* Format: page table size, then (page index, page data) for every nonzero
+   page and 0xffffffff at end. Sparse pages have index past table size. */
+void VM::MemSnapshot::save(Common::WriteStream *stream) const {
+	stream->writeUint32LE(_pages.size());
+
+	for (uint32 i = 0; i < _pages.size(); i++) {
+		if (_pages[i]) {
+			stream->writeUint32LE(i);
+			stream->write(_pages[i]->data, PAGE_SIZE);
+		}
+	}
+
+	for (Common::HashMap<uint32, MemoryBlock *>::const_iterator it = _sparsePages.begin(); it != _sparsePages.end(); ++it) {
+		stream->writeUint32LE(it->_key);
+		stream->write(it->_value->data, PAGE_SIZE);
+	}
+
+	stream->writeUint32LE(0xffffffff);
+}
+
+bool VM::MemSnapshot::load(MemAccess *mem, Common::ReadStream *stream) {
+	release();
+
+	const uint32 count = stream->readUint32LE();
+	if (count > (ADDRESS_MASK >> PAGE_SHIFT) + 1)
+		return false;
+
+	_mem = mem;
+	_pages.resize(count);
+	for (uint32 i = 0; i < count; i++)
+		_pages[i] = nullptr;
+
+	while (true) {
+		const uint32 page = stream->readUint32LE();
+		if (stream->err() || stream->eos() || (page != 0xffffffff && (page > (ADDRESS_MASK >> PAGE_SHIFT) || block(page)))) {
+			release();
+			return false;
+		}
+
+		if (page == 0xffffffff)
+			break;
+
+		MemoryBlock *blk = mem->allocBlock();
+		if (page < count)
+			_pages[page] = blk;
+		else
+			_sparsePages[page] = blk;
+		if (stream->read(blk->data, PAGE_SIZE) != PAGE_SIZE) {
+			release();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+
+VM::CodeCache::~CodeCache() {
+	for (Region *r : _regions)
+		delete r;
+	for (Region *r : _retired)
+		delete r;
+	for (LoopIdiom *loop : _loops)
+		delete loop;
+	for (LoopIdiom *loop : _retiredLoops)
+		delete loop;
+}
+
+const VM::Instr *VM::CodeCache::get(uint32 address) {
+	if (_generation != _mem._codeGeneration)
+		flush();
+
+	Common::HashMap<uint32, const Instr *>::const_iterator it = _entries.find(address);
+	if (it != _entries.end())
+		return it->_value;
+
+	const Instr *entry = decode(address);
+	_entries[address] = entry;
+	return entry;
+}
+
+void VM::CodeCache::flush() {
+	for (Region *r : _regions)
+		_retired.push_back(r);
+	for (LoopIdiom *loop : _loops)
+		_retiredLoops.push_back(loop);
+
+	_regions.clear();
+	_loops.clear();
+	_entries.clear();
+	_generation = _mem._codeGeneration;
+
+	if (!_active)
+		freeRetired();
+}
+
+void VM::CodeCache::freeRetired() {
+	for (Region *r : _retired)
+		delete r;
+	_retired.clear();
+
+	for (LoopIdiom *loop : _retiredLoops)
+		delete loop;
+	_retiredLoops.clear();
+}
+
+static bool opHasImmediate(byte op) {
+	switch (op) {
+	case VM::OP_BRANCH:
+	case VM::OP_JMP:
+	case VM::OP_SP_ADD:
+	case VM::OP_MOV_EDI_ECX_AL:
+	case VM::OP_MOV_EBX_ECX_AL:
+	case VM::OP_MOV_EDI_ECX_EAX:
+	case VM::OP_MOV_EBX_ECX_EAX:
+	case VM::OP_RETX:
+	case VM::OP_LOAD:
+	case VM::OP_LOAD_OFFSET_EDI:
+	case VM::OP_LOAD_OFFSET_EDI2:
+	case VM::OP_LOAD_OFFSET_EBX:
+	case VM::OP_LOAD_OFFSET_ESP:
+	case VM::OP_MOV_EAX_BPTR_EDI:
+	case VM::OP_MOV_EAX_BPTR_EBX:
+	case VM::OP_MOV_EAX_DPTR_EDI:
+	case VM::OP_MOV_EAX_DPTR_EBX:
+	case VM::OP_PUSH_ESI_ADD_EDI:
+	case VM::OP_CALL_FUNC:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool opIsTerminator(byte op) {
+	switch (op) {
+	case VM::OP_JMP:
+	case VM::OP_RET:
+	case VM::OP_RETX:
+	case VM::OP_PUSH_ESI_ADD_EDI:
+	case VM::OP_PUSH_ESI_SET_EDX_EDI:
+		return true;
+	default:
+		return op == VM::OP_EXIT || op >= VM::OP_MAX;
+	}
+}
+
+static uint16 specialisePtrOp(uint16 generic, uint memtype) {
+	switch (memtype) {
+	case VM::REF_STACK:
+		return generic + 1;
+	case VM::REF_EBX:
+		return generic + 2;
+	case VM::REF_EDI:
+		return generic + 3;
+	default:
+		return generic;
+	}
+}
+
+void VM::RegTypes::update(byte op) {
+	switch (op) {
+	case OP_CMP_EQ:
+	case OP_CMP_NE:
+	case OP_CMP_LE:
+	case OP_CMP_LEQ:
+	case OP_CMP_GR:
+	case OP_CMP_GREQ:
+	case OP_CMP_NAE:
+	case OP_CMP_NA:
+	case OP_CMP_A:
+	case OP_CMP_AE:
+	case OP_ADD_EAX_EDX:
+	case OP_MUL:
+	case OP_OR:
+	case OP_XOR:
+	case OP_AND:
+	case OP_NEG:
+	case OP_SAR:
+	case OP_SHL:
+	case OP_LOAD:
+	case OP_INC:
+	case OP_DEC:
+	case OP_SHL_2:
+	case OP_ADD_4:
+	case OP_SUB_4:
+	case OP_NEG_ADD:
+	case OP_MOV_EAX_BPTR_EDI:
+	case OP_MOV_EAX_BPTR_EBX:
+	case OP_MOV_EAX_DPTR_EDI:
+	case OP_MOV_EAX_DPTR_EBX:
+	case OP_MOV_EAX_BPTR_EAX:
+	case OP_MOV_EAX_DPTR_EAX:
+		eax = REF_UNK;
+		break;
+
+	case OP_SP_ADD:
+		depth = 0;
+		break;
+
+	case OP_MOV_EDX_EAX:
+		edx = eax;
+		break;
+
+	case OP_XCHG: {
+		uint8 tmp = eax;
+		eax = edx;
+		edx = tmp;
+		break;
+	}
+
+	case OP_PUSH_EAX:
+		push(eax);
+		break;
+
+	case OP_POP_EDX:
+		edx = pop();
+		break;
+
+	case OP_LOAD_OFFSET_EDI:
+	case OP_LOAD_OFFSET_EDI2:
+		eax = REF_EDI;
+		break;
+
+	case OP_LOAD_OFFSET_EBX:
+		eax = REF_EBX;
+		break;
+
+	case OP_LOAD_OFFSET_ESP:
+		eax = REF_STACK;
+		break;
+
+	case OP_XCHG_ESP: {
+		uint8 tmp = pop();
+		push(eax);
+		eax = tmp;
+		break;
+	}
+
+	case OP_DIV:
+		eax = REF_UNK;
+		edx = REF_UNK;
+		break;
+
+	case OP_CALL_FUNC:
+		/* dispatcher can pop arguments and set registers */
+		reset();
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* Keep only types that are same in both, stacks are compared from top.
+   Returns true if anything was changed */
+bool VM::RegTypes::merge(const RegTypes &other) {
+	bool changed = false;
+
+	if (eax != other.eax && eax != REF_UNK) {
+		eax = REF_UNK;
+		changed = true;
+	}
+
+	if (edx != other.edx && edx != REF_UNK) {
+		edx = REF_UNK;
+		changed = true;
+	}
+
+	if (other.depth < depth) {
+		memmove(stack, stack + depth - other.depth, other.depth * sizeof(stack[0]));
+		depth = other.depth;
+		changed = true;
+	}
+
+	for (uint i = 0; i < depth; i++) {
+		const uint8 tp = other.stack[other.depth - depth + i];
+		if (stack[i] != tp && stack[i] != REF_UNK) {
+			stack[i] = REF_UNK;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+/* Stack bytes pushed by instruction, negative when it pops */
+static int32 opStackUse(byte op, uint32 imm) {
+	switch (op) {
+	case VM::OP_PUSH_EAX:
+	case VM::OP_PUSH_ESI_ADD_EDI:
+	case VM::OP_PUSH_ESI_SET_EDX_EDI:
+		return 4;
+	case VM::OP_POP_EDX:
+	case VM::OP_RET:
+		return -4;
+	case VM::OP_RETX:
+		return -4 - (int32)imm;
+	case VM::OP_SP_ADD:
+		return -(int32)imm;
+	default:
+		return 0;
+	}
+}
+
+/* Does instruction touch storage other than stack and object storage (EBX),
+   pointer accesses are judged by known type of pointer register */
+static bool opIsLocal(byte op, const VM::RegTypes &types) {
+	switch (op) {
+	case VM::OP_MOV_EDI_ECX_AL:
+	case VM::OP_MOV_EDI_ECX_EAX:
+	case VM::OP_MOV_EAX_BPTR_EDI:
+	case VM::OP_MOV_EAX_DPTR_EDI:
+	case VM::OP_CALL_FUNC:
+		return false;
+	case VM::OP_MOV_PTR_EDX_AL:
+	case VM::OP_MOV_PTR_EDX_EAX:
+		return types.edx == VM::REF_STACK || types.edx == VM::REF_EBX;
+	case VM::OP_MOV_EAX_BPTR_EAX:
+	case VM::OP_MOV_EAX_DPTR_EAX:
+		return types.eax == VM::REF_STACK || types.eax == VM::REF_EBX;
+	default:
+		return op < VM::OP_MAX;
+	}
+}
+
+/* Splits script reachable from address into basic blocks and propagates
+   register types and stack depth over them. Returns false if script runs
+   into never written memory or is too large. */
+bool VM::analyzeScript(const MemAccess &mem, uint32 address, ScriptCFG &cfg) {
+	static constexpr const uint32 MAX_INSTRUCTIONS = 0x10000;
+
+	cfg.entry = address;
+	cfg.blocks.clear();
+	cfg.blockIndex.clear();
+
+	/* Find all instructions reachable from entry and all block leaders */
+	Common::HashMap<uint32, bool> visited;
+	Common::HashMap<uint32, bool> leaders;
+	Common::HashMap<uint32, bool> labels;
+	Common::HashMap<uint32, bool> returnSites;
+	Common::Array<uint32> worklist;
+
+	worklist.push_back(address);
+	labels[address] = true;
+
+	while (!worklist.empty()) {
+		uint32 addr = worklist.back();
+		worklist.pop_back();
+
+		if (visited.contains(addr))
+			continue;
+
+		leaders[addr] = true;
+
+		while (true) {
+			if (visited.size() >= MAX_INSTRUCTIONS) {
+				warning("VM: script at %x too large to decode", address);
+				return false;
+			}
+
+			/* never written memory, leave it to interpreter */
+			if (!mem.findMemoryBlock(addr))
+				return false;
+
+			visited[addr] = true;
+
+			const byte op = mem.getU8(addr);
+			const uint32 next = addr + (opHasImmediate(op) ? 5 : 1);
+
+			if (op == OP_BRANCH || op == OP_JMP) {
+				const uint32 target = addr + 1 + mem.getU32(addr + 1);
+				labels[target] = true;
+				worklist.push_back(target);
+				if (op == OP_BRANCH) {
+					leaders[next] = true;
+					worklist.push_back(next);
+					break;
+				}
+			} else if (op == OP_PUSH_ESI_ADD_EDI || op == OP_PUSH_ESI_SET_EDX_EDI) {
+				/* callee returns to pushed ESI + 4, both push address of
+				   byte after opcode so it is addr + 5 even for 1 byte op */
+				const uint32 ret = addr + 5;
+				labels[ret] = true;
+				returnSites[ret] = true;
+				worklist.push_back(ret);
+			}
+
+			if (opIsTerminator(op))
+				break;
+
+			addr = next;
+			if (visited.contains(addr)) {
+				/* falls into code found before, it is join point */
+				labels[addr] = true;
+				break;
+			}
+		}
+	}
+
+	for (Common::HashMap<uint32, bool>::const_iterator it = labels.begin(); it != labels.end(); ++it)
+		leaders[it->_key] = true;
+
+	Common::Array<uint32> starts;
+	for (Common::HashMap<uint32, bool>::const_iterator it = leaders.begin(); it != leaders.end(); ++it)
+		starts.push_back(it->_key);
+	Common::sort(starts.begin(), starts.end());
+
+	cfg.blocks.resize(starts.size());
+	for (uint32 i = 0; i < starts.size(); i++) {
+		cfg.blockIndex[starts[i]] = i;
+		cfg.blocks[i].start = starts[i];
+		cfg.blocks[i].label = labels.contains(starts[i]);
+	}
+
+	/* Block ends on terminator, branch or next leader */
+	for (BasicBlock &blk : cfg.blocks) {
+		uint32 addr = blk.start;
+		while (true) {
+			const byte op = mem.getU8(addr);
+			const uint32 next = addr + (opHasImmediate(op) ? 5 : 1);
+
+			if (op == OP_BRANCH || op == OP_JMP)
+				blk.succs.push_back(addr + 1 + mem.getU32(addr + 1));
+			if (op == OP_BRANCH || (!opIsTerminator(op) && leaders.contains(next)))
+				blk.succs.push_back(next);
+
+			if (op == OP_BRANCH || opIsTerminator(op) || leaders.contains(next)) {
+				blk.end = next;
+				break;
+			}
+
+			addr = next;
+		}
+	}
+
+	/* Propagate types and stack depth until nothing changes. Entry and
+	   return sites start with unknown types, return site has depth of call. */
+	Common::Array<uint32> pending;
+
+	const int32 entryIndex = cfg.indexOf(address);
+	if (entryIndex < 0)
+		return false;
+
+	cfg.blocks[entryIndex].reached = true;
+	pending.push_back(entryIndex);
+
+	while (!pending.empty()) {
+		BasicBlock &blk = cfg.blocks[pending.back()];
+		pending.pop_back();
+
+		RegTypes types = blk.entryTypes;
+		int32 depth = blk.entryDepth;
+		int32 maxDepth = 0;
+		bool local = true;
+
+		uint32 addr = blk.start;
+		while (addr < blk.end) {
+			const byte op = mem.getU8(addr);
+			const uint32 imm = opHasImmediate(op) ? mem.getU32(addr + 1) : 0;
+
+			if (!opIsLocal(op, types))
+				local = false;
+
+			types.update(op);
+
+			if (op == OP_PUSH_ESI_ADD_EDI || op == OP_PUSH_ESI_SET_EDX_EDI) {
+				const int32 retIndex = cfg.indexOf(addr + 5);
+				if (retIndex < 0)
+					return false;
+
+				BasicBlock &ret = cfg.blocks[retIndex];
+				if (!ret.reached || depth > ret.entryDepth) {
+					ret.entryDepth = depth;
+					ret.reached = true;
+					pending.push_back(retIndex);
+				}
+			}
+
+			depth += opStackUse(op, imm);
+			if (depth - blk.entryDepth > maxDepth)
+				maxDepth = depth - blk.entryDepth;
+
+			addr += opHasImmediate(op) ? 5 : 1;
+		}
+
+		blk.maxDepth = maxDepth;
+		blk.localOnly = local;
+
+		for (uint32 succ : blk.succs) {
+			const int32 nextIndex = cfg.indexOf(succ);
+			if (nextIndex < 0)
+				return false;
+
+			BasicBlock &next = cfg.blocks[nextIndex];
+
+			RegTypes in = types;
+			if (returnSites.contains(succ) || succ == address)
+				in.reset();
+
+			int32 nextDepth = depth;
+			/* depth which grows in loop is not bounded */
+			if (nextDepth > (int32)STACK_SIZE) {
+				nextDepth = STACK_SIZE;
+				cfg.stackBounded = false;
+			}
+
+			bool changed = false;
+			if (!next.reached) {
+				next.reached = true;
+				next.entryTypes = in;
+				next.entryDepth = nextDepth;
+				changed = true;
+			} else {
+				changed = next.entryTypes.merge(in);
+				if (nextDepth > next.entryDepth) {
+					next.entryDepth = nextDepth;
+					changed = true;
+				}
+			}
+
+			if (changed)
+				pending.push_back(nextIndex);
+		}
+	}
+
+	for (const BasicBlock &blk : cfg.blocks) {
+		if (blk.entryDepth + blk.maxDepth > cfg.maxStack)
+			cfg.maxStack = blk.entryDepth + blk.maxDepth;
+		if (!blk.localOnly)
+			cfg.localOnly = false;
+	}
+
+	return true;
+}
+
+namespace {
+
+/* Value of register or stack slot at analysis time. Registers at entry and
+   stack bytes not written by script keep values of previous script, they
+   are UNDEF and result of pure script must not depend on them. */
+struct PureVal {
+	enum KIND {
+		CONST = 0,
+		UNKNOWN = 1,
+		UNDEF = 2
+	};
+
+	uint8 kind = UNKNOWN;
+	uint32 value = 0;
+
+	PureVal() {}
+	explicit PureVal(uint32 v) : kind(CONST), value(v) {}
+
+	static PureVal undef() {
+		PureVal val;
+		val.kind = UNDEF;
+		return val;
+	}
+
+	bool known() const {
+		return kind == CONST;
+	}
+
+	bool operator==(const PureVal &other) const {
+		return kind == other.kind && (kind != CONST || value == other.value);
+	}
+
+	/* Returns true if changed */
+	bool merge(const PureVal &other) {
+		if (*this == other || kind == UNDEF)
+			return false;
+
+		kind = other.kind == UNDEF ? UNDEF : UNKNOWN;
+		return true;
+	}
+};
+
+/* Result of operation on values a and b, v is used when both are known */
+static PureVal pureOp(const PureVal &a, const PureVal &b, uint32 v) {
+	if (a.kind == PureVal::UNDEF || b.kind == PureVal::UNDEF)
+		return PureVal::undef();
+	if (a.known() && b.known())
+		return PureVal(v);
+	return PureVal();
+}
+
+/* Same for operations which are not folded */
+static PureVal pureOp(const PureVal &a, const PureVal &b) {
+	if (a.kind == PureVal::UNDEF || b.kind == PureVal::UNDEF)
+		return PureVal::undef();
+	return PureVal();
+}
+
+struct PureState {
+	bool reached = false;
+	int32 depth = 0;
+	PureVal eax;
+	PureVal edx;
+	Common::Array<PureVal> stack;   /* values pushed inside of script, top is last */
+	uint32 written[VM::STACK_POS / 32];  /* stack bytes written by script */
+
+	PureState() {
+		eax = PureVal::undef();
+		edx = PureVal::undef();
+		memset(written, 0, sizeof(written));
+	}
+
+	void setWritten(uint32 offset, uint32 size, bool defined) {
+		for (uint32 i = offset; i < offset + size; i++) {
+			if (defined)
+				written[i >> 5] |= 1 << (i & 31);
+			else
+				written[i >> 5] &= ~(1 << (i & 31));
+		}
+	}
+
+	bool isWritten(uint32 offset, uint32 size) const {
+		for (uint32 i = offset; i < offset + size; i++) {
+			if (!(written[i >> 5] & (1 << (i & 31))))
+				return false;
+		}
+		return true;
+	}
+
+	void push(const PureVal &val) {
+		depth += 4;
+		if (depth <= (int32)VM::STACK_POS)
+			setWritten(VM::STACK_POS - depth, 4, val.kind != PureVal::UNDEF);
+		stack.push_back(val);
+	}
+
+	PureVal pop() {
+		PureVal val;
+		if (!stack.empty()) {
+			val = stack.back();
+			stack.pop_back();
+		} else if (depth < 4 || !isWritten(VM::STACK_POS - depth, 4)) {
+			val = PureVal::undef();
+		}
+		depth -= 4;
+		return val;
+	}
+
+	/* Values which differ become unknown. Returns true if anything was changed */
+	bool merge(const PureState &other) {
+		bool changed = eax.merge(other.eax);
+		changed |= edx.merge(other.edx);
+
+		while (other.stack.size() < stack.size()) {
+			stack.remove_at(0);
+			changed = true;
+		}
+
+		for (uint i = 0; i < stack.size(); i++)
+			changed |= stack[i].merge(other.stack[other.stack.size() - stack.size() + i]);
+
+		for (uint i = 0; i < ARRAYSIZE(written); i++) {
+			if (written[i] & ~other.written[i]) {
+				written[i] &= other.written[i];
+				changed = true;
+			}
+		}
+
+		return changed;
+	}
+};
+
+} // End of anonymous namespace
+
+static void addPureInput(VM::PureScript &info, uint memtype, uint32 offset, uint8 size) {
+	for (const VM::MemRange &r : info.inputs) {
+		if (r.memtype == memtype && r.offset == offset && r.size == size)
+			return;
+	}
+
+	VM::MemRange r;
+	r.memtype = memtype;
+	r.offset = offset;
+	r.size = size;
+	info.inputs.push_back(r);
+}
+
+/* Access through pointer is allowed when address is known and it is
+   either input or stack bytes of script own frame. Returns false for
+   impure access, loaded value is stored to val. */
+static bool purePtrAccess(VM::PureScript &info, PureState &st, const PureVal &ptr, uint8 size, const PureVal *store, PureVal &val) {
+	if (!ptr.known())
+		return false;
+
+	VM::ValAddr addr;
+	addr.setVal(ptr.value);
+
+	val = PureVal();
+
+	switch (addr.getMemType()) {
+	case VM::REF_STACK:
+		if ((int32)addr.getOffset() < (int32)VM::STACK_POS - st.depth || addr.getOffset() + size > VM::STACK_POS)
+			return false;
+
+		if (store) {
+			st.setWritten(addr.getOffset(), size, store->kind != PureVal::UNDEF);
+			/* may overwrite pushed values */
+			st.stack.clear();
+		} else if (!st.isWritten(addr.getOffset(), size)) {
+			val = PureVal::undef();
+		}
+		return true;
+
+	case VM::REF_EBX:
+	case VM::REF_EDI:
+		if (store)
+			return false;
+		addPureInput(info, addr.getMemType(), addr.getOffset(), size);
+		return true;
+
+	default:
+		/* reads give 0 and writes are ignored */
+		if (!store)
+			val = PureVal(0);
+		return true;
+	}
+}
+
+/* Runs script over its CFG with known constants and exact stack depth.
+   Script is pure when it has no stores outside of own stack frame, no calls,
+   no reads with unknown address and its branches and result don't depend
+   on values left by previous scripts. */
+bool VM::analyzePurity(const MemAccess &mem, const ScriptCFG &cfg, PureScript &info) {
+	info.inputs.clear();
+
+	Common::Array<PureState> states(cfg.blocks.size());
+	Common::Array<uint32> pending;
+
+	const int32 entryIndex = cfg.indexOf(cfg.entry);
+	if (entryIndex < 0)
+		return false;
+
+	states[entryIndex].reached = true;
+	pending.push_back(entryIndex);
+
+	while (!pending.empty()) {
+		const BasicBlock &blk = cfg.blocks[pending.back()];
+		PureState st = states[pending.back()];
+		pending.pop_back();
+
+		uint32 addr = blk.start;
+		while (addr < blk.end) {
+			const byte op = mem.getU8(addr);
+			const uint32 imm = opHasImmediate(op) ? mem.getU32(addr + 1) : 0;
+			addr += opHasImmediate(op) ? 5 : 1;
+
+			const PureVal eax = st.eax;
+			const PureVal edx = st.edx;
+
+			switch (op) {
+			case OP_MOV_EDI_ECX_AL:
+			case OP_MOV_EBX_ECX_AL:
+			case OP_MOV_EDI_ECX_EAX:
+			case OP_MOV_EBX_ECX_EAX:
+			case OP_RET:
+			case OP_RETX:
+			case OP_PUSH_ESI_ADD_EDI:
+			case OP_PUSH_ESI_SET_EDX_EDI:
+			case OP_CALL_FUNC:
+				return false;
+
+			case OP_SP_ADD:
+				st.depth -= (int32)imm;
+				st.stack.clear();
+				break;
+
+			case OP_MOV_EDX_EAX:
+				st.edx = eax;
+				break;
+
+			case OP_ADD_EAX_EDX:
+				st.eax = pureOp(eax, edx, eax.value + edx.value);
+				break;
+
+			case OP_LOAD:
+				st.eax = PureVal(imm);
+				break;
+
+			case OP_INC:
+				st.eax = pureOp(eax, eax, eax.value + 1);
+				break;
+
+			case OP_DEC:
+				st.eax = pureOp(eax, eax, eax.value - 1);
+				break;
+
+			case OP_NEG:
+				st.eax = pureOp(eax, eax, (uint32)(-(int32)eax.value));
+				break;
+
+			case OP_SHL_2:
+				st.eax = pureOp(eax, eax, eax.value << 2);
+				break;
+
+			case OP_ADD_4:
+				st.eax = pureOp(eax, eax, eax.value + 4);
+				break;
+
+			case OP_SUB_4:
+				st.eax = pureOp(eax, eax, eax.value - 4);
+				break;
+
+			case OP_XCHG:
+				st.eax = edx;
+				st.edx = eax;
+				break;
+
+			case OP_PUSH_EAX:
+				st.push(eax);
+				break;
+
+			case OP_POP_EDX:
+				st.edx = st.pop();
+				break;
+
+			case OP_XCHG_ESP:
+				st.eax = st.pop();
+				st.push(eax);
+				break;
+
+			case OP_LOAD_OFFSET_EDI:
+			case OP_LOAD_OFFSET_EDI2: {
+				ValAddr val;
+				val.setAddress(REF_EDI, imm);
+				st.eax = PureVal(val.getVal());
+				break;
+			}
+
+			case OP_LOAD_OFFSET_EBX: {
+				ValAddr val;
+				val.setAddress(REF_EBX, imm);
+				st.eax = PureVal(val.getVal());
+				break;
+			}
+
+			case OP_LOAD_OFFSET_ESP: {
+				ValAddr val;
+				val.setAddress(REF_STACK, imm + STACK_POS - st.depth);
+				st.eax = PureVal(val.getVal());
+				break;
+			}
+
+			case OP_MOV_PTR_EDX_AL:
+			case OP_MOV_PTR_EDX_EAX: {
+				PureVal unused;
+				if (!purePtrAccess(info, st, edx, op == OP_MOV_PTR_EDX_AL ? 1 : 4, &eax, unused))
+					return false;
+				break;
+			}
+
+			case OP_MOV_EAX_BPTR_EDI:
+				addPureInput(info, REF_EDI, imm & ADDRESS_MASK, 1);
+				st.eax = PureVal();
+				break;
+
+			case OP_MOV_EAX_DPTR_EDI:
+				addPureInput(info, REF_EDI, imm & ADDRESS_MASK, 4);
+				st.eax = PureVal();
+				break;
+
+			case OP_MOV_EAX_BPTR_EBX:
+				addPureInput(info, REF_EBX, imm, 1);
+				st.eax = PureVal();
+				break;
+
+			case OP_MOV_EAX_DPTR_EBX:
+				addPureInput(info, REF_EBX, imm, 4);
+				st.eax = PureVal();
+				break;
+
+			case OP_MOV_EAX_BPTR_EAX:
+			case OP_MOV_EAX_DPTR_EAX: {
+				PureVal val;
+				if (!purePtrAccess(info, st, eax, op == OP_MOV_EAX_BPTR_EAX ? 1 : 4, nullptr, val))
+					return false;
+				st.eax = val.known() ? PureVal() : val;
+				break;
+			}
+
+			case OP_DIV:
+				st.eax = pureOp(eax, edx);
+				st.edx = st.eax;
+				break;
+
+			case OP_JMP:
+				break;
+
+			case OP_BRANCH:
+				if (eax.kind == PureVal::UNDEF)
+					return false;
+				break;
+
+			default:
+				if (op >= OP_MAX || op == OP_EXIT) {
+					/* script result */
+					if (eax.kind == PureVal::UNDEF)
+						return false;
+				} else {
+					/* comparisons and other arithmetic */
+					st.eax = pureOp(eax, edx);
+				}
+				break;
+			}
+
+			/* reads of caller stack or out of stack buffer */
+			if (st.depth < 0 || st.depth > (int32)STACK_POS)
+				return false;
+		}
+
+		for (uint32 succ : blk.succs) {
+			const int32 index = cfg.indexOf(succ);
+			if (index < 0)
+				return false;
+
+			PureState &next = states[index];
+
+			if (!next.reached) {
+				next = st;
+				next.reached = true;
+				pending.push_back(index);
+			} else if (next.depth != st.depth) {
+				/* depth depends on path */
+				return false;
+			} else if (next.merge(st)) {
+				pending.push_back(index);
+			}
+		}
+	}
+
+	return true;
+}
+
+/* Result of arithmetic opcode, a is EDX and b is EAX */
+static uint32 loopOp(uint8 op, uint32 a, uint32 b) {
+	switch (op) {
+	case VM::OP_CMP_EQ:
+		return a == b ? 1 : 0;
+	case VM::OP_CMP_NE:
+		return a != b ? 1 : 0;
+	case VM::OP_CMP_LE:
+		return (int32)a < (int32)b ? 1 : 0;
+	case VM::OP_CMP_LEQ:
+		return (int32)a <= (int32)b ? 1 : 0;
+	case VM::OP_CMP_GR:
+		return (int32)a > (int32)b ? 1 : 0;
+	case VM::OP_CMP_GREQ:
+		return (int32)a >= (int32)b ? 1 : 0;
+	case VM::OP_CMP_NAE:
+		return a < b ? 1 : 0;
+	case VM::OP_CMP_NA:
+		return a <= b ? 1 : 0;
+	case VM::OP_CMP_A:
+		return a > b ? 1 : 0;
+	case VM::OP_CMP_AE:
+		return a >= b ? 1 : 0;
+	case VM::OP_ADD_EAX_EDX:
+		return b + a;
+	case VM::OP_MUL:
+		return b * a;
+	case VM::OP_OR:
+		return b | a;
+	case VM::OP_XOR:
+		return b ^ a;
+	case VM::OP_AND:
+		return b & a;
+	case VM::OP_NEG:
+		return (uint32)(-(int32)b);
+	case VM::OP_SAR:
+		return (int32)a >> (b & 0xff);
+	case VM::OP_SHL:
+		return a << (b & 0xff);
+	case VM::OP_NEG_ADD:
+		return (-(int32)b) + a;
+	default:
+		return 0;
+	}
+}
+
+namespace {
+
+/* Value in loop iteration. Besides expression it keeps what the value
+   points to, so memory accesses can be sorted into fixed locations and
+   accesses moving with induction vars. */
+struct LoopSym {
+	enum FORM {
+		UNDEF = 0,     /* left by code before iteration */
+		CONST,         /* value */
+		STACK,         /* stack address, value is offset from SP of header */
+		VAR,           /* var + value */
+		OTHER
+	};
+
+	uint8 form = UNDEF;
+	int32 var = -1;
+	uint32 value = 0;
+	uint16 node = 0;
+};
+
+/* Symbolic state of one loop iteration */
+struct LoopState {
+	static constexpr const uint MAX_ACCESSES = 16;
+
+	VM::LoopIdiom &loop;
+	bool failed = false;
+	int32 sp = 0;              /* relative to SP of header */
+	LoopSym eax;
+	LoopSym edx;
+	Common::Array<VM::LoopAccess> stores;  /* to fixed locations */
+	Common::Array<LoopSym> storeVals;
+
+	explicit LoopState(VM::LoopIdiom &l) : loop(l) {
+		/* node 0 is constant 0, default operand */
+		loop.nodes.push_back(VM::LoopNode());
+	}
+
+	uint16 addNode(uint8 kind, uint8 op, uint16 a, uint16 b, uint32 value) {
+		if (loop.nodes.size() >= VM::LoopIdiom::MAX_NODES) {
+			failed = true;
+			return 0;
+		}
+
+		VM::LoopNode n;
+		n.kind = kind;
+		n.op = op;
+		n.a = a;
+		n.b = b;
+		n.value = value;
+		loop.nodes.push_back(n);
+		return loop.nodes.size() - 1;
+	}
+
+	LoopSym constant(uint32 v) {
+		LoopSym s;
+		s.form = LoopSym::CONST;
+		s.value = v;
+		s.node = addNode(VM::LoopNode::N_CONST, 0, 0, 0, v);
+		return s;
+	}
+
+	LoopSym stackAddr(uint32 offset) {
+		LoopSym s;
+		s.form = LoopSym::STACK;
+		s.value = offset;
+		const uint16 sum = addNode(VM::LoopNode::N_OP, VM::OP_ADD_EAX_EDX, addNode(VM::LoopNode::N_SP, 0, 0, 0, 0), constant(offset).node, 0);
+		s.node = addNode(VM::LoopNode::N_ADDR, VM::REF_STACK, sum, 0, 0);
+		return s;
+	}
+
+	LoopSym sext8(const LoopSym &v) {
+		if (v.form == LoopSym::CONST)
+			return constant((int32)(int8)(v.value & 0xff));
+
+		LoopSym s;
+		s.form = v.form == LoopSym::UNDEF ? LoopSym::UNDEF : LoopSym::OTHER;
+		s.node = addNode(VM::LoopNode::N_SEXT8, 0, v.node, 0, 0);
+		return s;
+	}
+
+	/* a is EDX and b is EAX */
+	LoopSym apply(uint8 op, const LoopSym &a, const LoopSym &b) {
+		if (a.form == LoopSym::UNDEF || b.form == LoopSym::UNDEF) {
+			failed = true;
+			return LoopSym();
+		}
+
+		if (a.form == LoopSym::CONST && b.form == LoopSym::CONST)
+			return constant(loopOp(op, a.value, b.value));
+
+		LoopSym s;
+		s.form = LoopSym::OTHER;
+		s.node = addNode(VM::LoopNode::N_OP, op, a.node, b.node, 0);
+
+		/* pointer moved by constant keeps pointing to the same memory */
+		const LoopSym *base = nullptr;
+		uint32 delta = 0;
+		if (op == VM::OP_ADD_EAX_EDX && b.form == LoopSym::CONST) {
+			base = &a;
+			delta = b.value;
+		} else if (op == VM::OP_ADD_EAX_EDX && a.form == LoopSym::CONST) {
+			base = &b;
+			delta = a.value;
+		} else if (op == VM::OP_NEG_ADD && b.form == LoopSym::CONST) {
+			base = &a;
+			delta = 0 - b.value;
+		}
+
+		if (base && base->form != LoopSym::OTHER) {
+			s.form = base->form;
+			s.var = base->var;
+			s.value = base->value + delta;
+		}
+		return s;
+	}
+
+	bool overlap(int32 a, uint8 sizeA, int32 b, uint8 sizeB) const {
+		return a < b + sizeB && b < a + sizeA;
+	}
+
+	int32 findVar(uint8 memtype, int32 offset) {
+		for (uint i = 0; i < loop.vars.size(); i++) {
+			if (loop.vars[i].memtype == memtype && loop.vars[i].offset == offset)
+				return i;
+		}
+
+		if (loop.vars.size() >= VM::LoopIdiom::MAX_VARS) {
+			failed = true;
+			return -1;
+		}
+
+		VM::LoopVar v;
+		v.memtype = memtype;
+		v.offset = offset;
+		loop.vars.push_back(v);
+		return loop.vars.size() - 1;
+	}
+
+	/* addrNode is address of location, used by byte loads */
+	LoopSym loadFixed(uint8 memtype, int32 offset, uint8 size, uint16 addrNode) {
+		if (memtype == VM::REF_UNK)
+			return constant(0);
+
+		for (uint i = 0; i < stores.size(); i++) {
+			if (stores[i].memtype != memtype || !overlap(stores[i].offset, stores[i].size, offset, size))
+				continue;
+
+			if (stores[i].offset != offset || stores[i].size != size) {
+				failed = true;
+				return LoopSym();
+			}
+			return size == 4 ? storeVals[i] : sext8(storeVals[i]);
+		}
+
+		if (size == 4) {
+			LoopSym s;
+			s.var = findVar(memtype, offset);
+			if (s.var < 0)
+				return s;
+			s.form = LoopSym::VAR;
+			s.node = addNode(VM::LoopNode::N_VAR, 0, 0, 0, s.var);
+			return s;
+		}
+
+		bool known = false;
+		for (const VM::LoopAccess &acc : loop.fixed)
+			known |= acc.memtype == memtype && acc.offset == offset && acc.size == size;
+
+		if (!known) {
+			if (loop.fixed.size() >= MAX_ACCESSES) {
+				failed = true;
+				return LoopSym();
+			}
+
+			VM::LoopAccess acc;
+			acc.memtype = memtype;
+			acc.offset = offset;
+			acc.size = size;
+			loop.fixed.push_back(acc);
+		}
+
+		LoopSym s;
+		s.form = LoopSym::OTHER;
+		s.node = addNode(VM::LoopNode::N_LOAD8, 0, addrNode, 0, 0);
+		return s;
+	}
+
+	void storeFixed(uint8 memtype, int32 offset, uint8 size, const LoopSym &val) {
+		if (memtype == VM::REF_UNK)
+			return;
+
+		/* values pushed by iteration are fine until they are used */
+		if (val.form == LoopSym::UNDEF && memtype != VM::REF_STACK) {
+			failed = true;
+			return;
+		}
+
+		for (uint i = 0; i < stores.size(); i++) {
+			if (stores[i].memtype != memtype || !overlap(stores[i].offset, stores[i].size, offset, size))
+				continue;
+
+			if (stores[i].offset != offset || stores[i].size != size)
+				failed = true;
+			else
+				storeVals[i] = val;
+			return;
+		}
+
+		if (stores.size() >= MAX_ACCESSES) {
+			failed = true;
+			return;
+		}
+
+		VM::LoopAccess acc;
+		acc.memtype = memtype;
+		acc.offset = offset;
+		acc.size = size;
+		acc.write = true;
+		stores.push_back(acc);
+		storeVals.push_back(val);
+	}
+
+	/* Fixed address from immediate of EDI or EBX opcode */
+	LoopSym loadDirect(uint8 memtype, uint32 offset, uint8 size) {
+		if (offset > VM::ADDRESS_MASK) {
+			failed = true;
+			return LoopSym();
+		}
+
+		VM::ValAddr addr;
+		addr.setAddress(memtype, offset);
+		return loadFixed(memtype, offset, size, constant(addr.getVal()).node);
+	}
+
+	void storeDirect(uint8 memtype, uint32 offset, uint8 size, const LoopSym &val) {
+		if (offset > VM::ADDRESS_MASK)
+			failed = true;
+		else
+			storeFixed(memtype, offset, size, val);
+	}
+
+	LoopSym loadPtr(const LoopSym &ptr, uint8 size) {
+		VM::ValAddr addr;
+		addr.setVal(ptr.value);
+
+		switch (ptr.form) {
+		case LoopSym::CONST:
+			/* stack addresses are only known relative to SP */
+			if (addr.getMemType() != VM::REF_STACK)
+				return loadFixed(addr.getMemType(), addr.getOffset(), size, ptr.node);
+			break;
+
+		case LoopSym::STACK:
+			return loadFixed(VM::REF_STACK, ptr.value, size, ptr.node);
+
+		case LoopSym::VAR:
+			if (loop.loads.size() < MAX_ACCESSES) {
+				VM::LoopAccess acc;
+				acc.var = ptr.var;
+				acc.offset = ptr.value;
+				acc.size = size;
+				acc.node = addNode(size == 1 ? VM::LoopNode::N_LOAD8 : VM::LoopNode::N_LOAD32, 0, ptr.node, 0, 0);
+				loop.loads.push_back(acc);
+
+				LoopSym s;
+				s.form = LoopSym::OTHER;
+				s.node = acc.node;
+				return s;
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		failed = true;
+		return LoopSym();
+	}
+
+	void storePtr(const LoopSym &ptr, uint8 size, const LoopSym &val) {
+		VM::ValAddr addr;
+		addr.setVal(ptr.value);
+
+		if (val.form == LoopSym::UNDEF) {
+			failed = true;
+			return;
+		}
+
+		switch (ptr.form) {
+		case LoopSym::CONST:
+			if (addr.getMemType() != VM::REF_STACK) {
+				storeFixed(addr.getMemType(), addr.getOffset(), size, val);
+				return;
+			}
+			break;
+
+		case LoopSym::STACK:
+			storeFixed(VM::REF_STACK, ptr.value, size, val);
+			return;
+
+		case LoopSym::VAR:
+			/* only one moving store */
+			if (!loop.store.size) {
+				loop.store.var = ptr.var;
+				loop.store.offset = ptr.value;
+				loop.store.size = size;
+				loop.store.write = true;
+				loop.store.node = val.node;
+				return;
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		failed = true;
+	}
+
+	void push(const LoopSym &val) {
+		sp -= 4;
+		storeFixed(VM::REF_STACK, sp, 4, val);
+	}
+
+	LoopSym pop() {
+		const LoopSym val = loadFixed(VM::REF_STACK, sp, 4, 0);
+		sp += 4;
+		return val;
+	}
+};
+
+/* Value doesn't change between iterations */
+static bool loopInvariant(const VM::LoopIdiom &loop, uint16 index) {
+	const VM::LoopNode &n = loop.nodes[index];
+	switch (n.kind) {
+	case VM::LoopNode::N_VAR:
+		return loop.vars[n.value].step == 0;
+	case VM::LoopNode::N_OP:
+		return loopInvariant(loop, n.a) && loopInvariant(loop, n.b);
+	case VM::LoopNode::N_ADDR:
+	case VM::LoopNode::N_SEXT8:
+	case VM::LoopNode::N_LOAD8:
+	case VM::LoopNode::N_LOAD32:
+		return loopInvariant(loop, n.a);
+	default:
+		return true;
+	}
+}
+
+} // End of anonymous namespace
+
+/* Summarises loop headed at header when it is a single path of blocks
+   without calls, whose iteration is a function of induction vars and
+   memory not written by the loop: at most one store moving with an
+   induction var and any number of such loads, plus temporaries which are
+   written before read. Vars are 32 bit locations read before written and
+   changed by constant step. The loop is classified by what it does with
+   memory, not by the bytecode it was compiled to. */
+bool VM::analyzeLoop(const MemAccess &mem, const ScriptCFG &cfg, uint32 header, LoopIdiom &loop) {
+	static constexpr const uint MAX_BLOCKS = 16;
+
+	if (!cfg.blockIndex.contains(header))
+		return false;
+
+	const uint32 headerIndex = cfg.blockIndex[header];
+
+	/* Natural loop: blocks which reach back edge without passing header */
+	Common::Array<uint8> inBody(cfg.blocks.size());
+	Common::Array<uint32> pending;
+	uint32 bodySize = 1;
+	bool backEdge = false;
+
+	inBody[headerIndex] = true;
+	pending.push_back(headerIndex);
+
+	while (!pending.empty()) {
+		const uint32 to = cfg.blocks[pending.back()].start;
+		pending.pop_back();
+
+		for (uint32 i = 0; i < cfg.blocks.size(); i++) {
+			const BasicBlock &blk = cfg.blocks[i];
+
+			bool pred = false;
+			for (uint32 succ : blk.succs)
+				pred |= succ == to;
+
+			if (!pred || (to == header && blk.start < header))
+				continue;
+
+			backEdge |= to == header;
+			if (inBody[i])
+				continue;
+
+			if (++bodySize > MAX_BLOCKS)
+				return false;
+			inBody[i] = true;
+			pending.push_back(i);
+		}
+	}
+
+	if (!backEdge)
+		return false;
+
+	/* Every block must have one successor inside of loop */
+	Common::Array<uint32> path;
+	uint32 cur = headerIndex;
+	while (true) {
+		path.push_back(cur);
+		if (path.size() > bodySize)
+			return false;
+
+		int32 next = -1;
+		for (uint32 succ : cfg.blocks[cur].succs) {
+			Common::HashMap<uint32, uint32>::const_iterator it = cfg.blockIndex.find(succ);
+			if (it == cfg.blockIndex.end() || !inBody[it->_value])
+				continue;
+			if (next != -1 && next != (int32)it->_value)
+				return false;
+			next = it->_value;
+		}
+
+		if (next == -1)
+			return false;
+		if ((uint32)next == headerIndex)
+			break;
+		cur = next;
+	}
+
+	if (path.size() != bodySize)
+		return false;
+
+	loop.header = header;
+
+	LoopState st(loop);
+
+	for (uint p = 0; p < path.size() && !st.failed; p++) {
+		const BasicBlock &blk = cfg.blocks[path[p]];
+		const uint32 next = cfg.blocks[path[(p + 1) % path.size()]].start;
+
+		uint32 addr = blk.start;
+		while (addr < blk.end && !st.failed) {
+			const byte op = mem.getU8(addr);
+			const uint32 imm = opHasImmediate(op) ? mem.getU32(addr + 1) : 0;
+
+			loop.ops++;
+
+			switch (op) {
+			case OP_CMP_EQ:
+			case OP_CMP_NE:
+			case OP_CMP_LE:
+			case OP_CMP_LEQ:
+			case OP_CMP_GR:
+			case OP_CMP_GREQ:
+			case OP_CMP_NAE:
+			case OP_CMP_NA:
+			case OP_CMP_A:
+			case OP_CMP_AE:
+			case OP_ADD_EAX_EDX:
+			case OP_MUL:
+			case OP_OR:
+			case OP_XOR:
+			case OP_AND:
+			case OP_SAR:
+			case OP_SHL:
+			case OP_NEG_ADD:
+				st.eax = st.apply(op, st.edx, st.eax);
+				break;
+
+			case OP_BRANCH: {
+				const uint32 target = addr + 1 + imm;
+				if (target == addr + 5)
+					break;
+
+				if (st.eax.form == LoopSym::UNDEF || (target != next && addr + 5 != next)) {
+					st.failed = true;
+					break;
+				}
+
+				LoopExit exit;
+				exit.node = st.eax.node;
+				exit.end = loop.nodes.size();
+				exit.continueOnZero = target == next;
+				loop.exits.push_back(exit);
+				break;
+			}
+
+			case OP_JMP:
+				break;
+
+			case OP_SP_ADD:
+				st.sp += (int32)imm;
+				break;
+
+			case OP_MOV_EDI_ECX_AL:
+				st.storeDirect(REF_EDI, imm & ADDRESS_MASK, 1, st.eax);
+				break;
+
+			case OP_MOV_EBX_ECX_AL:
+				st.storeDirect(REF_EBX, imm, 1, st.eax);
+				break;
+
+			case OP_MOV_EDI_ECX_EAX:
+				st.storeDirect(REF_EDI, imm & ADDRESS_MASK, 4, st.eax);
+				break;
+
+			case OP_MOV_EBX_ECX_EAX:
+				st.storeDirect(REF_EBX, imm, 4, st.eax);
+				break;
+
+			case OP_MOV_EDX_EAX:
+				st.edx = st.eax;
+				break;
+
+			case OP_NEG:
+				st.eax = st.apply(op, st.constant(0), st.eax);
+				break;
+
+			case OP_LOAD:
+				st.eax = st.constant(imm);
+				break;
+
+			case OP_INC:
+				st.eax = st.apply(OP_ADD_EAX_EDX, st.constant(1), st.eax);
+				break;
+
+			case OP_DEC:
+				st.eax = st.apply(OP_ADD_EAX_EDX, st.constant(0xffffffff), st.eax);
+				break;
+
+			case OP_XCHG: {
+				const LoopSym tmp = st.eax;
+				st.eax = st.edx;
+				st.edx = tmp;
+				break;
+			}
+
+			case OP_PUSH_EAX:
+				st.push(st.eax);
+				break;
+
+			case OP_POP_EDX:
+				st.edx = st.pop();
+				break;
+
+			case OP_LOAD_OFFSET_EDI:
+			case OP_LOAD_OFFSET_EDI2: {
+				ValAddr a;
+				a.setAddress(REF_EDI, imm);
+				st.eax = st.constant(a.getVal());
+				break;
+			}
+
+			case OP_LOAD_OFFSET_EBX: {
+				ValAddr a;
+				a.setAddress(REF_EBX, imm);
+				st.eax = st.constant(a.getVal());
+				break;
+			}
+
+			case OP_LOAD_OFFSET_ESP:
+				st.eax = st.stackAddr(imm + st.sp);
+				break;
+
+			case OP_MOV_PTR_EDX_AL:
+				st.storePtr(st.edx, 1, st.eax);
+				break;
+
+			case OP_MOV_PTR_EDX_EAX:
+				st.storePtr(st.edx, 4, st.eax);
+				break;
+
+			case OP_SHL_2:
+				st.eax = st.apply(OP_SHL, st.eax, st.constant(2));
+				break;
+
+			case OP_ADD_4:
+				st.eax = st.apply(OP_ADD_EAX_EDX, st.constant(4), st.eax);
+				break;
+
+			case OP_SUB_4:
+				st.eax = st.apply(OP_ADD_EAX_EDX, st.constant(0xfffffffc), st.eax);
+				break;
+
+			case OP_XCHG_ESP: {
+				const LoopSym top = st.pop();
+				st.push(st.eax);
+				st.eax = top;
+				break;
+			}
+
+			case OP_MOV_EAX_BPTR_EDI:
+				st.eax = st.loadDirect(REF_EDI, imm & ADDRESS_MASK, 1);
+				break;
 
+			case OP_MOV_EAX_BPTR_EBX:
+				st.eax = st.loadDirect(REF_EBX, imm, 1);
+				break;
 
-uint8 VM::MemAccess::getU8(uint32 address) {
-	if (!_currentBlock || address < _currentBlock->address || address >= (_currentBlock->address + 0x100))
-		_currentBlock = findMemoryBlock(address);
+			case OP_MOV_EAX_DPTR_EDI:
+				st.eax = st.loadDirect(REF_EDI, imm & ADDRESS_MASK, 4);
+				break;
 
-	if (!_currentBlock)
-		return 0; // ERROR!
+			case OP_MOV_EAX_DPTR_EBX:
+				st.eax = st.loadDirect(REF_EBX, imm, 4);
+				break;
 
-	return _currentBlock->data[ address - _currentBlock->address ];
-}
+			case OP_MOV_EAX_BPTR_EAX:
+				st.eax = st.loadPtr(st.eax, 1);
+				break;
+
+			case OP_MOV_EAX_DPTR_EAX:
+				st.eax = st.loadPtr(st.eax, 4);
+				break;
+
+			default:
+				/* calls, returns, exit and division which may trap */
+				st.failed = true;
+				break;
+			}
 
-uint32 VM::MemAccess::getU32(uint32 address) {
-	if (!_currentBlock || address < _currentBlock->address || address >= (_currentBlock->address + 0x100))
-		_currentBlock = findMemoryBlock(address);
+			addr += opHasImmediate(op) ? 5 : 1;
+		}
+	}
 
-	if (!_currentBlock)
-		return 0; // ERROR!
+	if (st.failed || st.sp != 0 || loop.exits.empty())
+		return false;
 
-	uint32 pos = address - _currentBlock->address;
-	if ((int32)0x100 - (int32)pos >= 4)
-		return VM::getU32(_currentBlock->data + pos); //easy
+	/* Vars must move by constant step and nothing may partially overwrite them */
+	for (uint i = 0; i < loop.vars.size(); i++) {
+		LoopVar &v = loop.vars[i];
 
-	MemoryBlock *block = _currentBlock;
-	uint32 val = block->data[ pos ];
-	for (int i = 1; i < 4; i++) {
-		pos++;
-		if (pos >= 0x100) {
-			block = findMemoryBlock(address + i);
-			if (!block)
-				break;
-			pos = 0;
+		for (uint j = i + 1; j < loop.vars.size(); j++) {
+			if (loop.vars[j].memtype == v.memtype && st.overlap(loop.vars[j].offset, 4, v.offset, 4))
+				return false;
+		}
+
+		LoopAccess acc;
+		acc.memtype = v.memtype;
+		acc.offset = v.offset;
+		acc.size = 4;
+
+		for (uint j = 0; j < st.stores.size(); j++) {
+			const LoopAccess &s = st.stores[j];
+			if (s.memtype != v.memtype || !st.overlap(s.offset, s.size, v.offset, 4))
+				continue;
+
+			const LoopSym &val = st.storeVals[j];
+			if (s.offset != v.offset || s.size != 4 || val.form != LoopSym::VAR || val.var != (int32)i)
+				return false;
+
+			v.step = val.value;
+			acc.write = true;
 		}
-		val |= block->data[ pos ] << (i * 8);
+
+		loop.fixed.push_back(acc);
 	}
 
-	return val;
-}
+	/* Bytes read before written can't be written later */
+	for (const LoopAccess &r : loop.fixed) {
+		if (r.size != 1)
+			continue;
+		for (const LoopAccess &s : st.stores) {
+			if (s.memtype == r.memtype && st.overlap(s.offset, s.size, r.offset, r.size))
+				return false;
+		}
+	}
+
+	for (const LoopAccess &s : st.stores) {
+		bool isVar = false;
+		for (const LoopVar &v : loop.vars)
+			isVar |= v.memtype == s.memtype && v.offset == s.offset;
+		if (!isVar)
+			loop.fixed.push_back(s);
+	}
 
-void VM::MemAccess::setU8(uint32 address, uint8 val) {
-	if (!_currentBlock || address < _currentBlock->address || address >= (_currentBlock->address + 0x100))
-		_currentBlock = findMemoryBlock(address);
+	if (loop.store.size) {
+		const int32 step = loop.vars[loop.store.var].step;
+		if (step != loop.store.size && step != -(int32)loop.store.size)
+			return false;
+
+		uint16 value = loop.store.node;
+		if (loop.store.size == 1 && loop.nodes[value].kind == LoopNode::N_SEXT8)
+			value = loop.nodes[value].a;
+
+		for (uint i = 0; i < loop.loads.size(); i++) {
+			const LoopAccess &l = loop.loads[i];
+			if (l.node == value && l.size == loop.store.size && loop.vars[l.var].step == step) {
+				loop.kind = LoopIdiom::COPY;
+				loop.copyFrom = i;
+				return true;
+			}
+		}
+
+		if (!loopInvariant(loop, loop.store.node))
+			return false;
+
+		loop.kind = LoopIdiom::FILL;
+		return true;
+	}
 
-	if (!_currentBlock)
-		_currentBlock = createBlock(address);
+	if (loop.loads.empty())
+		return false;
 
-	_currentBlock->data[ address - _currentBlock->address ] = val;
+	loop.kind = loop.loads.size() == 1 ? LoopIdiom::LENGTH : LoopIdiom::COMPARE;
+	return true;
 }
 
-void VM::MemAccess::setU32(uint32 address, uint32 val) {
-	if (!_currentBlock || address < _currentBlock->address || address >= (_currentBlock->address + 0x100))
-		_currentBlock = findMemoryBlock(address);
+const VM::Instr *VM::CodeCache::decode(uint32 address) {
+	const MemAccess &mem = _mem;
 
-	if (!_currentBlock)
-		_currentBlock = createBlock(address);
+	ScriptCFG cfg;
+	if (!analyzeScript(mem, address, cfg))
+		return nullptr;
 
-	uint32 pos = address - _currentBlock->address;
+	if (!cfg.stackBounded || cfg.maxStack > (int32)STACK_POS)
+		warning("VM: script at %x may overflow stack (%d bytes%s)", address, cfg.maxStack, cfg.stackBounded ? "" : ", grows in loop");
 
-	if (address + 4 <= _currentBlock->address + 0x100) {
-		VM::setU32(_currentBlock->data + pos, val);
-		return;
+	_blockCount += cfg.blocks.size();
+	for (const BasicBlock &blk : cfg.blocks) {
+		if (blk.localOnly)
+			_localBlockCount++;
+	}
+
+	/* Targets of backward edges may head loops which can run in bulk */
+	Common::HashMap<uint32, LoopIdiom *> loops;
+	for (const BasicBlock &blk : cfg.blocks) {
+		for (uint32 succ : blk.succs) {
+			if (succ > blk.start || loops.contains(succ))
+				continue;
+
+			LoopIdiom *loop = new LoopIdiom();
+			_heapAllocs++;
+			if (analyzeLoop(mem, cfg, succ, *loop)) {
+				loops[succ] = loop;
+				_loops.push_back(loop);
+			} else {
+				delete loop;
+				loops[succ] = nullptr;
+			}
+		}
 	}
 
-	MemoryBlock *block = _currentBlock;
+	/* Emit runs from every label, each linear run is contiguous so
+	   fall-through is ip + 1 */
+	Region *code = new Region();
+	_heapAllocs++;
+	code->reserve(cfg.blocks.size() * 4);
+
+	Common::HashMap<uint32, uint32> index;
+	Common::Array<uint32> targets;
+
+	for (const BasicBlock &start : cfg.blocks) {
+		if (!start.label || index.contains(start.start))
+			continue;
+
+		RegTypes types;
+		uint32 addr = start.start;
+		uint32 barrier = code->size();
+		int prevOp = -1;
+
+		while (true) {
+			if (index.contains(addr)) {
+				Instr jmp;
+				jmp.op = IOP_JMP;
+				jmp.size = 0;
+				jmp.ops = 0;
+				jmp.addr = addr;
+				code->push_back(jmp);
+				targets.push_back(addr);
+				break;
+			}
+
+			const BasicBlock *blk = cfg.findBlock(addr);
+			if (blk && blk->label) {
+				/* types known on every path into label */
+				types = blk->entryTypes;
+				barrier = code->size();
+				prevOp = -1;
+			}
+
+			index[addr] = code->size();
+
+			if (blk && blk->label && loops.contains(addr) && loops[addr]) {
+				Instr in;
+				in.op = IOP_LOOP;
+				in.size = 0;
+				in.ops = 0;
+				in.addr = addr;
+				in.loop = loops[addr];
+				code->push_back(in);
+				barrier = code->size();
+			}
+
+			const byte op = mem.getU8(addr);
+
+			_decodedCount++;
+			if (prevOp != -1 && op < OP_MAX)
+				_pairCounts[prevOp][op]++;
+			prevOp = op < OP_MAX ? op : -1;
+
+			Instr in;
+			in.addr = addr;
+			in.size = opHasImmediate(op) ? 5 : 1;
+			if (in.size == 5)
+				in.imm = mem.getU32(addr + 1);
+
+			uint32 target = 0;
+
+			switch (op) {
+			default:
+			case OP_EXIT:
+				in.op = IOP_EXIT;
+				break;
+
+			case OP_CMP_EQ:
+			case OP_CMP_NE:
+			case OP_CMP_LE:
+			case OP_CMP_LEQ:
+			case OP_CMP_GR:
+			case OP_CMP_GREQ:
+			case OP_CMP_NAE:
+			case OP_CMP_NA:
+			case OP_CMP_A:
+			case OP_CMP_AE:
+				in.op = IOP_CMP_EQ + (op - OP_CMP_EQ);
+				break;
+
+			case OP_BRANCH:
+				in.op = IOP_BRANCH;
+				target = addr + 1 + in.imm;
+				break;
+
+			case OP_JMP:
+				in.op = IOP_JMP;
+				target = addr + 1 + in.imm;
+				break;
+
+			case OP_SP_ADD:
+				in.op = IOP_SP_ADD;
+				break;
+
+			case OP_MOV_EDI_ECX_AL:
+				in.op = IOP_ST8_EDI;
+				in.imm &= ADDRESS_MASK;
+				break;
+
+			case OP_MOV_EBX_ECX_AL:
+				in.op = IOP_ST8_EBX;
+				break;
+
+			case OP_MOV_EDI_ECX_EAX:
+				in.op = IOP_ST32_EDI;
+				in.imm &= ADDRESS_MASK;
+				break;
+
+			case OP_MOV_EBX_ECX_EAX:
+				in.op = IOP_ST32_EBX;
+				break;
+
+			case OP_RET:
+				in.op = IOP_RET;
+				break;
+
+			case OP_RETX:
+				in.op = IOP_RETX;
+				break;
+
+			case OP_MOV_EDX_EAX:
+				in.op = IOP_MOV_EDX_EAX;
+				break;
+
+			case OP_ADD_EAX_EDX:
+			case OP_MUL:
+			case OP_OR:
+			case OP_XOR:
+			case OP_AND:
+			case OP_NEG:
+			case OP_SAR:
+			case OP_SHL:
+			case OP_LOAD:
+			case OP_INC:
+			case OP_DEC:
+				in.op = IOP_ADD_EAX_EDX + (op - OP_ADD_EAX_EDX);
+				break;
+
+			case OP_XCHG:
+				in.op = IOP_XCHG;
+				break;
+
+			case OP_PUSH_EAX:
+				in.op = IOP_PUSH_EAX;
+				break;
+
+			case OP_POP_EDX:
+				in.op = IOP_POP_EDX;
+				break;
+
+			case OP_LOAD_OFFSET_EDI:
+			case OP_LOAD_OFFSET_EDI2:
+				in.op = IOP_LEA_EDI;
+				break;
+
+			case OP_LOAD_OFFSET_EBX:
+				in.op = IOP_LEA_EBX;
+				break;
+
+			case OP_LOAD_OFFSET_ESP:
+				in.op = IOP_LEA_STACK;
+				break;
+
+			case OP_MOV_PTR_EDX_AL:
+				in.op = specialisePtrOp(IOP_ST8_PTR, types.edx);
+				break;
+
+			case OP_MOV_PTR_EDX_EAX:
+				in.op = specialisePtrOp(IOP_ST32_PTR, types.edx);
+				break;
+
+			case OP_SHL_2:
+			case OP_ADD_4:
+			case OP_SUB_4:
+				in.op = IOP_SHL_2 + (op - OP_SHL_2);
+				break;
+
+			case OP_XCHG_ESP:
+				in.op = IOP_XCHG_ESP;
+				break;
+
+			case OP_NEG_ADD:
+				in.op = IOP_NEG_ADD;
+				break;
+
+			case OP_DIV:
+				in.op = IOP_DIV;
+				break;
+
+			case OP_MOV_EAX_BPTR_EDI:
+			case OP_MOV_EAX_BPTR_EBX:
+			case OP_MOV_EAX_DPTR_EDI:
+			case OP_MOV_EAX_DPTR_EBX:
+				in.op = IOP_LD8_EDI + (op - OP_MOV_EAX_BPTR_EDI);
+				if (op == OP_MOV_EAX_BPTR_EDI || op == OP_MOV_EAX_DPTR_EDI)
+					in.imm &= ADDRESS_MASK;
+				break;
+
+			case OP_MOV_EAX_BPTR_EAX:
+				in.op = specialisePtrOp(IOP_LD8_PTR, types.eax);
+				break;
+
+			case OP_MOV_EAX_DPTR_EAX:
+				in.op = specialisePtrOp(IOP_LD32_PTR, types.eax);
+				break;
+
+			case OP_PUSH_ESI_ADD_EDI:
+				in.op = IOP_CALL;
+				break;
 
-	_currentBlock->data[ pos ] = val & 0xff;
+			case OP_CALL_FUNC:
+				in.op = IOP_CALL_FUNC;
+				break;
 
-	for (int i = 1; i < 4; i++) {
-		pos++;
-		if (pos >= 0x100) {
-			block = createBlock(address + i);
-			if (!block)
+			case OP_PUSH_ESI_SET_EDX_EDI:
+				in.op = IOP_CALL_EDX;
 				break;
-			pos = 0;
+			}
+
+			types.update(op);
+
+			code->push_back(in);
+			if (in.op == IOP_BRANCH || in.op == IOP_JMP)
+				targets.push_back(target);
+
+			/* Peephole: merge last two instructions while some superinstruction
+			   covers them, never across label */
+			while (code->size() >= barrier + 2) {
+				Instr &a = (*code)[code->size() - 2];
+				const Instr &b = code->back();
+
+				const uint16 fused = fuseInstr(a, b);
+				if (fused == IOP_EXIT)
+					break;
+
+				switch (fused) {
+				case IOP_LD8_EDI:
+				case IOP_LD8_EBX:
+				case IOP_LD32_EDI:
+				case IOP_LD32_EBX:
+					/* address from LEA is masked */
+					a.imm &= ADDRESS_MASK;
+					break;
+
+				case IOP_PUSH_LOAD:
+				case IOP_PUSH_LD32_EBX:
+				case IOP_PUSH_LD32_EDI:
+				case IOP_MOV_EDX_LOAD:
+				case IOP_MOV_EDX_LD32_EBX:
+				case IOP_MOV_EDX_LD32_EDI:
+					a.imm = b.imm;
+					break;
+
+				default:
+					if (fused >= IOP_BINI_CMP_EQ)
+						a.imm2 = (a.op == IOP_PUSH_LOAD_POP) ? 1 : 0;
+					break;
+				}
+
+				a.op = fused;
+				a.size += b.size;
+				a.ops += b.ops;
+				index.erase(b.addr);
+				code->pop_back();
+			}
+
+			if (opIsTerminator(op))
+				break;
+
+			addr += in.size;
+		}
+	}
+
+	_fusedCount += code->size();
+
+	/* Link branch targets */
+	for (uint32 target : targets) {
+		if (!index.contains(target)) {
+			warning("VM: script at %x branches to undecoded %x", address, target);
+			delete code;
+			return nullptr;
+		}
+	}
+
+	uint32 t = 0;
+	for (Instr &in : *code) {
+		if (in.op == IOP_BRANCH || in.op == IOP_JMP)
+			in.target = &(*code)[index[targets[t++]]];
+
+		_mem.markCode(in.addr, in.size);
+	}
+
+	_regions.push_back(code);
+
+	/* Return sites may be reached from callee RET, register them as entries */
+	for (const Instr &in : *code) {
+		if (in.op == IOP_CALL || in.op == IOP_CALL_EDX) {
+			const uint32 ret = in.addr + 5;
+			Common::HashMap<uint32, uint32>::const_iterator it = index.find(ret);
+			/* not decoded here, RET decodes it on first return */
+			if (it != index.end() && !_entries.contains(ret))
+				_entries[ret] = &(*code)[it->_value];
 		}
-		block->data[ pos ] = (val >> (i * 8)) & 0xff;
 	}
+
+	Common::HashMap<uint32, uint32>::const_iterator it = index.find(address);
+	if (it == index.end())
+		return nullptr;
+	return &(*code)[it->_value];
 }
 
+uint16 VM::CodeCache::fuseInstr(const Instr &a, const Instr &b) {
+	switch (a.op) {
+	case IOP_LEA_EDI:
+		if (b.op == IOP_LD8_PTR_EDI)
+			return IOP_LD8_EDI;
+		if (b.op == IOP_LD32_PTR_EDI)
+			return IOP_LD32_EDI;
+		break;
+
+	case IOP_LEA_EBX:
+		if (b.op == IOP_LD8_PTR_EBX)
+			return IOP_LD8_EBX;
+		if (b.op == IOP_LD32_PTR_EBX)
+			return IOP_LD32_EBX;
+		break;
+
+	case IOP_LEA_STACK:
+		if (b.op == IOP_LD8_PTR_STACK)
+			return IOP_LD8_STACK;
+		if (b.op == IOP_LD32_PTR_STACK)
+			return IOP_LD32_STACK;
+		break;
+
+	case IOP_PUSH_EAX:
+		if (b.op == IOP_LOAD)
+			return IOP_PUSH_LOAD;
+		if (b.op == IOP_LD32_EBX)
+			return IOP_PUSH_LD32_EBX;
+		if (b.op == IOP_LD32_EDI)
+			return IOP_PUSH_LD32_EDI;
+		break;
+
+	case IOP_PUSH_LOAD:
+	case IOP_PUSH_LD32_EBX:
+	case IOP_PUSH_LD32_EDI:
+		if (b.op == IOP_POP_EDX)
+			return a.op + 1;
+		break;
+
+	case IOP_MOV_EDX_EAX:
+		if (b.op == IOP_LOAD)
+			return IOP_MOV_EDX_LOAD;
+		if (b.op == IOP_LD32_EBX)
+			return IOP_MOV_EDX_LD32_EBX;
+		if (b.op == IOP_LD32_EDI)
+			return IOP_MOV_EDX_LD32_EDI;
+		break;
+
+	case IOP_PUSH_LOAD_POP:
+	case IOP_MOV_EDX_LOAD:
+		if (b.op >= IOP_CMP_EQ && b.op <= IOP_CMP_AE)
+			return IOP_BINI_CMP_EQ + (b.op - IOP_CMP_EQ);
+		if (b.op >= IOP_ADD_EAX_EDX && b.op <= IOP_AND)
+			return IOP_BINI_ADD + (b.op - IOP_ADD_EAX_EDX);
+		if (b.op == IOP_SAR)
+			return IOP_BINI_SAR;
+		if (b.op == IOP_SHL)
+			return IOP_BINI_SHL;
+		if (b.op == IOP_NEG_ADD)
+			return IOP_BINI_NEG_ADD;
+		break;
+
+	default:
+		break;
+	}
+
+	return IOP_EXIT;
+}
 
+void VM::CodeCache::resetStats() {
+	memset(_pairCounts, 0, sizeof(_pairCounts));
+	_decodedCount = 0;
+	_fusedCount = 0;
+	_blockCount = 0;
+	_localBlockCount = 0;
+}
 
+void VM::Runtime::decodeScript(uint32 scriptAddress) {
+	_codeCache.get(scriptAddress);
+}
 
+VM::VM(Runtime &runtime) : _runtime(runtime), _mem(runtime._memAccess) {
+	memset(_stack, 0, sizeof(_stack));
+	memset(_stackT, 0, sizeof(_stackT));
+}
 
 uint32 VM::execute(uint32 scriptAddress, byte *storage) {
 	//Common::String disasm = disassembly(scriptAddress);
@@ -124,19 +2697,936 @@ uint32 VM::execute(uint32 scriptAddress, byte *storage) {
 	ESI = scriptAddress;
 	EBX = storage;
 
-	_readAccess.reset();
-	_writeAccess.reset();
+	SP = STACK_POS;
+
+	if (_runtime._interrupt)
+		return 0;
+
+	const bool profile = _runtime._profiler._enabled;
+	const uint32 startTime = profile ? g_system->getMillis() : 0;
+	_profInstructions = 0;
+
+	uint32 res;
+	NativeInfo *native = _runtime._natives.lookup(scriptAddress);
+	if (native) {
+		native->calls++;
+		if (_runtime._natives._validate)
+			res = validateNative(*native, scriptAddress);
+		else
+			res = native->entry->func(this, scriptAddress);
+	} else {
+		res = runBytecode();
+	}
+
+	if (profile) {
+		ScriptProfile &prof = _runtime._profiler._scripts.getOrCreateVal(scriptAddress);
+		prof.calls++;
+		prof.instructions += _profInstructions;
+		prof.time += g_system->getMillis() - startTime;
+	}
+
+	return res;
+}
+
+uint32 VM::runBytecode() {
+	_runtime._codeCache._active++;
+
+	const Instr *entry = _runtime._codeCache.get(ESI);
+	uint32 res;
+	if (_runtime._profiler._enabled)
+		res = entry ? run<true>(entry) : interpret<true>();
+	else
+		res = entry ? run<false>(entry) : interpret<false>();
+
+	_runtime._codeCache._active--;
+	if (!_runtime._codeCache._active)
+		_runtime._codeCache.freeRetired();
+
+	return res;
+}
+
+/* Script with indirect call for selfTest(), subroutine at 0x1000 returns
+   5 and caller at 0x1006 returns 7. 1 byte PUSH_ESI_SET_EDX_EDI pushes
+   address of next byte, so 4 bytes of padding are skipped by RET. */
+static const byte selfTestCallEdx[] = {
+	VM::OP_LOAD, 0x05, 0x00, 0x00, 0x00,
+	VM::OP_RET,
+	VM::OP_LOAD, 0x00, 0x10, 0x00, 0x00,
+	VM::OP_MOV_EDX_EAX,
+	VM::OP_PUSH_ESI_SET_EDX_EDI,
+	0x00, 0x00, 0x00, 0x00,
+	VM::OP_LOAD, 0x07, 0x00, 0x00, 0x00,
+	VM::OP_EXIT
+};
+
+/* Same with direct call */
+static const byte selfTestCall[] = {
+	VM::OP_LOAD, 0x05, 0x00, 0x00, 0x00,
+	VM::OP_RET,
+	VM::OP_PUSH_ESI_ADD_EDI, 0x00, 0x10, 0x00, 0x00,
+	VM::OP_LOAD, 0x07, 0x00, 0x00, 0x00,
+	VM::OP_EXIT
+};
+
+bool VM::selfTestScript(const char *name, const byte *code, uint32 size) {
+	static const uint32 BASE = 0x1000;
+	static const uint32 ENTRY = 0x1006;
+
+	Runtime *rt = new Runtime();
+	rt->writeMemory(BASE, code, size);
+
+	VM vm(*rt);
+	vm.ESI = ENTRY;
+	vm.SP = STACK_POS;
+	const uint32 expected = vm.interpret<false>();
+
+	/* wrong return site lands on padding or memory past script, both are
+	   zero which is OP_EXIT, so broken code ends with other result */
+	const uint32 result = vm.execute(ENTRY);
+
+	bool ok = true;
+	if (result != expected) {
+		warning("VM: self test %s: decoded code returned %u, interpreter %u", name, result, expected);
+		ok = false;
+	}
+
+	delete rt;
+	return ok;
+}
+
+uint VM::selfTest() {
+	uint failed = 0;
+	if (!selfTestScript("call", selfTestCall, sizeof(selfTestCall)))
+		failed++;
+	if (!selfTestScript("call_edx", selfTestCallEdx, sizeof(selfTestCallEdx)))
+		failed++;
+	return failed;
+}
+
+namespace {
+
+/* Bytes of one memory touched by loop access */
+struct LoopRange {
+	uint8 memtype = VM::REF_UNK;
+	int64 lo = 0;
+	int64 hi = 0;
+
+	bool overlaps(const LoopRange &other) const {
+		return memtype != VM::REF_UNK && memtype == other.memtype && lo < other.hi && other.lo < hi;
+	}
+};
+
+} // End of anonymous namespace
+
+/* Bytes touched by access in count iterations, false when they leave memory */
+static bool loopRange(const VM &vm, const VM::LoopIdiom &loop, const VM::LoopAccess &acc, const uint32 *vars, uint32 count, LoopRange &r) {
+	if (acc.var < 0) {
+		r.memtype = acc.memtype;
+		r.lo = acc.offset;
+		if (acc.memtype == VM::REF_STACK)
+			r.lo += (int32)vm.SP;
+		r.hi = r.lo + acc.size;
+	} else {
+		const uint32 start = vars[acc.var] + acc.offset;
+		const int64 first = start & VM::ADDRESS_MASK;
+		const int64 last = first + (int64)loop.vars[acc.var].step * (count - 1);
+		r.memtype = start >> VM::MEMTYPE_SHIFT;
+		r.lo = MIN(first, last);
+		r.hi = MAX(first, last) + acc.size;
+	}
+
+	switch (r.memtype) {
+	case VM::REF_STACK:
+		return r.lo >= 0 && r.hi <= VM::STACK_SIZE;
+	case VM::REF_EBX:
+		if (!vm.EBX)
+			return false;
+		// fall through
+	default:
+		return r.lo >= 0 && r.hi <= (int64)VM::ADDRESS_MASK + 1;
+	}
+}
+
+static void readLoopMem(VM &vm, uint memtype, uint32 offset, byte *dst, uint32 count) {
+	switch (memtype) {
+	case VM::REF_STACK:
+		memcpy(dst, vm._stack + offset, count);
+		break;
+	case VM::REF_EBX:
+		memcpy(dst, vm.EBX + offset, count);
+		break;
+	case VM::REF_EDI:
+		vm._mem.read(dst, offset, count);
+		break;
+	default:
+		memset(dst, 0, count);
+		break;
+	}
+}
+
+static void writeLoopMem(VM &vm, uint memtype, uint32 offset, const byte *src, uint32 count) {
+	switch (memtype) {
+	case VM::REF_STACK:
+		memcpy(vm._stack + offset, src, count);
+		break;
+	case VM::REF_EBX:
+		memcpy(vm.EBX + offset, src, count);
+		break;
+	case VM::REF_EDI:
+		vm._mem.write(offset, src, count);
+		break;
+	default:
+		break;
+	}
+}
+
+void VM::evalLoopNodes(const LoopIdiom &loop, const uint32 *vars, uint32 *values, uint from, uint to, bool &fault) {
+	for (uint i = from; i < to; i++) {
+		const LoopNode &n = loop.nodes[i];
+		ValAddr addr;
+
+		switch (n.kind) {
+		default:
+		case LoopNode::N_CONST:
+			values[i] = n.value;
+			break;
+
+		case LoopNode::N_SP:
+			values[i] = SP;
+			break;
+
+		case LoopNode::N_VAR:
+			values[i] = vars[n.value];
+			break;
+
+		case LoopNode::N_OP:
+			values[i] = loopOp(n.op, values[n.a], values[n.b]);
+			break;
+
+		case LoopNode::N_ADDR:
+			addr.setAddress(n.op, values[n.a]);
+			values[i] = addr.getVal();
+			break;
+
+		case LoopNode::N_SEXT8:
+			values[i] = (int32)(int8)(values[n.a] & 0xff);
+			break;
+
+		case LoopNode::N_LOAD8:
+		case LoopNode::N_LOAD32: {
+			const uint32 size = n.kind == LoopNode::N_LOAD8 ? 1 : 4;
+			addr.setVal(values[n.a]);
+
+			/* the interpreter would not stop here, but run() does */
+			if ((addr.getMemType() == REF_STACK && addr.getOffset() + size > STACK_SIZE) ||
+			    (addr.getMemType() == REF_EBX && !EBX)) {
+				fault = true;
+				values[i] = 0;
+			} else if (size == 1) {
+				values[i] = (int32)(int8)getMem8(addr);
+			} else {
+				values[i] = getMem32(addr);
+			}
+			break;
+		}
+		}
+	}
+}
+
+/* Finds first iteration which leaves loop from memory at entry, then
+   applies all iterations before the last full one at once. The last full
+   iteration and the leaving one run as usual, so registers and temporaries
+   end up exactly as without this. Returns count of iterations done. */
+uint32 VM::runLoop(LoopIdiom &loop) {
+	static constexpr const uint32 MAX_ITERATIONS = 0x10000;
+
+	if (_skipLoop == &loop && _skipCount) {
+		_skipCount--;
+		return 0;
+	}
+
+	uint32 vars[LoopIdiom::MAX_VARS];
+	uint32 cur[LoopIdiom::MAX_VARS];
+	uint32 values[LoopIdiom::MAX_NODES];
+	byte buf[256];
+
+	for (uint j = 0; j < loop.vars.size(); j++) {
+		LoopAccess acc;
+		acc.memtype = loop.vars[j].memtype;
+		acc.offset = loop.vars[j].offset;
+		acc.size = 4;
+
+		LoopRange r;
+		if (!loopRange(*this, loop, acc, vars, 1, r))
+			return 0;
+
+		readLoopMem(*this, r.memtype, r.lo, buf, 4);
+		vars[j] = getU32(buf);
+	}
+
+	bool fault = false;
+	uint32 trip = 0;
+	for (; trip < MAX_ITERATIONS && !fault; trip++) {
+		for (uint j = 0; j < loop.vars.size(); j++)
+			cur[j] = vars[j] + trip * (uint32)loop.vars[j].step;
+
+		bool leave = false;
+		uint from = 0;
+		for (const LoopExit &exit : loop.exits) {
+			evalLoopNodes(loop, cur, values, from, exit.end, fault);
+			from = exit.end;
+			if ((values[exit.node] == 0) != exit.continueOnZero) {
+				leave = true;
+				break;
+			}
+		}
+
+		if (leave)
+			break;
+	}
+
+	if (trip < 3)
+		return 0;
+
+	const uint32 count = trip - 1;
+
+	/* Stores of iterations before the leaving one must not change anything
+	   else read by loop */
+	bool alias = fault;
+
+	LoopRange store;
+	if (loop.store.size && !loopRange(*this, loop, loop.store, vars, trip, store))
+		alias = true;
+
+	for (uint i = 0; i < loop.fixed.size() && !alias; i++) {
+		LoopRange r;
+		alias = !loopRange(*this, loop, loop.fixed[i], vars, 1, r) || (loop.store.size && r.overlaps(store));
+	}
+
+	for (uint i = 0; i < loop.loads.size() && !alias; i++) {
+		LoopRange r;
+		alias = !loopRange(*this, loop, loop.loads[i], vars, trip + 1, r) || (loop.store.size && r.overlaps(store));
+
+		for (uint j = 0; j < loop.fixed.size() && !alias; j++) {
+			LoopRange f;
+			loopRange(*this, loop, loop.fixed[j], vars, 1, f);
+			alias = loop.fixed[j].write && r.overlaps(f);
+		}
+	}
+
+	if (loop.kind == LoopIdiom::FILL && !alias) {
+		evalLoopNodes(loop, vars, values, 0, loop.nodes.size(), fault);
+		alias = fault;
+	}
+
+	if (alias) {
+		/* interpreter runs this visit, don't check it again until it ends */
+		_skipLoop = &loop;
+		_skipCount = trip;
+		return 0;
+	}
+
+	if (loop.store.size) {
+		LoopRange dst;
+		loopRange(*this, loop, loop.store, vars, count, dst);
+
+		LoopRange src;
+		if (loop.kind == LoopIdiom::COPY) {
+			loopRange(*this, loop, loop.loads[loop.copyFrom], vars, count, src);
+		} else {
+			const uint32 value = values[loop.store.node];
+			for (uint i = 0; i < sizeof(buf); i++)
+				buf[i] = (value >> (8 * (i % loop.store.size))) & 0xff;
+		}
+
+		for (int64 pos = 0; pos < dst.hi - dst.lo; pos += sizeof(buf)) {
+			const uint32 n = MIN<int64>(sizeof(buf), dst.hi - dst.lo - pos);
+			if (loop.kind == LoopIdiom::COPY)
+				readLoopMem(*this, src.memtype, src.lo + pos, buf, n);
+			writeLoopMem(*this, dst.memtype, dst.lo + pos, buf, n);
+		}
+	}
+
+	for (uint j = 0; j < loop.vars.size(); j++) {
+		if (!loop.vars[j].step)
+			continue;
+
+		LoopAccess acc;
+		acc.memtype = loop.vars[j].memtype;
+		acc.offset = loop.vars[j].offset;
+		acc.size = 4;
+
+		LoopRange r;
+		loopRange(*this, loop, acc, vars, 1, r);
+		setU32(buf, vars[j] + count * (uint32)loop.vars[j].step);
+		writeLoopMem(*this, r.memtype, r.lo, buf, 4);
+	}
+
+	loop.hits++;
+	loop.iterations += count;
+	return count;
+}
+
+#if defined(__GNUC__)
+#define GAMOS_THREADED_DISPATCH
+#endif
+
+inline void VM::countOp(const Instr *ip) {
+	_profInstructions += ip->ops;
+	_runtime._profiler._opCounts[ip->op]++;
+}
+
+template<bool PROFILE>
+uint32 VM::run(const Instr *ip) {
+	const uint32 generation = _mem._codeGeneration;
+
+/* code in memory was overwritten, continue with bytecode interpreter */
+#define CHECK_CODE_WRITE() \
+	if (_mem._codeGeneration != generation) { \
+		ESI = ip->addr + ip->size; \
+		return interpret<PROFILE>(); \
+	}
+
+#define JUMP_TO(address) { \
+		ESI = (address); \
+		ip = _runtime._codeCache.get(ESI); \
+		if (!ip) \
+			return interpret<PROFILE>(); \
+	}
+
+#ifdef GAMOS_THREADED_DISPATCH
+	static const void *const labels[] = {
+		&&L_IOP_EXIT, &&L_IOP_CMP_EQ, &&L_IOP_CMP_NE, &&L_IOP_CMP_LE, &&L_IOP_CMP_LEQ,
+		&&L_IOP_CMP_GR, &&L_IOP_CMP_GREQ, &&L_IOP_CMP_NAE, &&L_IOP_CMP_NA, &&L_IOP_CMP_A,
+		&&L_IOP_CMP_AE, &&L_IOP_BRANCH, &&L_IOP_JMP, &&L_IOP_SP_ADD, &&L_IOP_ST8_EDI,
+		&&L_IOP_ST8_EBX, &&L_IOP_ST32_EDI, &&L_IOP_ST32_EBX, &&L_IOP_RET, &&L_IOP_RETX,
+		&&L_IOP_MOV_EDX_EAX, &&L_IOP_ADD_EAX_EDX, &&L_IOP_MUL, &&L_IOP_OR, &&L_IOP_XOR,
+		&&L_IOP_AND, &&L_IOP_NEG, &&L_IOP_SAR, &&L_IOP_SHL, &&L_IOP_LOAD,
+		&&L_IOP_INC, &&L_IOP_DEC, &&L_IOP_XCHG, &&L_IOP_PUSH_EAX, &&L_IOP_POP_EDX,
+		&&L_IOP_LEA_EDI, &&L_IOP_LEA_EBX, &&L_IOP_LEA_STACK,
+		&&L_IOP_ST8_PTR, &&L_IOP_ST8_PTR_STACK, &&L_IOP_ST8_PTR_EBX, &&L_IOP_ST8_PTR_EDI,
+		&&L_IOP_ST32_PTR, &&L_IOP_ST32_PTR_STACK, &&L_IOP_ST32_PTR_EBX, &&L_IOP_ST32_PTR_EDI,
+		&&L_IOP_SHL_2, &&L_IOP_ADD_4, &&L_IOP_SUB_4, &&L_IOP_XCHG_ESP, &&L_IOP_NEG_ADD,
+		&&L_IOP_DIV, &&L_IOP_LD8_EDI, &&L_IOP_LD8_EBX, &&L_IOP_LD32_EDI, &&L_IOP_LD32_EBX,
+		&&L_IOP_LD8_PTR, &&L_IOP_LD8_PTR_STACK, &&L_IOP_LD8_PTR_EBX, &&L_IOP_LD8_PTR_EDI,
+		&&L_IOP_LD32_PTR, &&L_IOP_LD32_PTR_STACK, &&L_IOP_LD32_PTR_EBX, &&L_IOP_LD32_PTR_EDI,
+		&&L_IOP_CALL, &&L_IOP_CALL_FUNC, &&L_IOP_CALL_EDX,
+		&&L_IOP_LD8_STACK, &&L_IOP_LD32_STACK, &&L_IOP_PUSH_LOAD, &&L_IOP_PUSH_LOAD_POP,
+		&&L_IOP_PUSH_LD32_EBX, &&L_IOP_PUSH_LD32_EBX_POP, &&L_IOP_PUSH_LD32_EDI, &&L_IOP_PUSH_LD32_EDI_POP,
+		&&L_IOP_MOV_EDX_LOAD, &&L_IOP_MOV_EDX_LD32_EBX, &&L_IOP_MOV_EDX_LD32_EDI,
+		&&L_IOP_BINI_CMP_EQ, &&L_IOP_BINI_CMP_NE, &&L_IOP_BINI_CMP_LE, &&L_IOP_BINI_CMP_LEQ,
+		&&L_IOP_BINI_CMP_GR, &&L_IOP_BINI_CMP_GREQ, &&L_IOP_BINI_CMP_NAE, &&L_IOP_BINI_CMP_NA,
+		&&L_IOP_BINI_CMP_A, &&L_IOP_BINI_CMP_AE, &&L_IOP_BINI_ADD, &&L_IOP_BINI_MUL,
+		&&L_IOP_BINI_OR, &&L_IOP_BINI_XOR, &&L_IOP_BINI_AND, &&L_IOP_BINI_SAR,
+		&&L_IOP_BINI_SHL, &&L_IOP_BINI_NEG_ADD,
+		&&L_IOP_LOOP
+	};
+	static_assert(ARRAYSIZE(labels) == IOP_MAX, "IOP label table mismatch");
+
+#define CASE(op) L_##op
+#define DISPATCH() { \
+		if (PROFILE) \
+			countOp(ip); \
+		goto *labels[ip->op]; \
+	}
+#define NEXT() { ip++; DISPATCH(); }
+
+	DISPATCH();
+	{
+#else
+#define CASE(op) case op
+#define DISPATCH() goto dispatch
+#define NEXT() { ip++; DISPATCH(); }
+
+dispatch:
+	if (PROFILE)
+		countOp(ip);
+
+	switch (ip->op) {
+	default:
+#endif
+
+	CASE(IOP_EXIT):
+		ESI = ip->addr + 1;
+		return EAX.getVal();
+
+	CASE(IOP_CMP_EQ):
+		EAX.setVal(EDX.getVal() == EAX.getVal() ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_CMP_NE):
+		EAX.setVal(EDX.getVal() != EAX.getVal() ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_CMP_LE):
+		EAX.setVal((int32)EDX.getVal() < (int32)EAX.getVal() ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_CMP_LEQ):
+		EAX.setVal((int32)EDX.getVal() <= (int32)EAX.getVal() ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_CMP_GR):
+		EAX.setVal((int32)EDX.getVal() > (int32)EAX.getVal() ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_CMP_GREQ):
+		EAX.setVal((int32)EDX.getVal() >= (int32)EAX.getVal() ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_CMP_NAE):
+		EAX.setVal(EDX.getVal() < EAX.getVal() ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_CMP_NA):
+		EAX.setVal(EDX.getVal() <= EAX.getVal() ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_CMP_A):
+		EAX.setVal(EDX.getVal() > EAX.getVal() ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_CMP_AE):
+		EAX.setVal(EDX.getVal() >= EAX.getVal() ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BRANCH):
+		if (EAX.getVal() != 0)
+			ip++;
+		else
+			ip = ip->target;
+		DISPATCH();
+
+	CASE(IOP_JMP):
+		ip = ip->target;
+		DISPATCH();
+
+	CASE(IOP_SP_ADD):
+		SP += (int32)ip->imm;
+		NEXT();
+
+	CASE(IOP_ST8_EDI):
+		_mem.setU8(ip->imm, EAX.getVal() & 0xff);
+		CHECK_CODE_WRITE();
+		NEXT();
+
+	CASE(IOP_ST8_EBX):
+		EBX[ip->imm] = EAX.getVal() & 0xff;
+		NEXT();
+
+	CASE(IOP_ST32_EDI):
+		_mem.setU32(ip->imm, EAX.getVal());
+		CHECK_CODE_WRITE();
+		NEXT();
+
+	CASE(IOP_ST32_EBX):
+		setU32(EBX + ip->imm, EAX.getVal());
+		NEXT();
+
+	CASE(IOP_RET):
+		JUMP_TO(pop32() + 4);
+		DISPATCH();
+
+	CASE(IOP_RETX):
+		ECX = popReg();
+		SP += ip->imm;
+		JUMP_TO(ECX.getVal() + 4);
+		DISPATCH();
+
+	CASE(IOP_MOV_EDX_EAX):
+		EDX = EAX;
+		NEXT();
+
+	CASE(IOP_ADD_EAX_EDX):
+		EAX.setVal(EAX.getVal() + EDX.getVal());
+		NEXT();
+
+	CASE(IOP_MUL):
+		EAX.setVal(EAX.getVal() * EDX.getVal());
+		NEXT();
+
+	CASE(IOP_OR):
+		EAX.setVal(EAX.getVal() | EDX.getVal());
+		NEXT();
+
+	CASE(IOP_XOR):
+		EAX.setVal(EAX.getVal() ^ EDX.getVal());
+		NEXT();
+
+	CASE(IOP_AND):
+		EAX.setVal(EAX.getVal() & EDX.getVal());
+		NEXT();
+
+	CASE(IOP_NEG):
+		EAX.setVal((uint32)(-(int32)EAX.getVal()));
+		NEXT();
+
+	CASE(IOP_SAR):
+		EAX.setVal((int32)EDX.getVal() >> (EAX.getVal() & 0xff)); /* must be arythmetic shift! */
+		NEXT();
+
+	CASE(IOP_SHL):
+		EAX.setVal(EDX.getVal() << (EAX.getVal() & 0xff));
+		NEXT();
+
+	CASE(IOP_LOAD):
+		EAX.setVal(ip->imm);
+		NEXT();
+
+	CASE(IOP_INC):
+		EAX.setVal(EAX.getVal() + 1);
+		NEXT();
+
+	CASE(IOP_DEC):
+		EAX.setVal(EAX.getVal() - 1);
+		NEXT();
+
+	CASE(IOP_XCHG):
+		ECX = EAX;
+		EAX = EDX;
+		EDX = ECX;
+		NEXT();
+
+	CASE(IOP_PUSH_EAX):
+		pushReg(EAX);
+		NEXT();
+
+	CASE(IOP_POP_EDX):
+		EDX = popReg();
+		NEXT();
+
+	CASE(IOP_LEA_EDI):
+		EAX.setAddress(REF_EDI, ip->imm);
+		NEXT();
+
+	CASE(IOP_LEA_EBX):
+		EAX.setAddress(REF_EBX, ip->imm);
+		NEXT();
+
+	CASE(IOP_LEA_STACK):
+		EAX.setAddress(REF_STACK, ip->imm + SP);
+		NEXT();
+
+	CASE(IOP_ST8_PTR):
+		setMem8(EDX, EAX.getVal() & 0xff);
+		CHECK_CODE_WRITE();
+		NEXT();
+
+	CASE(IOP_ST8_PTR_STACK):
+		_stack[EDX.getOffset()] = EAX.getVal() & 0xff;
+		NEXT();
+
+	CASE(IOP_ST8_PTR_EBX):
+		EBX[EDX.getOffset()] = EAX.getVal() & 0xff;
+		NEXT();
+
+	CASE(IOP_ST8_PTR_EDI):
+		_mem.setU8(EDX.getOffset(), EAX.getVal() & 0xff);
+		CHECK_CODE_WRITE();
+		NEXT();
+
+	CASE(IOP_ST32_PTR):
+		setMem32(EDX, EAX.getVal());
+		CHECK_CODE_WRITE();
+		NEXT();
+
+	CASE(IOP_ST32_PTR_STACK):
+		setU32(_stack + EDX.getOffset(), EAX.getVal());
+		NEXT();
+
+	CASE(IOP_ST32_PTR_EBX):
+		setU32(EBX + EDX.getOffset(), EAX.getVal());
+		NEXT();
+
+	CASE(IOP_ST32_PTR_EDI):
+		_mem.setU32(EDX.getOffset(), EAX.getVal());
+		CHECK_CODE_WRITE();
+		NEXT();
+
+	CASE(IOP_SHL_2):
+		EAX.setVal(EAX.getVal() << 2);
+		NEXT();
+
+	CASE(IOP_ADD_4):
+		EAX.setVal(EAX.getVal() + 4);
+		NEXT();
+
+	CASE(IOP_SUB_4):
+		EAX.setVal(EAX.getVal() - 4);
+		NEXT();
+
+	CASE(IOP_XCHG_ESP):
+		ECX = popReg();
+		pushReg(EAX);
+		EAX = ECX;
+		NEXT();
+
+	CASE(IOP_NEG_ADD):
+		EAX.setVal((-(int32)EAX.getVal()) + EDX.getVal());
+		NEXT();
+
+	CASE(IOP_DIV):
+		ECX = EAX;
+		EAX.setVal((int32)EDX.getVal() / (int32)ECX.getVal());
+		EDX.setVal((int32)EDX.getVal() % (int32)ECX.getVal());
+		NEXT();
+
+	CASE(IOP_LD8_EDI):
+		EAX.setVal((int32)((int8)_mem.getU8(ip->imm)));
+		NEXT();
+
+	CASE(IOP_LD8_EBX):
+		EAX.setVal((int32)((int8)EBX[ip->imm]));
+		NEXT();
+
+	CASE(IOP_LD32_EDI):
+		EAX.setVal(_mem.getU32(ip->imm));
+		NEXT();
+
+	CASE(IOP_LD32_EBX):
+		EAX.setVal(getU32(EBX + ip->imm));
+		NEXT();
+
+	CASE(IOP_LD8_PTR):
+		EAX.setVal((int32)((int8)getMem8(EAX)));
+		NEXT();
+
+	CASE(IOP_LD8_PTR_STACK):
+		EAX.setVal((int32)((int8)_stack[EAX.getOffset()]));
+		NEXT();
+
+	CASE(IOP_LD8_PTR_EBX):
+		EAX.setVal((int32)((int8)EBX[EAX.getOffset()]));
+		NEXT();
+
+	CASE(IOP_LD8_PTR_EDI):
+		EAX.setVal((int32)((int8)_mem.getU8(EAX.getOffset())));
+		NEXT();
+
+	CASE(IOP_LD32_PTR):
+		EAX.setVal(getMem32(EAX));
+		NEXT();
+
+	CASE(IOP_LD32_PTR_STACK):
+		EAX.setVal(getU32(_stack + EAX.getOffset()));
+		NEXT();
+
+	CASE(IOP_LD32_PTR_EBX):
+		EAX.setVal(getU32(EBX + EAX.getOffset()));
+		NEXT();
+
+	CASE(IOP_LD32_PTR_EDI):
+		EAX.setVal(_mem.getU32(EAX.getOffset()));
+		NEXT();
+
+	CASE(IOP_CALL):
+		push32(ip->addr + 1);
+		JUMP_TO(ip->imm);
+		DISPATCH();
+
+	CASE(IOP_CALL_FUNC):
+		EAX.setVal(ip->imm);
+		ESI = ip->addr + 5;
+		if (_runtime._callFuncs)
+			_runtime._callFuncs(_runtime._callingObject, this, EAX.getVal());
+		if (_runtime._interrupt)
+			return 0;
+		CHECK_CODE_WRITE();
+		NEXT();
+
+	CASE(IOP_CALL_EDX):
+		push32(ip->addr + 1);
+		JUMP_TO(EDX.getVal());
+		DISPATCH();
+
+	CASE(IOP_LD8_STACK):
+		EAX.setVal((int32)((int8)_stack[(ip->imm + SP) & ADDRESS_MASK]));
+		NEXT();
+
+	CASE(IOP_LD32_STACK):
+		EAX.setVal(getU32(_stack + ((ip->imm + SP) & ADDRESS_MASK)));
+		NEXT();
+
+	CASE(IOP_PUSH_LOAD):
+		pushReg(EAX);
+		EAX.setVal(ip->imm);
+		NEXT();
+
+	CASE(IOP_PUSH_LOAD_POP):
+		setU32(_stack + SP - 4, EAX.getVal());
+		EDX = EAX;
+		EAX.setVal(ip->imm);
+		NEXT();
+
+	CASE(IOP_PUSH_LD32_EBX):
+		pushReg(EAX);
+		EAX.setVal(getU32(EBX + ip->imm));
+		NEXT();
+
+	CASE(IOP_PUSH_LD32_EBX_POP):
+		setU32(_stack + SP - 4, EAX.getVal());
+		EDX = EAX;
+		EAX.setVal(getU32(EBX + ip->imm));
+		NEXT();
+
+	CASE(IOP_PUSH_LD32_EDI):
+		pushReg(EAX);
+		EAX.setVal(_mem.getU32(ip->imm));
+		NEXT();
+
+	CASE(IOP_PUSH_LD32_EDI_POP):
+		setU32(_stack + SP - 4, EAX.getVal());
+		EDX = EAX;
+		EAX.setVal(_mem.getU32(ip->imm));
+		NEXT();
+
+	CASE(IOP_MOV_EDX_LOAD):
+		EDX = EAX;
+		EAX.setVal(ip->imm);
+		NEXT();
+
+	CASE(IOP_MOV_EDX_LD32_EBX):
+		EDX = EAX;
+		EAX.setVal(getU32(EBX + ip->imm));
+		NEXT();
+
+	CASE(IOP_MOV_EDX_LD32_EDI):
+		EDX = EAX;
+		EAX.setVal(_mem.getU32(ip->imm));
+		NEXT();
+
+/* EDX = EAX, EAX = imm, then EAX = EDX <op> imm */
+#define BINI_PREP() \
+	if (ip->imm2) \
+		setU32(_stack + SP - 4, EAX.getVal()); \
+	EDX = EAX;
+
+	CASE(IOP_BINI_CMP_EQ):
+		BINI_PREP();
+		EAX.setVal(EDX.getVal() == ip->imm ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BINI_CMP_NE):
+		BINI_PREP();
+		EAX.setVal(EDX.getVal() != ip->imm ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BINI_CMP_LE):
+		BINI_PREP();
+		EAX.setVal((int32)EDX.getVal() < (int32)ip->imm ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BINI_CMP_LEQ):
+		BINI_PREP();
+		EAX.setVal((int32)EDX.getVal() <= (int32)ip->imm ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BINI_CMP_GR):
+		BINI_PREP();
+		EAX.setVal((int32)EDX.getVal() > (int32)ip->imm ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BINI_CMP_GREQ):
+		BINI_PREP();
+		EAX.setVal((int32)EDX.getVal() >= (int32)ip->imm ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BINI_CMP_NAE):
+		BINI_PREP();
+		EAX.setVal(EDX.getVal() < ip->imm ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BINI_CMP_NA):
+		BINI_PREP();
+		EAX.setVal(EDX.getVal() <= ip->imm ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BINI_CMP_A):
+		BINI_PREP();
+		EAX.setVal(EDX.getVal() > ip->imm ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BINI_CMP_AE):
+		BINI_PREP();
+		EAX.setVal(EDX.getVal() >= ip->imm ? 1 : 0);
+		NEXT();
+
+	CASE(IOP_BINI_ADD):
+		BINI_PREP();
+		EAX.setVal(ip->imm + EDX.getVal());
+		NEXT();
+
+	CASE(IOP_BINI_MUL):
+		BINI_PREP();
+		EAX.setVal(ip->imm * EDX.getVal());
+		NEXT();
+
+	CASE(IOP_BINI_OR):
+		BINI_PREP();
+		EAX.setVal(ip->imm | EDX.getVal());
+		NEXT();
+
+	CASE(IOP_BINI_XOR):
+		BINI_PREP();
+		EAX.setVal(ip->imm ^ EDX.getVal());
+		NEXT();
+
+	CASE(IOP_BINI_AND):
+		BINI_PREP();
+		EAX.setVal(ip->imm & EDX.getVal());
+		NEXT();
+
+	CASE(IOP_BINI_SAR):
+		BINI_PREP();
+		EAX.setVal((int32)EDX.getVal() >> (ip->imm & 0xff));
+		NEXT();
+
+	CASE(IOP_BINI_SHL):
+		BINI_PREP();
+		EAX.setVal(EDX.getVal() << (ip->imm & 0xff));
+		NEXT();
+
+	CASE(IOP_BINI_NEG_ADD):
+		BINI_PREP();
+		EAX.setVal((-(int32)ip->imm) + EDX.getVal());
+		NEXT();
+
+#undef BINI_PREP
+
+	CASE(IOP_LOOP): {
+		/* leaves state of the last full iteration, remaining ones run as usual */
+		const uint32 count = runLoop(*ip->loop);
+		if (count) {
+			if (PROFILE)
+				_profInstructions += count * ip->loop->ops;
+			CHECK_CODE_WRITE();
+		}
+		NEXT();
+	}
+	}
 
-	SP = STACK_POS;
+#undef CASE
+#undef DISPATCH
+#undef NEXT
+#undef JUMP_TO
+#undef CHECK_CODE_WRITE
+
+	return EAX.getVal();
+}
 
+template<bool PROFILE>
+uint32 VM::interpret() {
 	//Common::Array<OpLog> cmdlog;
 
 	bool loop = true;
 	while (loop) {
-		if (_interrupt)
+		if (_runtime._interrupt)
 			return 0;
 
-		byte op = _readAccess.getU8(ESI);
+		if (PROFILE)
+			_profInstructions++;
+
+		byte op = _mem.getU8(ESI);
 		//cmdlog.push_back({ESI, (OP)op, SP});
 		ESI++;
 
@@ -220,35 +3710,35 @@ uint32 VM::execute(uint32 scriptAddress, byte *storage) {
 			if (EAX.getVal() != 0)
 				ESI += 4;
 			else
-				ESI += (int32)_readAccess.getU32(ESI);
+				ESI += (int32)_mem.getU32(ESI);
 			break;
 
 		case OP_JMP:
-			ESI += (int32)_readAccess.getU32(ESI);
+			ESI += (int32)_mem.getU32(ESI);
 			break;
 
 		case OP_SP_ADD:
-			SP += (int32)_readAccess.getU32(ESI);
+			SP += (int32)_mem.getU32(ESI);
 			ESI += 4;
 			break;
 
 		case OP_MOV_EDI_ECX_AL:
-			setMem8(REF_EDI, _readAccess.getU32(ESI), EAX.getVal() & 0xff);
+			setMem8(REF_EDI, _mem.getU32(ESI), EAX.getVal() & 0xff);
 			ESI += 4;
 			break;
 
 		case OP_MOV_EBX_ECX_AL:
-			setMem8(REF_EBX, _readAccess.getU32(ESI), EAX.getVal() & 0xff);
+			setMem8(REF_EBX, _mem.getU32(ESI), EAX.getVal() & 0xff);
 			ESI += 4;
 			break;
 
 		case OP_MOV_EDI_ECX_EAX:
-			setMem32(REF_EDI, _readAccess.getU32(ESI), EAX.getVal());
+			setMem32(REF_EDI, _mem.getU32(ESI), EAX.getVal());
 			ESI += 4;
 			break;
 
 		case OP_MOV_EBX_ECX_EAX:
-			setMem32(REF_EBX, _readAccess.getU32(ESI), EAX.getVal());
+			setMem32(REF_EBX, _mem.getU32(ESI), EAX.getVal());
 			ESI += 4;
 			break;
 
@@ -259,7 +3749,7 @@ uint32 VM::execute(uint32 scriptAddress, byte *storage) {
 
 		case OP_RETX:
 			ECX = popReg();
-			SP += _readAccess.getU32(ESI);
+			SP += _mem.getU32(ESI);
 			ESI = ECX.getVal();
 			ESI += 4;
 			break;
@@ -301,7 +3791,7 @@ uint32 VM::execute(uint32 scriptAddress, byte *storage) {
 			break;
 
 		case OP_LOAD:
-            EAX.setVal( _readAccess.getU32(ESI) );
+            EAX.setVal( _mem.getU32(ESI) );
 			ESI += 4;
 			break;
 
@@ -329,17 +3819,17 @@ uint32 VM::execute(uint32 scriptAddress, byte *storage) {
 
 		case OP_LOAD_OFFSET_EDI:
 		case OP_LOAD_OFFSET_EDI2:
-            EAX.setAddress(REF_EDI, _readAccess.getU32(ESI));
+            EAX.setAddress(REF_EDI, _mem.getU32(ESI));
 			ESI += 4;
 			break;
 
 		case OP_LOAD_OFFSET_EBX:
-            EAX.setAddress(REF_EBX, _readAccess.getU32(ESI));
+            EAX.setAddress(REF_EBX, _mem.getU32(ESI));
 			ESI += 4;
 			break;
 
 		case OP_LOAD_OFFSET_ESP:
-            EAX.setAddress(REF_STACK, _readAccess.getU32(ESI) + SP);
+            EAX.setAddress(REF_STACK, _mem.getU32(ESI) + SP);
 			ESI += 4;
 			break;
 
@@ -380,22 +3870,22 @@ uint32 VM::execute(uint32 scriptAddress, byte *storage) {
 			break;
 
 		case OP_MOV_EAX_BPTR_EDI:
-			EAX.setVal( (int32)((int8)getMem8(REF_EDI, _readAccess.getU32(ESI))) );
+			EAX.setVal( (int32)((int8)getMem8(REF_EDI, _mem.getU32(ESI))) );
 			ESI += 4;
 			break;
 
 		case OP_MOV_EAX_BPTR_EBX:
-            EAX.setVal( (int32)((int8)getMem8(REF_EBX, _readAccess.getU32(ESI))) );
+            EAX.setVal( (int32)((int8)getMem8(REF_EBX, _mem.getU32(ESI))) );
 			ESI += 4;
 			break;
 
 		case OP_MOV_EAX_DPTR_EDI:
-            EAX.setVal( getMem32(REF_EDI, _readAccess.getU32(ESI)) );
+            EAX.setVal( getMem32(REF_EDI, _mem.getU32(ESI)) );
 			ESI += 4;
 			break;
 
 		case OP_MOV_EAX_DPTR_EBX:
-            EAX.setVal( getMem32(REF_EBX, _readAccess.getU32(ESI)) );
+            EAX.setVal( getMem32(REF_EBX, _mem.getU32(ESI)) );
 			ESI += 4;
 			break;
 
@@ -409,14 +3899,14 @@ uint32 VM::execute(uint32 scriptAddress, byte *storage) {
 
 		case OP_PUSH_ESI_ADD_EDI:
 			push32(ESI);
-			ESI = _readAccess.getU32(ESI);
+			ESI = _mem.getU32(ESI);
 			break;
 
 		case OP_CALL_FUNC:
-			EAX.setVal( _readAccess.getU32(ESI) );
+			EAX.setVal( _mem.getU32(ESI) );
 			ESI += 4;
-			if (_callFuncs)
-				_callFuncs(_callingObject, this, EAX.getVal());
+			if (_runtime._callFuncs)
+				_runtime._callFuncs(_runtime._callingObject, this, EAX.getVal());
 			break;
 
 		case OP_PUSH_ESI_SET_EDX_EDI:
@@ -430,25 +3920,628 @@ uint32 VM::execute(uint32 scriptAddress, byte *storage) {
 }
 
 
-uint32 VM::doScript(uint32 scriptAddress, byte *storage) {
+uint32 VM::Runtime::doScript(uint32 scriptAddress, byte *storage) {
+	if (_interrupt)
+		return 0;
+
+	VM *context = _threads.acquire();
+	uint32 res = context->execute(scriptAddress, storage);
+	_threads.release();
+	return res;
+}
+
+uint32 VM::Runtime::doCondition(uint32 scriptAddress, byte *storage) {
 	if (_interrupt)
 		return 0;
 
-	for (int i = 0; i < THREADS_COUNT; i++) {
-		if (!_threads[i]._inUse) {
-			_threads[i]._inUse = true;
-			uint32 res = _threads[i].execute(scriptAddress, storage);
-			_threads[i]._inUse = false;
-			return res;
+	ConditionMemo &memo = _conditionMemo;
+	if (!memo._enabled)
+		return doScript(scriptAddress, storage);
+
+	MemoEntry &entry = memo._scripts.getOrCreateVal(scriptAddress);
+	if (!entry.analyzed || entry.codeGeneration != _memAccess._codeGeneration) {
+		ScriptCFG cfg;
+		PureScript info;
+
+		entry.analyzed = true;
+		entry.codeGeneration = _memAccess._codeGeneration;
+		entry.pure = analyzeScript(_memAccess, scriptAddress, cfg) && analyzePurity(_memAccess, cfg, info);
+		entry.ebxInputs.clear();
+		entry.results.clear();
+
+		for (const MemRange &r : info.inputs) {
+			if (!entry.pure)
+				break;
+			if (r.memtype == REF_EDI)
+				_memAccess.markWatch(r.offset, r.size);
+			else
+				entry.ebxInputs.push_back(r);
 		}
 	}
 
-	VM *tmpcontext = new VM();
-	uint32 res = tmpcontext->execute(scriptAddress, storage);
-	delete tmpcontext;
+	if (!entry.pure || (!storage && !entry.ebxInputs.empty())) {
+		memo._uncached++;
+		return doScript(scriptAddress, storage);
+	}
+
+	if (entry.epoch != memo._epoch || entry.watchGeneration != _memAccess._watchGeneration) {
+		if (entry.epoch == memo._epoch && !entry.results.empty())
+			memo._invalidations++;
+
+		entry.results.clear();
+		entry.epoch = memo._epoch;
+		entry.watchGeneration = _memAccess._watchGeneration;
+	}
+
+	Common::Array<byte> key;
+	for (const MemRange &r : entry.ebxInputs) {
+		for (uint32 i = 0; i < r.size; i++)
+			key.push_back(storage[r.offset + i]);
+	}
+
+	Common::HashMap<Common::Array<byte>, uint32, MemoKeyHash>::const_iterator it = entry.results.find(key);
+	if (it != entry.results.end()) {
+		entry.hits++;
+		memo._hits++;
+		return it->_value;
+	}
+
+	/* pure script can't call back here, so entry stays valid */
+	const uint32 res = doScript(scriptAddress, storage);
+	entry.misses++;
+	memo._misses++;
+
+	if (!_interrupt)
+		entry.results[key] = res;
+
 	return res;
 }
 
+uint VM::MemoKeyHash::operator()(const Common::Array<byte> &key) const {
+	uint hash = key.size();
+	for (byte b : key)
+		hash = hash * 31 + b;
+	return hash;
+}
+
+uint32 VM::hashScript(const MemAccess &mem, const ScriptCFG &cfg, uint32 *size) {
+	/* FNV-1a over blocks with their offsets from entry, branches are
+	   relative so same script hashes same at any address */
+	uint32 hash = 2166136261u;
+	uint32 total = 0;
+
+	for (const BasicBlock &blk : cfg.blocks) {
+		const uint32 offset = blk.start - cfg.entry;
+		for (uint i = 0; i < 4; i++)
+			hash = (hash ^ ((offset >> (i * 8)) & 0xff)) * 16777619u;
+
+		for (uint32 addr = blk.start; addr < blk.end; addr++)
+			hash = (hash ^ mem.getU8(addr)) * 16777619u;
+
+		total += blk.end - blk.start;
+	}
+
+	if (size)
+		*size = total;
+	return hash;
+}
+
+/* Addresses are emitted as offsets from entry, so translated script runs
+   at any address where same bytecode is found */
+static Common::String translateOp(const VM::MemAccess &mem, uint32 entry, uint32 addr, byte op) {
+	const uint32 imm = mem.getU32(addr + 1);
+	const uint32 next = addr + (opHasImmediate(op) ? 5 : 1) - entry;
+	const uint32 target = addr + 1 + imm - entry;
+
+	static const char *const cmpExpr[] = {
+		"vm->EDX.getVal() == vm->EAX.getVal()",
+		"vm->EDX.getVal() != vm->EAX.getVal()",
+		"(int32)vm->EDX.getVal() < (int32)vm->EAX.getVal()",
+		"(int32)vm->EDX.getVal() <= (int32)vm->EAX.getVal()",
+		"(int32)vm->EDX.getVal() > (int32)vm->EAX.getVal()",
+		"(int32)vm->EDX.getVal() >= (int32)vm->EAX.getVal()",
+		"vm->EDX.getVal() < vm->EAX.getVal()",
+		"vm->EDX.getVal() <= vm->EAX.getVal()",
+		"vm->EDX.getVal() > vm->EAX.getVal()",
+		"vm->EDX.getVal() >= vm->EAX.getVal()"
+	};
+
+	/* store may hit decoded code, rest of script must run from memory */
+	const Common::String codeCheck = Common::String::format("\tif (vm->_mem._codeGeneration != gen)\n\t\treturn vm->fallback(entry + 0x%x);\n", next);
+
+	switch (op) {
+	default:
+	case VM::OP_EXIT:
+		return Common::String::format("\tvm->ESI = entry + 0x%x;\n\treturn vm->EAX.getVal();\n", addr + 1 - entry);
+
+	case VM::OP_CMP_EQ:
+	case VM::OP_CMP_NE:
+	case VM::OP_CMP_LE:
+	case VM::OP_CMP_LEQ:
+	case VM::OP_CMP_GR:
+	case VM::OP_CMP_GREQ:
+	case VM::OP_CMP_NAE:
+	case VM::OP_CMP_NA:
+	case VM::OP_CMP_A:
+	case VM::OP_CMP_AE:
+		return Common::String::format("\tvm->EAX.setVal(%s ? 1 : 0);\n", cmpExpr[op - VM::OP_CMP_EQ]);
+
+	case VM::OP_BRANCH:
+		return Common::String::format("\tif (vm->EAX.getVal() == 0)\n\t\tgoto L_%x;\n", target);
+
+	case VM::OP_JMP:
+		return Common::String::format("\tgoto L_%x;\n", target);
+
+	case VM::OP_SP_ADD:
+		return Common::String::format("\tvm->SP += 0x%xu;\n", imm);
+
+	case VM::OP_MOV_EDI_ECX_AL:
+		return Common::String::format("\tvm->setMem8(VM::REF_EDI, 0x%x, vm->EAX.getVal() & 0xff);\n", imm) + codeCheck;
+
+	case VM::OP_MOV_EBX_ECX_AL:
+		return Common::String::format("\tvm->setMem8(VM::REF_EBX, 0x%x, vm->EAX.getVal() & 0xff);\n", imm);
+
+	case VM::OP_MOV_EDI_ECX_EAX:
+		return Common::String::format("\tvm->setMem32(VM::REF_EDI, 0x%x, vm->EAX.getVal());\n", imm) + codeCheck;
+
+	case VM::OP_MOV_EBX_ECX_EAX:
+		return Common::String::format("\tvm->setMem32(VM::REF_EBX, 0x%x, vm->EAX.getVal());\n", imm);
+
+	case VM::OP_MOV_EDX_EAX:
+		return "\tvm->EDX = vm->EAX;\n";
+
+	case VM::OP_ADD_EAX_EDX:
+		return "\tvm->EAX.setVal(vm->EAX.getVal() + vm->EDX.getVal());\n";
+
+	case VM::OP_MUL:
+		return "\tvm->EAX.setVal(vm->EAX.getVal() * vm->EDX.getVal());\n";
+
+	case VM::OP_OR:
+		return "\tvm->EAX.setVal(vm->EAX.getVal() | vm->EDX.getVal());\n";
+
+	case VM::OP_XOR:
+		return "\tvm->EAX.setVal(vm->EAX.getVal() ^ vm->EDX.getVal());\n";
+
+	case VM::OP_AND:
+		return "\tvm->EAX.setVal(vm->EAX.getVal() & vm->EDX.getVal());\n";
+
+	case VM::OP_NEG:
+		return "\tvm->EAX.setVal((uint32)(-(int32)vm->EAX.getVal()));\n";
+
+	case VM::OP_SAR:
+		return "\tvm->EAX.setVal((int32)vm->EDX.getVal() >> (vm->EAX.getVal() & 0xff));\n";
+
+	case VM::OP_SHL:
+		return "\tvm->EAX.setVal(vm->EDX.getVal() << (vm->EAX.getVal() & 0xff));\n";
+
+	case VM::OP_LOAD:
+		return Common::String::format("\tvm->EAX.setVal(0x%xu);\n", imm);
+
+	case VM::OP_INC:
+		return "\tvm->EAX.setVal(vm->EAX.getVal() + 1);\n";
+
+	case VM::OP_DEC:
+		return "\tvm->EAX.setVal(vm->EAX.getVal() - 1);\n";
+
+	case VM::OP_XCHG:
+		return "\tvm->ECX = vm->EAX;\n\tvm->EAX = vm->EDX;\n\tvm->EDX = vm->ECX;\n";
+
+	case VM::OP_PUSH_EAX:
+		return "\tvm->pushReg(vm->EAX);\n";
+
+	case VM::OP_POP_EDX:
+		return "\tvm->EDX = vm->popReg();\n";
+
+	case VM::OP_LOAD_OFFSET_EDI:
+	case VM::OP_LOAD_OFFSET_EDI2:
+		return Common::String::format("\tvm->EAX.setAddress(VM::REF_EDI, 0x%x);\n", imm);
+
+	case VM::OP_LOAD_OFFSET_EBX:
+		return Common::String::format("\tvm->EAX.setAddress(VM::REF_EBX, 0x%x);\n", imm);
+
+	case VM::OP_LOAD_OFFSET_ESP:
+		return Common::String::format("\tvm->EAX.setAddress(VM::REF_STACK, 0x%xu + vm->SP);\n", imm);
+
+	case VM::OP_MOV_PTR_EDX_AL:
+		return Common::String("\tvm->setMem8(vm->EDX, vm->EAX.getVal() & 0xff);\n") + codeCheck;
+
+	case VM::OP_MOV_PTR_EDX_EAX:
+		return Common::String("\tvm->setMem32(vm->EDX, vm->EAX.getVal());\n") + codeCheck;
+
+	case VM::OP_SHL_2:
+		return "\tvm->EAX.setVal(vm->EAX.getVal() << 2);\n";
+
+	case VM::OP_ADD_4:
+		return "\tvm->EAX.setVal(vm->EAX.getVal() + 4);\n";
+
+	case VM::OP_SUB_4:
+		return "\tvm->EAX.setVal(vm->EAX.getVal() - 4);\n";
+
+	case VM::OP_XCHG_ESP:
+		return "\tvm->ECX = vm->popReg();\n\tvm->pushReg(vm->EAX);\n\tvm->EAX = vm->ECX;\n";
+
+	case VM::OP_NEG_ADD:
+		return "\tvm->EAX.setVal((-(int32)vm->EAX.getVal()) + vm->EDX.getVal());\n";
+
+	case VM::OP_DIV:
+		return "\tvm->ECX = vm->EAX;\n"
+		       "\tvm->EAX.setVal((int32)vm->EDX.getVal() / (int32)vm->ECX.getVal());\n"
+		       "\tvm->EDX.setVal((int32)vm->EDX.getVal() % (int32)vm->ECX.getVal());\n";
+
+	case VM::OP_MOV_EAX_BPTR_EDI:
+		return Common::String::format("\tvm->EAX.setVal((int32)((int8)vm->getMem8(VM::REF_EDI, 0x%x)));\n", imm);
+
+	case VM::OP_MOV_EAX_BPTR_EBX:
+		return Common::String::format("\tvm->EAX.setVal((int32)((int8)vm->getMem8(VM::REF_EBX, 0x%x)));\n", imm);
+
+	case VM::OP_MOV_EAX_DPTR_EDI:
+		return Common::String::format("\tvm->EAX.setVal(vm->getMem32(VM::REF_EDI, 0x%x));\n", imm);
+
+	case VM::OP_MOV_EAX_DPTR_EBX:
+		return Common::String::format("\tvm->EAX.setVal(vm->getMem32(VM::REF_EBX, 0x%x));\n", imm);
+
+	case VM::OP_MOV_EAX_BPTR_EAX:
+		return "\tvm->EAX.setVal((int32)((int8)vm->getMem8(vm->EAX)));\n";
+
+	case VM::OP_MOV_EAX_DPTR_EAX:
+		return "\tvm->EAX.setVal(vm->getMem32(vm->EAX));\n";
+
+	case VM::OP_CALL_FUNC:
+		return Common::String::format("\tif (!vm->callFunc(%u, entry + 0x%x))\n\t\treturn 0;\n", imm, next) + codeCheck;
+	}
+}
+
+bool VM::translateScript(const MemAccess &mem, uint32 address, Common::String &out, NativeEntry &entry) {
+	ScriptCFG cfg;
+	if (!analyzeScript(mem, address, cfg))
+		return false;
+
+	/* Subroutines share stack and return address with caller, leave
+	   such scripts to interpreter */
+	Common::HashMap<uint32, bool> targets;
+	bool checksCode = false;
+
+	for (const BasicBlock &blk : cfg.blocks) {
+		uint32 addr = blk.start;
+		while (addr < blk.end) {
+			const byte op = mem.getU8(addr);
+			switch (op) {
+			case OP_RET:
+			case OP_RETX:
+			case OP_PUSH_ESI_ADD_EDI:
+			case OP_PUSH_ESI_SET_EDX_EDI:
+				return false;
+
+			case OP_BRANCH:
+			case OP_JMP:
+				targets[addr + 1 + mem.getU32(addr + 1)] = true;
+				break;
+
+			case OP_MOV_EDI_ECX_AL:
+			case OP_MOV_EDI_ECX_EAX:
+			case OP_MOV_PTR_EDX_AL:
+			case OP_MOV_PTR_EDX_EAX:
+			case OP_CALL_FUNC:
+				checksCode = true;
+				break;
+
+			default:
+				break;
+			}
+			addr += opHasImmediate(op) ? 5 : 1;
+		}
+	}
+
+	entry.hash = hashScript(mem, cfg, &entry.size);
+	entry.code = nullptr;
+	entry.func = nullptr;
+	entry.name = nullptr;
+
+	/* bytecode is kept with native, registry compares it before binding */
+	out = Common::String::format("/* script at %x, %u bytes */\n", address, entry.size);
+	out += Common::String::format("static const byte code_%08x_%x[] = {", entry.hash, entry.size);
+	uint32 count = 0;
+	for (const BasicBlock &blk : cfg.blocks) {
+		for (uint32 addr = blk.start; addr < blk.end; addr++, count++)
+			out += Common::String::format("%s0x%02x", count % 16 ? ", " : (count ? ",\n\t" : "\n\t"), mem.getU8(addr));
+	}
+	out += "\n};\n\n";
+
+	out += Common::String::format("static uint32 native_%08x_%x(VM *vm, uint32 entry) {\n", entry.hash, entry.size);
+	if (checksCode)
+		out += "\tconst uint32 gen = vm->_mem._codeGeneration;\n";
+
+	/* blocks are emitted by address, entry may be not the first one */
+	if (cfg.blocks[0].start != address) {
+		targets[address] = true;
+		out += "\tgoto L_0;\n";
+	}
+
+	for (const BasicBlock &blk : cfg.blocks) {
+		if (targets.contains(blk.start))
+			out += Common::String::format("L_%x:\n", blk.start - address);
+
+		uint32 addr = blk.start;
+		while (addr < blk.end) {
+			const byte op = mem.getU8(addr);
+			out += translateOp(mem, address, addr, op);
+			addr += opHasImmediate(op) ? 5 : 1;
+		}
+	}
+
+	out += "}\n";
+	return true;
+}
+
+bool VM::callFunc(uint32 funcID, uint32 next) {
+	EAX.setVal(funcID);
+	ESI = next;
+	if (_runtime._callFuncs)
+		_runtime._callFuncs(_runtime._callingObject, this, funcID);
+	return !_runtime._interrupt;
+}
+
+uint32 VM::fallback(uint32 address) {
+	ESI = address;
+	return interpret<false>();
+}
+
+VM::NativeRegistry::NativeRegistry(MemAccess &mem) : _mem(mem) {
+	for (const NativeEntry *e = _nativeScripts; e->func; e++) {
+		NativeInfo info;
+		info.entry = e;
+		_natives.push_back(info);
+	}
+
+	/* pointers to infos are kept by bindings, so array is final here */
+	for (uint i = 0; i < _natives.size(); i++) {
+		if (!_byHash.contains(_natives[i].entry->hash))
+			_byHash[_natives[i].entry->hash] = i;
+	}
+}
+
+bool VM::NativeRegistry::matches(const NativeEntry &entry, const ScriptCFG &cfg, uint32 size) const {
+	if (entry.size != size || !entry.code)
+		return false;
+
+	/* hash only picks candidate, bytecode must be the same */
+	uint32 i = 0;
+	for (const BasicBlock &blk : cfg.blocks) {
+		for (uint32 addr = blk.start; addr < blk.end; addr++) {
+			if (_mem.getU8(addr) != entry.code[i++])
+				return false;
+		}
+	}
+	return true;
+}
+
+void VM::NativeRegistry::resetStats() {
+	for (NativeInfo &info : _natives) {
+		info.calls = 0;
+		info.checked = 0;
+		info.mismatches = 0;
+	}
+}
+
+VM::NativeInfo *VM::NativeRegistry::lookup(uint32 address) {
+	if (!_enabled || _byHash.empty())
+		return nullptr;
+
+	if (_generation != _mem._codeGeneration) {
+		_bound.clear();
+		_generation = _mem._codeGeneration;
+	}
+
+	Common::HashMap<uint32, NativeInfo *>::const_iterator it = _bound.find(address);
+	if (it != _bound.end())
+		return it->_value;
+
+	NativeInfo *native = nullptr;
+
+	ScriptCFG cfg;
+	if (analyzeScript(_mem, address, cfg)) {
+		uint32 size = 0;
+		const uint32 hash = hashScript(_mem, cfg, &size);
+
+		Common::HashMap<uint32, uint32>::const_iterator e = _byHash.find(hash);
+		if (e != _byHash.end() && matches(*_natives[e->_value].entry, cfg, size)) {
+			native = &_natives[e->_value];
+
+			/* writes to script must drop this binding */
+			for (const BasicBlock &blk : cfg.blocks)
+				_mem.markCode(blk.start, blk.end - blk.start);
+		}
+	}
+
+	_bound[address] = native;
+	return native;
+}
+
+/* Bytes of object storage addressed by script with immediate offsets,
+   calls tells if script calls builtins */
+static uint32 storageExtent(const VM::MemAccess &mem, const VM::ScriptCFG &cfg, bool &calls) {
+	uint32 extent = 0;
+	calls = false;
+
+	for (const VM::BasicBlock &blk : cfg.blocks) {
+		for (uint32 addr = blk.start; addr < blk.end; addr += opHasImmediate(mem.getU8(addr)) ? 5 : 1) {
+			const uint32 imm = mem.getU32(addr + 1) & VM::ADDRESS_MASK;
+			uint32 size = 0;
+
+			switch (mem.getU8(addr)) {
+			case VM::OP_MOV_EBX_ECX_AL:
+			case VM::OP_MOV_EAX_BPTR_EBX:
+			case VM::OP_LOAD_OFFSET_EBX:
+				size = 1;
+				break;
+
+			case VM::OP_MOV_EBX_ECX_EAX:
+			case VM::OP_MOV_EAX_DPTR_EBX:
+				size = 4;
+				break;
+
+			case VM::OP_CALL_FUNC:
+				calls = true;
+				break;
+
+			default:
+				break;
+			}
+
+			if (size && imm + size > extent)
+				extent = imm + size;
+		}
+	}
+
+	/* object storage is never larger */
+	return MIN<uint32>(extent, 0x100);
+}
+
+static bool sameSparse(const VM::MemSnapshot &snap, const VM::MemAccess &mem, const Common::HashMap<uint32, VM::MemoryBlock *> &pages, uint32 &diff) {
+	for (Common::HashMap<uint32, VM::MemoryBlock *>::const_iterator it = pages.begin(); it != pages.end(); ++it) {
+		const VM::MemoryBlock *a = snap.block(it->_key) ? snap.block(it->_key) : &VM::MemAccess::_zeroBlock;
+		const VM::MemoryBlock *b = mem.pageBlock(it->_key);
+		if (a == b)
+			continue;
+
+		for (uint32 j = 0; j < VM::PAGE_SIZE; j++) {
+			if (a->data[j] != b->data[j]) {
+				diff = (it->_key << VM::PAGE_SHIFT) + j;
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/* Compares snapshot with live memory, first differing address goes to diff */
+static bool sameMemory(const VM::MemSnapshot &snap, const VM::MemAccess &mem, uint32 &diff) {
+	const uint32 pages = MAX(snap._pages.size(), mem._pages.size());
+
+	for (uint32 i = 0; i < pages; i++) {
+		const VM::MemoryBlock *a = snap.block(i) ? snap.block(i) : &VM::MemAccess::_zeroBlock;
+		const VM::MemoryBlock *b = mem.pageBlock(i);
+		if (a == b)
+			continue;
+
+		for (uint32 j = 0; j < VM::PAGE_SIZE; j++) {
+			if (a->data[j] != b->data[j]) {
+				diff = (i << VM::PAGE_SHIFT) + j;
+				return false;
+			}
+		}
+	}
+
+	return sameSparse(snap, mem, snap._sparsePages, diff) && sameSparse(snap, mem, mem._sparsePages, diff);
+}
+
+/* Runs native, rolls its effects back and runs bytecode, then compares
+   result, EDX, SP, live stack, memory and object storage. Bytecode state
+   is kept. Scripts calling builtins only run native, as builtins change
+   engine state. */
+uint32 VM::validateNative(NativeInfo &native, uint32 scriptAddress) {
+	ScriptCFG cfg;
+	analyzeScript(_mem, scriptAddress, cfg);
+
+	bool calls = false;
+	uint32 extent = storageExtent(_mem, cfg, calls);
+	if (calls)
+		return native.entry->func(this, scriptAddress);
+
+	/* scripts may run without object storage */
+	if (!EBX)
+		extent = 0;
+
+	native.checked++;
+
+	byte stack[STACK_SIZE];
+	byte storage[0x100];
+	memcpy(stack, _stack, STACK_SIZE);
+	if (EBX)
+		memcpy(storage, EBX, extent);
+	const ValAddr eax = EAX;
+	const ValAddr edx = EDX;
+	const ValAddr ecx = ECX;
+	const uint32 sp = SP;
+
+	MemSnapshot before;
+	_mem.takeSnapshot(before);
+
+	const uint32 nativeResult = native.entry->func(this, scriptAddress);
+
+	MemSnapshot after;
+	_mem.takeSnapshot(after);
+
+	byte nativeStack[STACK_SIZE];
+	byte nativeStorage[0x100];
+	memcpy(nativeStack, _stack, STACK_SIZE);
+	if (EBX)
+		memcpy(nativeStorage, EBX, extent);
+	const uint32 nativeEdx = EDX.getVal();
+	const uint32 nativeSp = SP;
+
+	/* full restore would drop all decoded code on every call */
+	_mem.rollback(before);
+	memcpy(_stack, stack, STACK_SIZE);
+	if (EBX)
+		memcpy(EBX, storage, extent);
+	EAX = eax;
+	EDX = edx;
+	ECX = ecx;
+	ESI = scriptAddress;
+	SP = sp;
+
+	const uint32 result = runBytecode();
+
+	Common::String diff;
+	if (result != nativeResult)
+		diff += Common::String::format(" result %x/%x", nativeResult, result);
+	if (EDX.getVal() != nativeEdx)
+		diff += Common::String::format(" EDX %x/%x", nativeEdx, EDX.getVal());
+	if (SP != nativeSp)
+		diff += Common::String::format(" SP %x/%x", nativeSp, SP);
+	else if (SP < STACK_SIZE && memcmp(_stack + SP, nativeStack + SP, STACK_SIZE - SP))
+		diff += " stack";
+	if (EBX && memcmp(EBX, nativeStorage, extent))
+		diff += " storage";
+
+	uint32 address = 0;
+	if (!sameMemory(after, _mem, address))
+		diff += Common::String::format(" memory at %x", address);
+
+	if (!diff.empty()) {
+		native.mismatches++;
+		warning("VM: native %s of script %x differs from bytecode:%s",
+		        native.entry->name ? native.entry->name : "(translated)", scriptAddress, diff.c_str());
+	}
+
+	return result;
+}
+
+VM::ContextPool::ContextPool(Runtime &runtime) : _runtime(runtime) {
+	_contexts.reserve(THREADS_COUNT);
+	for (uint i = 0; i < THREADS_COUNT; i++)
+		_contexts.push_back(new VM(_runtime));
+}
+
+VM::ContextPool::~ContextPool() {
+	for (VM *context : _contexts)
+		delete context;
+}
+
+VM *VM::ContextPool::acquire() {
+	if (_depth == _contexts.size())
+		_contexts.push_back(new VM(_runtime));
+
+	VM *context = _contexts[_depth];
+	_depth++;
+	if (_depth > _maxDepth)
+		_maxDepth = _depth;
+
+	return context;
+}
+
 
 
 int32 VM::getS32(const void *mem) {
@@ -505,7 +4598,7 @@ uint32 VM::getMem32(int memtype, uint32 offset) {
 		return getU32(EBX + offset);
 
 	case REF_EDI:
-		return _readAccess.getU32(offset);
+		return _mem.getU32(offset & ADDRESS_MASK);
 	}
 }
 
@@ -526,7 +4619,7 @@ uint8 VM::getMem8(int memtype, uint32 offset) {
 		return EBX[offset];
 
 	case REF_EDI:
-		return _readAccess.getU8(offset);
+		return _mem.getU8(offset & ADDRESS_MASK);
 	}
 }
 
@@ -547,7 +4640,7 @@ void VM::setMem32(int memtype, uint32 offset, uint32 val) {
 		break;
 
 	case REF_EDI:
-		_writeAccess.setU32(offset, val);
+		_mem.setU32(offset & ADDRESS_MASK, val);
 		break;
 	}
 }
@@ -569,7 +4662,7 @@ void VM::setMem8(int memtype, uint32 offset, uint8 val) {
 		break;
 
 	case REF_EDI:
-		_writeAccess.setU8(offset, val);
+		_mem.setU8(offset & ADDRESS_MASK, val);
 		break;
 	}
 }
@@ -578,75 +4671,23 @@ void VM::setMem8(const ValAddr &addr, uint8 val) {
     setMem8(addr.getMemType(), addr.getOffset(), val);
 }
 
-void VM::clearMemory() {
-	_memMap.clear();
-	_memAccess.reset();
+void VM::Runtime::clearMemory() {
+	_memAccess.clear();
+	_codeCache.resetStats();
+	_profiler._scripts.clear();
+	_conditionMemo.reset();
 }
 
-void VM::writeMemory(uint32 address, const byte* data, uint32 dataSize) {
-
-	uint32 blockAddr = address & (~0xff);
-	uint32 pos = 0;
-	uint32 remain = dataSize;
-
+void VM::Runtime::writeMemory(uint32 address, const byte* data, uint32 dataSize) {
 	//warning("Write memory at %x sz %x", address, dataSize);
-
-	for (uint32 addr = blockAddr; addr < address + dataSize; addr += 0x100) {
-		MemoryBlock &block = _memMap.getOrCreateVal(addr);
-
-		block.address = addr; // update it
-
-		uint32 copyCnt = (addr + 0x100) - (address + pos);
-		if (copyCnt > remain)
-			copyCnt = remain;
-
-		uint32 blockPos = (address + pos) - addr;
-		memcpy(block.data + blockPos, data + pos, copyCnt);
-
-		pos += copyCnt;
-		remain -= copyCnt;
-	}
-}
-
-void VM::zeroMemory(uint32 address, uint32 count) {
-	uint32 blockAddr = address & (~0xff);
-	uint32 pos = 0;
-	uint32 remain = count;
-
-	for (uint32 addr = blockAddr; addr < address + count; addr += 0x100) {
-		MemoryBlock *block = findMemoryBlock(addr);
-
-		uint32 zeroCnt = (addr + 0x100) - (address + pos);
-		if (zeroCnt > remain)
-			zeroCnt = remain;
-
-		uint32 blockPos = (address + pos) - addr;
-
-		if (block)
-			memset(block->data + blockPos, 0, zeroCnt);
-
-		pos += zeroCnt;
-		remain -= zeroCnt;
-	}
-}
-
-VM::MemoryBlock *VM::findMemoryBlock(uint32 address) {
-	Common::HashMap<uint32, MemoryBlock>::iterator it = _memMap.find(address & (~0xff));
-	if (it == _memMap.end())
-		return nullptr;
-
-	return &it->_value;
+	_memAccess.write(address, data, dataSize);
 }
 
-VM::MemoryBlock *VM::createBlock(uint32 address) {
-	MemoryBlock &blk = _memMap.getOrCreateVal(address & (~0xff));
-	blk.address = address & (~0xff);
-	return &blk;
+void VM::Runtime::zeroMemory(uint32 address, uint32 count) {
+	_memAccess.zero(address, count);
 }
 
-
-
-Common::Array<byte> VM::readMemBlocks(uint32 address, uint32 count) {
+Common::Array<byte> VM::Runtime::readMemBlocks(uint32 address, uint32 count) const {
 	Common::Array<byte> data(count);
 
 	readMemBlocks(data.data(), address, count);
@@ -654,80 +4695,44 @@ Common::Array<byte> VM::readMemBlocks(uint32 address, uint32 count) {
 	return data;
 }
 
-void VM::readMemBlocks(byte *dst, uint32 address, uint32 count) {
-	MemoryBlock *blk = findMemoryBlock(address);
-
-	uint32 pos = 0;
-	uint32 blockAddr = address & (~0xff);
-	uint32 remain = count;
-	while (remain > 0) {
-		uint32 dataCpyCount = (blockAddr + 0x100) - (address + pos);
-		if (dataCpyCount > remain)
-			dataCpyCount = remain;
-
-		if (!blk) {
-			memset(dst + pos, 0, dataCpyCount);
-		} else {
-			memcpy(dst + pos, blk->data + (address + pos - blk->address), dataCpyCount);
-		}
-
-		pos += dataCpyCount;
-		remain -= dataCpyCount;
-		blockAddr += 0x100;
-		blk = findMemoryBlock(blockAddr);
-	}
+void VM::Runtime::readMemBlocks(byte *dst, uint32 address, uint32 count) const {
+	_memAccess.read(dst, address, count);
 }
 
-Common::String VM::readMemString(uint32 address, uint32 maxLen) {
-	Common::String s;
+Common::String VM::Runtime::readMemString(uint32 address, uint32 maxLen) const {
+	return _memAccess.getString(address, maxLen).toString();
+}
 
-	MemoryBlock *blk = findMemoryBlock(address);
+VM::MemString VM::viewString(int memtype, uint32 offset, uint32 maxLen) {
+	MemString str;
 
-	if (!blk)
-		return s;
+	switch (memtype) {
+	default:
+	case REF_UNK:
+		break;
 
-	uint32 pos = address - blk->address;
-	char c = blk->data[pos];
+	case REF_STACK:
+		if (offset < STACK_SIZE)
+			str.set((const char *)_stack + offset, MIN<uint32>(maxLen, STACK_SIZE - offset));
+		break;
 
-	while (c != 0) {
-		s += c;
+	case REF_EBX:
+		str.set((const char *)EBX + offset, maxLen);
+		break;
 
-		pos++;
-		if (pos >= 0x100) {
-			blk = findMemoryBlock(blk->address + 0x100);
-			pos = 0;
-		}
+	case REF_EDI:
+		return _mem.getString(offset & ADDRESS_MASK, maxLen);
+	}
 
-		if (!blk)
-			break;
+	return str;
+}
 
-		c = blk->data[pos];
-	}
-	return s;
+VM::MemString VM::viewString(const ValAddr &addr, uint32 maxLen) {
+	return viewString(addr.getMemType(), addr.getOffset(), maxLen);
 }
 
 Common::String VM::getString(int memtype, uint32 offset, uint32 maxLen) {
-	switch (memtype) {
-	default:
-	case REF_UNK:
-		return Common::String();
-
-	case REF_STACK: {
-		Common::String s = Common::String((const char *)_stack + offset);
-		if (s.size() > maxLen)
-			s.erase(maxLen);
-		return s;
-	}
-	case REF_EBX: {
-		Common::String s = Common::String((const char *)EBX + offset);
-		if (s.size() > maxLen)
-			s.erase(maxLen);
-		return s;
-	}
-
-	case REF_EDI:
-		return readMemString(offset, maxLen);
-	}
+	return viewString(memtype, offset, maxLen).toString();
 }
 
 Common::String VM::getString(const ValAddr &addr, uint32 maxLen) {
@@ -735,10 +4740,77 @@ Common::String VM::getString(const ValAddr &addr, uint32 maxLen) {
 }
 
 
-Common::String VM::decodeOp(uint32 address, int *size) {
+const char *VM::opName(uint op) {
+	static const char *const names[OP_MAX] = {
+		"EXIT", "CMP_EQ", "CMP_NE", "CMP_LE", "CMP_LEQ",
+		"CMP_GR", "CMP_GREQ", "CMP_NAE", "CMP_NA", "CMP_A",
+		"CMP_AE", "BRANCH", "JMP", "SP_ADD", "MOV_EDI_ECX_AL",
+		"MOV_EBX_ECX_AL", "MOV_EDI_ECX_EAX", "MOV_EBX_ECX_EAX", "RET", "RETX",
+		"MOV_EDX_EAX", "ADD_EAX_EDX", "MUL", "OR", "XOR",
+		"AND", "NEG", "SAR", "SHL", "LOAD",
+		"INC", "DEC", "XCHG", "PUSH_EAX", "POP_EDX",
+		"LOAD_OFFSET_EDI", "LOAD_OFFSET_EDI2", "LOAD_OFFSET_EBX", "LOAD_OFFSET_ESP", "MOV_PTR_EDX_AL",
+		"MOV_PTR_EDX_EAX", "SHL_2", "ADD_4", "SUB_4", "XCHG_ESP",
+		"NEG_ADD", "DIV", "MOV_EAX_BPTR_EDI", "MOV_EAX_BPTR_EBX", "MOV_EAX_DPTR_EDI",
+		"MOV_EAX_DPTR_EBX", "MOV_EAX_BPTR_EAX", "MOV_EAX_DPTR_EAX", "PUSH_ESI_ADD_EDI", "CALL_FUNC",
+		"PUSH_ESI_SET_EDX_EDI"
+	};
+
+	if (op >= OP_MAX)
+		return "UNK";
+
+	return names[op];
+}
+
+const char *VM::iopName(uint op) {
+	static const char *const names[IOP_MAX] = {
+		"EXIT", "CMP_EQ", "CMP_NE", "CMP_LE", "CMP_LEQ",
+		"CMP_GR", "CMP_GREQ", "CMP_NAE", "CMP_NA", "CMP_A",
+		"CMP_AE", "BRANCH", "JMP", "SP_ADD", "ST8_EDI",
+		"ST8_EBX", "ST32_EDI", "ST32_EBX", "RET", "RETX",
+		"MOV_EDX_EAX", "ADD_EAX_EDX", "MUL", "OR", "XOR",
+		"AND", "NEG", "SAR", "SHL", "LOAD",
+		"INC", "DEC", "XCHG", "PUSH_EAX", "POP_EDX",
+		"LEA_EDI", "LEA_EBX", "LEA_STACK",
+		"ST8_PTR", "ST8_PTR_STACK", "ST8_PTR_EBX", "ST8_PTR_EDI",
+		"ST32_PTR", "ST32_PTR_STACK", "ST32_PTR_EBX", "ST32_PTR_EDI",
+		"SHL_2", "ADD_4", "SUB_4", "XCHG_ESP", "NEG_ADD",
+		"DIV", "LD8_EDI", "LD8_EBX", "LD32_EDI", "LD32_EBX",
+		"LD8_PTR", "LD8_PTR_STACK", "LD8_PTR_EBX", "LD8_PTR_EDI",
+		"LD32_PTR", "LD32_PTR_STACK", "LD32_PTR_EBX", "LD32_PTR_EDI",
+		"CALL", "CALL_FUNC", "CALL_EDX",
+		"LD8_STACK", "LD32_STACK", "PUSH_LOAD", "PUSH_LOAD_POP",
+		"PUSH_LD32_EBX", "PUSH_LD32_EBX_POP", "PUSH_LD32_EDI", "PUSH_LD32_EDI_POP",
+		"MOV_EDX_LOAD", "MOV_EDX_LD32_EBX", "MOV_EDX_LD32_EDI",
+		"BINI_CMP_EQ", "BINI_CMP_NE", "BINI_CMP_LE", "BINI_CMP_LEQ",
+		"BINI_CMP_GR", "BINI_CMP_GREQ", "BINI_CMP_NAE", "BINI_CMP_NA",
+		"BINI_CMP_A", "BINI_CMP_AE", "BINI_ADD", "BINI_MUL",
+		"BINI_OR", "BINI_XOR", "BINI_AND", "BINI_SAR",
+		"BINI_SHL", "BINI_NEG_ADD",
+		"LOOP"
+	};
+
+	if (op >= IOP_MAX)
+		return "UNK";
+
+	return names[op];
+}
+
+const char *VM::loopKindName(uint kind) {
+	static const char *const names[] = {
+		"copy", "fill", "length", "compare"
+	};
+
+	if (kind >= ARRAYSIZE(names))
+		return "unk";
+
+	return names[kind];
+}
+
+Common::String VM::decodeOp(const MemAccess &mem, uint32 address, int *size) {
 	Common::String tmp;
 
-	MemAccess readmem;
+	const MemAccess &readmem = mem;
 
 	int sz = 1;
 	byte op = readmem.getU8(address);
@@ -994,36 +5066,73 @@ Common::String VM::decodeOp(uint32 address, int *size) {
 }
 
 
-Common::String VM::disassembly(uint32 address) {
+Common::String VM::disassembly(const MemAccess &mem, uint32 address) {
 	Common::String tmp;
 
-	uint32 addr = address;
-	MemAccess readmem;
+	const MemAccess &readmem = mem;
 
-	while (true) {
-		tmp += Common::String::format("%08x: ", addr);
+	ScriptCFG cfg;
+	if (!analyzeScript(mem, address, cfg)) {
+		/* plain listing up to EXIT */
+		uint32 addr = address;
+		while (true) {
+			tmp += Common::String::format("%08x: ", addr);
 
-		byte op = readmem.getU8(addr);
+			byte op = readmem.getU8(addr);
 
-		int sz = 1;
-		tmp += decodeOp(addr, &sz);
-		tmp += "\n";
+			int sz = 1;
+			tmp += decodeOp(mem, addr, &sz);
+			tmp += "\n";
 
-		addr += sz;
+			addr += sz;
 
-		if (op == OP_EXIT)
-			break;
+			if (op == OP_EXIT)
+				break;
+		}
+
+		return tmp;
+	}
+
+	tmp += Common::String::format("; entry %x, %u blocks, stack %d%s%s\n", address, cfg.blocks.size(), cfg.maxStack,
+	                              cfg.stackBounded ? "" : " unbounded", cfg.localOnly ? ", local only" : "");
+
+	uint32 prevEnd = cfg.blocks.empty() ? 0 : cfg.blocks[0].start;
+	for (const BasicBlock &blk : cfg.blocks) {
+		if (blk.start != prevEnd)
+			tmp += "\n";
+		prevEnd = blk.end;
+
+		tmp += Common::String::format("loc_%x:\n", blk.start);
+
+		tmp += Common::String::format("    ; depth %d+%d", blk.entryDepth, blk.maxDepth);
+		if (blk.localOnly)
+			tmp += ", local";
+		if (!blk.succs.empty()) {
+			tmp += ", next";
+			for (uint32 succ : blk.succs)
+				tmp += Common::String::format(" loc_%x", succ);
+		}
+		tmp += "\n";
+
+		uint32 addr = blk.start;
+		while (addr < blk.end) {
+			int sz = 1;
+			tmp += Common::String::format("%08x: ", addr);
+			tmp += decodeOp(mem, addr, &sz);
+			tmp += "\n";
+			addr += sz;
+		}
 	}
 
 	return tmp;
 }
 
 
-Common::String VM::opLog(const Common::Array<OpLog> &log) {
+Common::String VM::opLog(const MemAccess &mem, const Common::Array<OpLog> &log) {
 	Common::String tmp;
 
 	for (const OpLog &l : log) {
-		tmp += Common::String::format("%08x: SP:%04x OP:[%02d] ", l.addr, l.sp, l.op) + decodeOp(l.addr) + "\n";
+		tmp += Common::String::format("%08x: SP:%04x OP:[%02d] ", l.addr, l.sp, l.op) + decodeOp(mem, l.addr) + "\n";
 	}
 
 	Common::DumpFile f;
@@ -1037,8 +5146,8 @@ Common::String VM::opLog(const Common::Array<OpLog> &log) {
 	return tmp;
 }
 
-void VM::printDisassembly(uint32 address) {
-	Common::String tmp = disassembly(address);
+void VM::printDisassembly(const MemAccess &mem, uint32 address) {
+	Common::String tmp = disassembly(mem, address);
 	warning("%s", tmp.c_str());
 }
 
@@ -23,12 +23,14 @@
 
 #include "common/array.h"
 #include "common/hashmap.h"
+#include "common/str.h"
+#include "common/stream.h"
 
 namespace Gamos {
 
 class VM {
 public:
-    static constexpr const uint THREADS_COUNT = 2;
+    static constexpr const uint THREADS_COUNT = 2;  /* contexts allocated up front */
     static constexpr const uint STACK_SIZE = 0x100;
     static constexpr const uint STACK_POS = 0x80;
     static constexpr const uint MEMTYPE_SHIFT = 30;
@@ -119,61 +121,792 @@ public:
 
     typedef void (* CallDispatcher)(void *object, VM *state, uint32 funcID);
 
+    struct Runtime;
+
+    static constexpr const uint PAGE_SHIFT = 8;
+    static constexpr const uint PAGE_SIZE = 1 << PAGE_SHIFT;
+    static constexpr const uint PAGE_MASK = PAGE_SIZE - 1;
+    static constexpr const uint ARENA_CHUNK_PAGES = 256;
+
     struct MemoryBlock {
-        uint32 address = 0;
-        byte data[256];
+        byte data[PAGE_SIZE];
+        uint32 refs = 0;       /* live page table and snapshots holding this block */
 
         MemoryBlock() {
-            address = 0;
             memset(data, 0, sizeof(data));
         }
     };
 
+    struct MemAccess;
+
+    /* Copy-on-write image of VM memory. Taking it only copies page pointers,
+       blocks stay shared with live memory until one of the sides writes to
+       them. */
+    struct MemSnapshot {
+        MemAccess *_mem = nullptr;
+        Common::Array<MemoryBlock *> _pages;   /* nullptr for zero pages */
+        Common::HashMap<uint32, MemoryBlock *> _sparsePages;
+
+        /* nullptr for zero pages */
+        MemoryBlock *block(uint32 page) const;
+
+        MemSnapshot() {}
+        MemSnapshot(const MemSnapshot &) = delete;
+        MemSnapshot &operator=(const MemSnapshot &) = delete;
+
+        ~MemSnapshot() {
+            release();
+        }
+
+        inline bool empty() const {
+            return _mem == nullptr;
+        }
+
+        void release();
+
+        void read(byte *dst, uint32 address, uint32 count) const;
+
+        void save(Common::WriteStream *stream) const;
+        bool load(MemAccess *mem, Common::ReadStream *stream);
+    };
+
+    /* View of NUL terminated string in VM memory. Points right into memory
+       when string is within one page and maxLen, otherwise holds a copy.
+       Pointer stays valid until the memory is written. */
+    struct MemString {
+        const char *_data = "";
+        uint32 _size = 0;
+        bool _owned = false;
+        Common::String _copy;
+
+        inline const char *c_str() const {
+            return _owned ? _copy.c_str() : _data;
+        }
+
+        inline uint32 size() const {
+            return _size;
+        }
+
+        inline bool empty() const {
+            return _size == 0;
+        }
+
+        inline char operator[](uint32 i) const {
+            return c_str()[i];
+        }
+
+        inline bool contains(char c) const {
+            return memchr(c_str(), c, _size) != nullptr;
+        }
+
+        inline Common::String toString() const {
+            return _owned ? _copy : Common::String(_data, _size);
+        }
+
+        /* Take own copy, for when viewed memory is about to be written */
+        void own();
+
+        /* Views string at str, takes copy when it is longer than maxLen */
+        void set(const char *str, uint32 maxLen);
+    };
+
     struct OpLog {
         uint32 addr;
         OP op;
         uint32 sp;
     };
 
+    /* Flat page table over the VM address space. Page index is address >> PAGE_SHIFT,
+       pages that was never written point to shared zero block, so reads of them
+       give 0 without any lookup. Blocks are taken from arena chunks which are kept
+       between modules.
+       Writes go through _writePages, which is null for pages which need special
+       handling (not allocated yet, holding decoded code or watched bytes, shared
+       with snapshot or not yet marked dirty).
+       Table does not grow past _pageLimit, written pages beyond it are kept in
+       _sparsePages. They are never decoded as code and any write to them bumps
+       _watchGeneration. */
     struct MemAccess {
-        MemoryBlock *_currentBlock = nullptr;
+        enum PAGEFLAGS {
+            PAGE_CODE = 1,
+            PAGE_DIRTY = 2,    /* written since last clearDirty() */
+            PAGE_WATCH = 4
+        };
+
+        struct ArenaChunk {
+            MemoryBlock *blocks = nullptr;
+            uint32 count = 0;
+        };
+
+        /* bit per byte of page, used for code and watched bytes */
+        struct CodeMask {
+            uint32 bits[PAGE_SIZE / 32];
+
+            CodeMask() {
+                memset(bits, 0, sizeof(bits));
+            }
+        };
+
+        Common::Array<MemoryBlock *> _pages;
+        Common::Array<MemoryBlock *> _writePages;
+        Common::Array<uint8> _pageFlags;
+        Common::Array<uint32> _dirtyPages;
 
-        uint8 getU8(uint32 address);
-        uint32 getU32(uint32 address);
+        Common::HashMap<uint32, MemoryBlock *> _sparsePages;
+        uint32 _pageLimit = 0;      /* 0 when table may grow without limit */
 
-        void setU8(uint32 address, uint8 val);
-        void setU32(uint32 address, uint32 val);
+        Common::Array<ArenaChunk> _arena;
+        Common::Array<MemoryBlock *> _freeBlocks;
+        uint32 _blockAllocs = 0;    /* blocks handed out since start, arena or free list */
+
+        Common::HashMap<uint32, CodeMask> _codeMasks;
+        uint32 _codeGeneration = 0;
+
+        Common::HashMap<uint32, CodeMask> _watchMasks;
+        uint32 _watchGeneration = 0;
+
+        static MemoryBlock _zeroBlock;  /* shared by all runtimes, never written */
+
+        ~MemAccess();
+
+        inline uint8 getU8(uint32 address) const {
+            const uint32 page = address >> PAGE_SHIFT;
+            if (page >= _pages.size())
+                return sparseBlock(page)->data[address & PAGE_MASK];
+            return _pages[page]->data[address & PAGE_MASK];
+        }
+
+        inline uint32 getU32(uint32 address) const {
+            const uint32 page = address >> PAGE_SHIFT;
+            const uint32 pos = address & PAGE_MASK;
+            if (pos <= PAGE_SIZE - 4 && page < _pages.size())
+                return VM::getU32(_pages[page]->data + pos);
+            return getU32Split(address);
+        }
+
+        inline void setU8(uint32 address, uint8 val) {
+            const uint32 page = address >> PAGE_SHIFT;
+            if (page < _writePages.size() && _writePages[page])
+                _writePages[page]->data[address & PAGE_MASK] = val;
+            else
+                write(address, &val, 1);
+        }
+
+        inline void setU32(uint32 address, uint32 val) {
+            const uint32 page = address >> PAGE_SHIFT;
+            const uint32 pos = address & PAGE_MASK;
+            if (pos <= PAGE_SIZE - 4 && page < _writePages.size() && _writePages[page]) {
+                VM::setU32(_writePages[page]->data + pos, val);
+            } else {
+                byte tmp[4];
+                VM::setU32(tmp, val);
+                write(address, tmp, 4);
+            }
+        }
+
+        /* returns nullptr for pages that was never written */
+        inline const MemoryBlock *findMemoryBlock(uint32 address) const {
+            const uint32 page = address >> PAGE_SHIFT;
+            if (page >= _pages.size() || _pages[page] == &_zeroBlock)
+                return nullptr;
+            return _pages[page];
+        }
+
+        uint32 getU32Split(uint32 address) const;
+
+        /* block of page past table, _zeroBlock when it was never written */
+        const MemoryBlock *sparseBlock(uint32 page) const;
+
+        inline const MemoryBlock *pageBlock(uint32 page) const {
+            return page < _pages.size() ? _pages[page] : sparseBlock(page);
+        }
+
+        MemString getString(uint32 address, uint32 maxLen = 256) const;
+
+        MemoryBlock *createBlock(uint32 address);
+
+        void reserve(uint32 size);
+        void clear();
+
+        /* Table won't grow past size bytes, reset by clear() */
+        void setGrowthLimit(uint32 size);
+
+        void write(uint32 address, const byte *data, uint32 dataSize);
+        void read(byte *dst, uint32 address, uint32 count) const;
+        void zero(uint32 address, uint32 count);
+
+        /* Mark bytes as holding decoded code. Any later write into them bumps
+           _codeGeneration, so decoded copies of scripts can be dropped. */
+        void markCode(uint32 address, uint32 count);
+        void invalidateCode();
+
+        /* Any later write into watched bytes bumps _watchGeneration */
+        void markWatch(uint32 address, uint32 count);
+
+        inline bool isDirty(uint32 page) const {
+            return page < _pageFlags.size() && (_pageFlags[page] & PAGE_DIRTY);
+        }
+
+        /* Start new checkpoint, following writes will mark pages dirty again */
+        void clearDirty();
+
+        void takeSnapshot(MemSnapshot &snap);
+        void restoreSnapshot(const MemSnapshot &snap);
+
+        /* Like restoreSnapshot(), but decoded code and watches are only
+           dropped when restored bytes under them differ */
+        void rollback(const MemSnapshot &snap);
+
+        MemoryBlock *allocBlock();
+        void releaseBlock(MemoryBlock *blk);
+
+    private:
+        void growPages(uint32 pages);
+        bool growTo(uint32 page);
+        bool restore(const MemSnapshot &snap, bool checkWrites);
+        void checkRestore(uint32 page, const MemoryBlock *blk);
+        MemoryBlock *writeSparse(uint32 page);
+
+        void markDirty(uint32 page);
+        void checkCodeWrite(uint32 page, uint32 pos, uint32 count);
+        void checkWatchWrite(uint32 page, uint32 pos, uint32 count);
+
+        inline bool canWriteDirect(uint32 page) const {
+            return (_pageFlags[page] & (PAGE_CODE | PAGE_WATCH)) == 0;
+        }
+    };
+
+    /* Internal opcodes of pre-decoded scripts. Immediates are extracted at
+       decode time and pointer accesses are specialised by memory type when
+       register contents are known inside of basic block. */
+    enum IOP {
+        IOP_EXIT = 0,
+        IOP_CMP_EQ,
+        IOP_CMP_NE,
+        IOP_CMP_LE,
+        IOP_CMP_LEQ,
+        IOP_CMP_GR,
+        IOP_CMP_GREQ,
+        IOP_CMP_NAE,
+        IOP_CMP_NA,
+        IOP_CMP_A,
+        IOP_CMP_AE,
+        IOP_BRANCH,
+        IOP_JMP,
+        IOP_SP_ADD,
+        IOP_ST8_EDI,
+        IOP_ST8_EBX,
+        IOP_ST32_EDI,
+        IOP_ST32_EBX,
+        IOP_RET,
+        IOP_RETX,
+        IOP_MOV_EDX_EAX,
+        IOP_ADD_EAX_EDX,
+        IOP_MUL,
+        IOP_OR,
+        IOP_XOR,
+        IOP_AND,
+        IOP_NEG,
+        IOP_SAR,
+        IOP_SHL,
+        IOP_LOAD,
+        IOP_INC,
+        IOP_DEC,
+        IOP_XCHG,
+        IOP_PUSH_EAX,
+        IOP_POP_EDX,
+        IOP_LEA_EDI,
+        IOP_LEA_EBX,
+        IOP_LEA_STACK,
+        IOP_ST8_PTR,
+        IOP_ST8_PTR_STACK,
+        IOP_ST8_PTR_EBX,
+        IOP_ST8_PTR_EDI,
+        IOP_ST32_PTR,
+        IOP_ST32_PTR_STACK,
+        IOP_ST32_PTR_EBX,
+        IOP_ST32_PTR_EDI,
+        IOP_SHL_2,
+        IOP_ADD_4,
+        IOP_SUB_4,
+        IOP_XCHG_ESP,
+        IOP_NEG_ADD,
+        IOP_DIV,
+        IOP_LD8_EDI,
+        IOP_LD8_EBX,
+        IOP_LD32_EDI,
+        IOP_LD32_EBX,
+        IOP_LD8_PTR,
+        IOP_LD8_PTR_STACK,
+        IOP_LD8_PTR_EBX,
+        IOP_LD8_PTR_EDI,
+        IOP_LD32_PTR,
+        IOP_LD32_PTR_STACK,
+        IOP_LD32_PTR_EBX,
+        IOP_LD32_PTR_EDI,
+        IOP_CALL,
+        IOP_CALL_FUNC,
+        IOP_CALL_EDX,
+
+        /* superinstructions made by fuseInstr() from frequent sequences */
+        IOP_LD8_STACK,
+        IOP_LD32_STACK,
+        IOP_PUSH_LOAD,
+        IOP_PUSH_LOAD_POP,
+        IOP_PUSH_LD32_EBX,
+        IOP_PUSH_LD32_EBX_POP,
+        IOP_PUSH_LD32_EDI,
+        IOP_PUSH_LD32_EDI_POP,
+        IOP_MOV_EDX_LOAD,
+        IOP_MOV_EDX_LD32_EBX,
+        IOP_MOV_EDX_LD32_EDI,
+        /* EDX = EAX, EAX = imm and do op, imm2 set when EAX was pushed and poped */
+        IOP_BINI_CMP_EQ,
+        IOP_BINI_CMP_NE,
+        IOP_BINI_CMP_LE,
+        IOP_BINI_CMP_LEQ,
+        IOP_BINI_CMP_GR,
+        IOP_BINI_CMP_GREQ,
+        IOP_BINI_CMP_NAE,
+        IOP_BINI_CMP_NA,
+        IOP_BINI_CMP_A,
+        IOP_BINI_CMP_AE,
+        IOP_BINI_ADD,
+        IOP_BINI_MUL,
+        IOP_BINI_OR,
+        IOP_BINI_XOR,
+        IOP_BINI_AND,
+        IOP_BINI_SAR,
+        IOP_BINI_SHL,
+        IOP_BINI_NEG_ADD,
+
+        IOP_LOOP,              /* loop header, runs recognised idiom in bulk */
+
+        IOP_MAX
+    };
+
+    struct LoopIdiom;
+
+    struct Instr {
+        uint8 op = IOP_EXIT;
+        uint8 size = 1;        /* size of bytecode, for ESI resync */
+        uint16 ops = 1;        /* count of bytecode instructions covered */
+        uint32 addr = 0;       /* bytecode address */
+        uint32 imm = 0;
+        uint32 imm2 = 0;
+        union {
+            const Instr *target = nullptr;
+            LoopIdiom *loop;   /* IOP_LOOP */
+        };
+    };
+
+    /* Known memory types of registers and of values pushed inside of script,
+       REF_UNK means value is not known */
+    struct RegTypes {
+        static constexpr const uint STACK_DEPTH = 8;
+
+        uint8 eax = REF_UNK;
+        uint8 edx = REF_UNK;
+        uint8 stack[STACK_DEPTH];
+        uint8 depth = 0;
 
         void reset() {
-            _currentBlock = nullptr;
+            eax = REF_UNK;
+            edx = REF_UNK;
+            depth = 0;
         }
+
+        void push(uint tp) {
+            if (depth == STACK_DEPTH) {
+                memmove(stack, stack + 1, sizeof(stack) - sizeof(stack[0]));
+                depth--;
+            }
+            stack[depth++] = tp;
+        }
+
+        uint pop() {
+            if (!depth)
+                return REF_UNK;
+            return stack[--depth];
+        }
+
+        void update(byte op);
+        bool merge(const RegTypes &other);
     };
 
-public:
-    inline static MemAccess &memory() {
-        return _memAccess;
+    /* Basic block of script bytecode, made by analyzeScript() */
+    struct BasicBlock {
+        uint32 start = 0;
+        uint32 end = 0;            /* address after last instruction */
+        Common::Array<uint32> succs;
+        bool label = false;        /* entry, jump target or return site */
+        bool localOnly = true;     /* touches only REF_STACK and REF_EBX storage */
+        int32 maxDepth = 0;        /* bytes pushed below SP of block entry */
+        int32 entryDepth = 0;      /* stack use at entry, relative to script entry */
+        bool reached = false;
+        RegTypes entryTypes;
     };
 
-    static void clearMemory();
-    static void writeMemory(uint32 address, const byte* data, uint32 dataSize);
+    /* Control flow graph of one script, blocks are sorted by address */
+    struct ScriptCFG {
+        uint32 entry = 0;
+        Common::Array<BasicBlock> blocks;
+        Common::HashMap<uint32, uint32> blockIndex;
+        int32 maxStack = 0;
+        bool stackBounded = true;
+        bool localOnly = true;
+
+        const BasicBlock *findBlock(uint32 address) const {
+            Common::HashMap<uint32, uint32>::const_iterator it = blockIndex.find(address);
+            if (it == blockIndex.end())
+                return nullptr;
+            return &blocks[it->_value];
+        }
 
-    static void zeroMemory(uint32 address, uint32 count);
+        /* Index of block starting at address or -1 */
+        int32 indexOf(uint32 address) const {
+            Common::HashMap<uint32, uint32>::const_iterator it = blockIndex.find(address);
+            if (it == blockIndex.end())
+                return -1;
+            return it->_value;
+        }
+    };
 
-    static MemoryBlock *findMemoryBlock(uint32 address);
+    static bool analyzeScript(const MemAccess &mem, uint32 address, ScriptCFG &cfg);
 
-    static MemoryBlock *createBlock(uint32 address);
+    /* Bytes read by script at fixed address, memtype is REF_EDI or REF_EBX */
+    struct MemRange {
+        uint8 memtype = REF_UNK;
+        uint8 size = 0;
+        uint32 offset = 0;
+    };
 
-    static Common::Array<byte> readMemBlocks(uint32 address, uint32 count);
-    static void readMemBlocks(byte *dst, uint32 address, uint32 count);
+    /* Script which doesn't write memory or call anything, so its result
+       depends only on listed inputs */
+    struct PureScript {
+        Common::Array<MemRange> inputs;
+    };
+
+    static bool analyzePurity(const MemAccess &mem, const ScriptCFG &cfg, PureScript &info);
+
+    /* Expression over state at start of loop iteration. Nodes are made in
+       order of bytecode, operands always come before their users. */
+    struct LoopNode {
+        enum KIND {
+            N_CONST,
+            N_SP,              /* SP at loop header */
+            N_VAR,             /* value is var index */
+            N_OP,              /* OP_* applied to a (EDX) and b (EAX) */
+            N_ADDR,            /* address of memtype op at offset a */
+            N_SEXT8,           /* low byte of a sign extended */
+            N_LOAD8,
+            N_LOAD32
+        };
+
+        uint8 kind = N_CONST;
+        uint8 op = 0;
+        uint16 a = 0;
+        uint16 b = 0;
+        uint32 value = 0;
+    };
+
+    /* 32 bit location read before written in iteration, changed by step
+       on each iteration. Stack offsets are relative to SP at header. */
+    struct LoopVar {
+        uint8 memtype = REF_UNK;
+        int32 offset = 0;
+        int32 step = 0;
+    };
+
+    /* Access through var + offset, or fixed location when var is -1 */
+    struct LoopAccess {
+        int32 var = -1;
+        uint8 memtype = REF_UNK;
+        int32 offset = 0;
+        uint8 size = 0;
+        bool write = false;
+        uint16 node = 0;       /* loaded or stored value */
+    };
+
+    struct LoopExit {
+        uint16 node = 0;
+        uint16 end = 0;        /* nodes made before branch */
+        bool continueOnZero = false;
+    };
+
+    /* Single path loop whose iteration only depends on memory, see
+       analyzeLoop() */
+    struct LoopIdiom {
+        static constexpr const uint MAX_NODES = 512;
+        static constexpr const uint MAX_VARS = 8;
+
+        enum KIND {
+            COPY,
+            FILL,
+            LENGTH,
+            COMPARE
+        };
+
+        uint8 kind = COPY;
+        uint32 header = 0;
+        uint32 ops = 0;        /* bytecode instructions in iteration */
+        Common::Array<LoopNode> nodes;
+        Common::Array<LoopVar> vars;
+        Common::Array<LoopExit> exits;
+        Common::Array<LoopAccess> loads;    /* through induction vars */
+        Common::Array<LoopAccess> fixed;    /* other locations touched */
+        LoopAccess store;                   /* size 0 when none */
+        int32 copyFrom = -1;                /* load copied by COPY */
+
+        uint32 hits = 0;
+        uint64 iterations = 0;
+    };
+
+    static bool analyzeLoop(const MemAccess &mem, const ScriptCFG &cfg, uint32 header, LoopIdiom &loop);
+    static const char *loopKindName(uint kind);
+
+    struct MemoKeyHash {
+        uint operator()(const Common::Array<byte> &key) const;
+    };
+
+    /* Results of one condition script keyed by bytes of its EBX inputs */
+    struct MemoEntry {
+        bool analyzed = false;
+        bool pure = false;
+        uint32 codeGeneration = 0;
+        Common::Array<MemRange> ebxInputs;
+
+        uint32 epoch = 0;
+        uint32 watchGeneration = 0;
+        Common::HashMap<Common::Array<byte>, uint32, MemoKeyHash> results;
+
+        uint32 hits = 0;
+        uint32 misses = 0;
+    };
+
+    /* Memoised results of pure condition scripts. VM memory inputs are
+       watched and any write into them drops stored results, object storage
+       inputs are part of the key. Results are kept for one frame only. */
+    struct ConditionMemo {
+        bool _enabled = true;
+        uint32 _epoch = 0;
+        Common::HashMap<uint32, MemoEntry> _scripts;
+
+        uint32 _hits = 0;
+        uint32 _misses = 0;
+        uint32 _uncached = 0;     /* calls of impure scripts */
+        uint32 _invalidations = 0;
+
+        void beginFrame() {
+            _epoch++;
+        }
 
-    static Common::String readMemString(uint32 address, uint32 maxLen = 256);
+        void reset() {
+            _scripts.clear();
+            _hits = 0;
+            _misses = 0;
+            _uncached = 0;
+            _invalidations = 0;
+        }
+    };
+
+    /* Decoded scripts. Regions are never moved after decoding, so running
+       code can hold pointers into them. When code memory is overwritten all
+       regions are dropped, the ones which may be in use are freed when last
+       execute() returns. */
+    struct CodeCache {
+        typedef Common::Array<Instr> Region;
+
+        MemAccess &_mem;
+        Common::HashMap<uint32, const Instr *> _entries;
+        Common::Array<Region *> _regions;
+        Common::Array<Region *> _retired;
+        Common::Array<LoopIdiom *> _loops;
+        Common::Array<LoopIdiom *> _retiredLoops;
+        uint32 _generation = 0;
+        uint32 _active = 0;
+        uint32 _heapAllocs = 0;     /* regions and loop idioms allocated since start */
+
+        /* per module statistics of decoder, opcode pairs are counted inside of basic blocks */
+        uint32 _pairCounts[OP_MAX][OP_MAX];
+        uint32 _decodedCount = 0;
+        uint32 _fusedCount = 0;
+        uint32 _blockCount = 0;
+        uint32 _localBlockCount = 0;
+
+        explicit CodeCache(MemAccess &mem) : _mem(mem) {
+            resetStats();
+        }
+
+        ~CodeCache();
+
+        const Instr *get(uint32 address);
+
+        void flush();
+        void freeRetired();
+        void resetStats();
+
+    private:
+        const Instr *decode(uint32 address);
+
+        static uint16 fuseInstr(const Instr &a, const Instr &b);
+    };
+
+public:
+    explicit VM(Runtime &runtime);
 
     Common::String getString(int memtype, uint32 offset, uint32 maxLen = 256);
     Common::String getString(const ValAddr &addr, uint32 maxLen = 256);
 
+    MemString viewString(int memtype, uint32 offset, uint32 maxLen = 256);
+    MemString viewString(const ValAddr &addr, uint32 maxLen = 256);
+
     uint32 execute(uint32 scriptAddress, byte *storage = nullptr);
 
-    static uint32 doScript(uint32 scriptAddress, byte *storage = nullptr);
+    /* Helpers for translated scripts */
+    bool callFunc(uint32 funcID, uint32 next);
+    uint32 fallback(uint32 address);
+
+    /* Execution contexts for nested doScript calls. Scripts nest strictly,
+       so the pool is a stack indexed by the current depth and only grows
+       when a new maximum depth is reached. */
+    struct ContextPool {
+        Runtime &_runtime;
+        Common::Array<VM *> _contexts;
+        uint _depth = 0;
+        uint _maxDepth = 0;
+
+        explicit ContextPool(Runtime &runtime);
+        ~ContextPool();
+
+        VM *acquire();
+        void release() {
+            _depth--;
+        }
+    };
+
+    struct ScriptProfile {
+        uint32 calls = 0;
+        uint64 instructions = 0;
+        uint32 time = 0;       /* ms including nested scripts */
+    };
+
+    /* Optional execution profiler. Time is measured with getMillis, so value
+       for one call is 0 or 1, but sums over many calls are close to real. */
+    struct Profiler {
+        bool _enabled = false;
+        Common::HashMap<uint32, ScriptProfile> _scripts;
+        uint64 _opCounts[IOP_MAX];
+
+        Profiler() {
+            reset();
+        }
+
+        void reset() {
+            _scripts.clear();
+            memset(_opCounts, 0, sizeof(_opCounts));
+        }
+    };
+
+    /* Script translated to C++ by translateScript(), works on same context
+       state as bytecode and returns EAX. Entry is address script was bound
+       at, code addresses are relative to it. */
+    typedef uint32 (* NativeScript)(VM *vm, uint32 entry);
+
+    struct NativeEntry {
+        uint32 hash;           /* hashScript() of translated bytecode */
+        uint32 size;           /* bytes of bytecode covered */
+        const byte *code;      /* bytes of blocks in address order, size long */
+        NativeScript func;
+        const char *name;      /* label for vm_natives, may be nullptr */
+    };
+
+    /* Translated scripts shipped with engine, ends with null func */
+    static const NativeEntry _nativeScripts[];
+
+    struct NativeInfo {
+        const NativeEntry *entry = nullptr;
+        uint32 calls = 0;
+        uint32 checked = 0;        /* calls compared with bytecode */
+        uint32 mismatches = 0;
+    };
+
+    /* Binds script addresses to natives with matching code hash, binding is
+       redone after code memory is overwritten */
+    struct NativeRegistry {
+        MemAccess &_mem;
+        bool _enabled = true;
+        bool _validate = false;    /* also run bytecode and compare effects */
+        Common::Array<NativeInfo> _natives;        /* filled once, never resized */
+        Common::HashMap<uint32, uint32> _byHash;   /* index in _natives */
+        Common::HashMap<uint32, NativeInfo *> _bound;   /* nullptr when no native matched */
+        uint32 _generation = 0;
+
+        explicit NativeRegistry(MemAccess &mem);
+
+        NativeInfo *lookup(uint32 address);
+        void resetStats();
+
+    private:
+        bool matches(const NativeEntry &entry, const ScriptCFG &cfg, uint32 size) const;
+    };
+
+    /* Hash of reachable code, position independent */
+    static uint32 hashScript(const MemAccess &mem, const ScriptCFG &cfg, uint32 *size = nullptr);
+
+    /* Emit C++ function equivalent to script, fails for scripts with
+       subroutine calls */
+    static bool translateScript(const MemAccess &mem, uint32 address, Common::String &out, NativeEntry &entry);
+
+    /* VM state of one engine instance: memory, decoded code and execution
+       contexts. Contexts reference it, so separate instances don't share
+       anything and can run in different threads. */
+    struct Runtime {
+        CallDispatcher _callFuncs = nullptr;
+        void *_callingObject = nullptr;
+
+        bool _interrupt = false;
+
+        MemAccess _memAccess;
+        CodeCache _codeCache;
+        ContextPool _threads;
+        Profiler _profiler;
+        ConditionMemo _conditionMemo;
+        NativeRegistry _natives;
+
+        Runtime() : _codeCache(_memAccess), _threads(*this), _natives(_memAccess) {}
+        Runtime(const Runtime &) = delete;
+        Runtime &operator=(const Runtime &) = delete;
+
+        inline MemAccess &memory() {
+            return _memAccess;
+        };
+
+        inline const MemAccess &memory() const {
+            return _memAccess;
+        };
+
+        void clearMemory();
+        void writeMemory(uint32 address, const byte* data, uint32 dataSize);
+
+        void zeroMemory(uint32 address, uint32 count);
+
+        Common::Array<byte> readMemBlocks(uint32 address, uint32 count) const;
+        void readMemBlocks(byte *dst, uint32 address, uint32 count) const;
+
+        Common::String readMemString(uint32 address, uint32 maxLen = 256) const;
+
+        void decodeScript(uint32 scriptAddress);
+
+        uint32 doScript(uint32 scriptAddress, byte *storage = nullptr);
+
+        /* doScript for condition scripts, takes result from memo when possible */
+        uint32 doCondition(uint32 scriptAddress, byte *storage = nullptr);
+
+        Common::String disassembly(uint32 address) const {
+            return VM::disassembly(_memAccess, address);
+        }
+    };
 
     static int32 getS32(const void *);
     static uint32 getU32(const void *);
@@ -195,17 +928,41 @@ public:
     void setMem8(int memtype, uint32 offset, uint8 val);
     void setMem8(const ValAddr& addr, uint8 val);
 
-    static Common::String decodeOp(uint32 address, int *size = nullptr);
-    static Common::String disassembly(uint32 address);
+    static const char *opName(uint op);
+    static const char *iopName(uint op);
 
-    static Common::String opLog(const Common::Array<OpLog> &log);
+    static Common::String decodeOp(const MemAccess &mem, uint32 address, int *size = nullptr);
+    static Common::String disassembly(const MemAccess &mem, uint32 address);
 
-    static void printDisassembly(uint32 address);
+    static Common::String opLog(const MemAccess &mem, const Common::Array<OpLog> &log);
+
+    static void printDisassembly(const MemAccess &mem, uint32 address);
+
+    /* Compares decoded code with interpreter on built in scripts, returns
+       number of scripts where they disagree */
+    static uint selfTest();
 
 private:
+    template<bool PROFILE>
+    uint32 run(const Instr *ip);
+
+    template<bool PROFILE>
+    uint32 interpret();
+
+    /* Runs script at ESI, decoded when it can be */
+    uint32 runBytecode();
+
+    inline void countOp(const Instr *ip);
+
+    uint32 validateNative(NativeInfo &native, uint32 scriptAddress);
+    static bool selfTestScript(const char *name, const byte *code, uint32 size);
+
+    uint32 runLoop(LoopIdiom &loop);
+    void evalLoopNodes(const LoopIdiom &loop, const uint32 *vars, uint32 *values, uint from, uint to, bool &fault);
 
 public:
-    bool _inUse = false;
+    Runtime &_runtime;
+    MemAccess &_mem;       /* memory of _runtime, used by every instruction */
 
     uint32 ESI = 0;
     byte *EBX = nullptr;
@@ -216,19 +973,12 @@ public:
     byte _stack[STACK_SIZE];
     byte _stackT[STACK_SIZE];
 
-private:
-    MemAccess _readAccess;
-    MemAccess _writeAccess;
-
-public:
-    static CallDispatcher _callFuncs;
-    static void *_callingObject;
+    uint32 _profInstructions = 0;
 
-    static Common::HashMap<uint32, MemoryBlock> _memMap;
-    static bool _interrupt;
 
-    static VM _threads[THREADS_COUNT];
-    static MemAccess _memAccess;
+    /* loop which was not run in bulk, checked again after these visits */
+    const LoopIdiom *_skipLoop = nullptr;
+    uint32 _skipCount = 0;
 };
 
 
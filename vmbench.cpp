@@ -0,0 +1,169 @@
+/* ScummVM - Graphic Adventure Engine
+ *
+ * ScummVM is the legal property of its developers, whose names
+ * are too numerous to list here. Please refer to the COPYRIGHT
+ * file distributed with this source distribution.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "gamos/gamos.h"
+
+#include "common/system.h"
+
+namespace Gamos {
+
+/* VM benchmark: every onCreate, condition and function script of a module is
+   run against dispatcher which only pops builtin arguments, so nothing but
+   the VM is measured. Started with vm_bench config key (passes) for every
+   module of the game or with vm_bench console command for loaded one. */
+
+enum {
+	/* builtins all return 0 here, so script waiting for one to change
+	   would never end */
+	BENCH_MAX_CALLS = 100000
+};
+
+void GamosEngine::callbackVMBenchDispatcher(void *engine, VM *vm, uint32 funcID) {
+	GamosEngine *gamos = (GamosEngine *)engine;
+	if (funcID < VMCALL_COUNT)
+		vm->SP += _vmCalls[funcID].args * 4;
+
+	vm->EAX.setVal(0);
+
+	gamos->_benchCalls++;
+	if (gamos->_benchCalls >= BENCH_MAX_CALLS)
+		gamos->_vm._interrupt = true;
+}
+
+void GamosEngine::benchmarkPass(const Common::Array<uint32> &scripts, VMBenchStats &st) {
+	byte storage[0x100];
+
+	for (uint32 address : scripts) {
+		memset(storage, 0, sizeof(storage));
+		_benchCalls = 0;
+
+		_vm.doScript(address, storage);
+
+		if (_vm._interrupt) {
+			_vm._interrupt = false;
+			st.aborted++;
+		}
+		st.runs++;
+	}
+}
+
+void GamosEngine::benchmarkScripts(uint passes, VMBenchStats &st) {
+	Common::HashMap<uint32, bool> seen;
+	Common::Array<uint32> scripts;
+
+	for (const ObjectAction &obj : _objectActions) {
+		Common::Array<int32> addrs;
+		addrs.push_back(obj.onCreateAddress);
+		for (const Actions &act : obj.actions) {
+			addrs.push_back(act.conditionAddress);
+			addrs.push_back(act.functionAddress);
+		}
+
+		for (int32 address : addrs) {
+			if (address < 0 || seen.contains(address))
+				continue;
+			seen[address] = true;
+			scripts.push_back(address);
+		}
+	}
+
+	st.scripts = scripts.size();
+
+	const VM::CallDispatcher callFuncs = _vm._callFuncs;
+	const VM::Profiler profiler = _vm._profiler;
+
+	_vm._callFuncs = callbackVMBenchDispatcher;
+	_vm._interrupt = false;
+
+	/* Warm up pass decodes scripts and counts instructions with profiler,
+	   timed passes run without it */
+	VMBenchStats warmup;
+	_vm._profiler.reset();
+	_vm._profiler._enabled = true;
+	benchmarkPass(scripts, warmup);
+
+	uint64 instructions = 0;
+	for (Common::HashMap<uint32, VM::ScriptProfile>::const_iterator it = _vm._profiler._scripts.begin(); it != _vm._profiler._scripts.end(); ++it)
+		instructions += it->_value.instructions;
+
+	_vm._profiler = profiler;
+
+	const uint32 blocks = _vm.memory()._blockAllocs;
+	const uint32 chunks = _vm.memory()._arena.size();
+	const uint32 code = _vm._codeCache._heapAllocs;
+	const uint32 startTime = _system->getMillis();
+
+	for (uint i = 0; i < passes; i++)
+		benchmarkPass(scripts, st);
+
+	st.runTime = _system->getMillis() - startTime;
+	st.instructions = instructions * passes;
+	st.blockAllocs = _vm.memory()._blockAllocs - blocks;
+	st.arenaAllocs = _vm.memory()._arena.size() - chunks;
+	st.codeAllocs = _vm._codeCache._heapAllocs - code;
+
+	_vm._callFuncs = callFuncs;
+}
+
+const char *GamosEngine::benchHeader() {
+	return "module scripts     runs aborted   Minstr/s  ns/script  load ms  blocks  arena  code";
+}
+
+Common::String GamosEngine::formatBenchStats(const VMBenchStats &st) {
+	const uint32 time = MAX<uint32>(st.runTime, 1);
+	const uint64 perScript = st.runs ? (uint64)st.runTime * 1000000 / st.runs : 0;
+
+	return Common::String::format("%6d %7u %8u %7u %10.2f %10u %8u %7u %6u %5u",
+	                              st.module, st.scripts, st.runs, st.aborted,
+	                              (double)st.instructions / time / 1000.0, (uint32)perScript,
+	                              st.loadTime, st.blockAllocs, st.arenaAllocs, st.codeAllocs);
+}
+
+Common::Error GamosEngine::runVMBenchmark(uint passes) {
+	if (!openArchive(getRunFile()))
+		return Common::kNoGameDataFoundError;
+
+	/* load module data only, no state file and no game screen */
+	BYTE_004177f7 = 1;
+	_runReadDataMod = true;
+
+	_system->logMessage(LogMessageType::kInfo, Common::String::format("VM benchmark, %u passes\n%s\n", passes, benchHeader()).c_str());
+
+	for (uint id = 0; _arch.findDirByID(2 + id) != -1; id++) {
+		VMBenchStats st;
+		st.module = id;
+
+		const uint32 startTime = _system->getMillis();
+		if (!loadModule(id)) {
+			warning("VM benchmark: can't load module %u", id);
+			continue;
+		}
+		st.loadTime = _system->getMillis() - startTime;
+
+		benchmarkScripts(passes, st);
+
+		_system->logMessage(LogMessageType::kInfo, (formatBenchStats(st) + "\n").c_str());
+	}
+
+	return Common::kNoError;
+}
+
+} // End of namespace Gamos